@@ -23,6 +23,34 @@ int main(int argc, const char * argv[]) {
         return -1;
     }
     
+    // options following the scene file:
+    // --checkpoint <path>: periodically stores the progress of the render into the file.
+    // --checkpoint-interval <seconds>: interval between checkpoints, 600 seconds by default.
+    // --resume: continues from the checkpoint file if it exists.
+    std::string checkpointPath;
+    float checkpointInterval = 600.0f;
+    bool resume = false;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpointPath = argv[++i];
+        }
+        else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            checkpointInterval = (float)std::atof(argv[++i]);
+        }
+        else if (arg == "--resume") {
+            resume = true;
+        }
+        else {
+            fprintf(stderr, "Unknown command line argument: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (resume && checkpointPath.empty()) {
+        fprintf(stderr, "--resume requires --checkpoint <path>.\n");
+        return -1;
+    }
+    
     using namespace std::chrono;
     SLR::initSpectrum();
     
@@ -42,12 +70,6 @@ int main(int argc, const char * argv[]) {
     }
     printf("read scene: %g [s]\n", stopwatch.stop() * 1e-3f);
     
-    stopwatch.start();
-    const SLR::Scene* rawScene;
-    SLR::ArenaAllocator mem;
-    scene->build(&rawScene, mem);
-    printf("build scene: %g [s]\n", stopwatch.stop() * 1e-3f);
-    
     SLR::RenderSettings settings;
     settings.addItem(SLR::RenderSettingItem::ImageWidth, context.width);
     settings.addItem(SLR::RenderSettingItem::ImageHeight, context.height);
@@ -55,6 +77,22 @@ int main(int argc, const char * argv[]) {
     settings.addItem(SLR::RenderSettingItem::TimeEnd, context.timeEnd);
     settings.addItem(SLR::RenderSettingItem::Brightness, context.brightness);
     settings.addItem(SLR::RenderSettingItem::RNGSeed, context.rngSeed);
+    settings.addItem(SLR::RenderSettingItem::TopLevelAccelerator, (int32_t)context.topLevelAccelerator);
+    settings.addItem(SLR::RenderSettingItem::InstanceAccelerator, (int32_t)context.instanceAccelerator);
+    settings.addItem(SLR::RenderSettingItem::AcceleratorCacheDirectory, context.acceleratorCacheDirectory);
+    settings.addItem(SLR::RenderSettingItem::CompactVertices, context.compactVertices);
+    settings.addItem(SLR::RenderSettingItem::CheckpointPath, checkpointPath);
+    settings.addItem(SLR::RenderSettingItem::CheckpointInterval, checkpointInterval);
+    settings.addItem(SLR::RenderSettingItem::Resume, resume);
+    
+    stopwatch.start();
+    const SLR::Scene* rawScene;
+    SLR::ArenaAllocator mem;
+    if (!scene->build(&rawScene, settings, mem)) {
+        printf("Failed to build the scene.\n");
+        exit(-1);
+    }
+    printf("build scene: %g [s]\n", stopwatch.stop() * 1e-3f);
     
     context.renderer->render(*rawScene, settings);
     
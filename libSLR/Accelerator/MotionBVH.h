@@ -0,0 +1,313 @@
+//
+//  MotionBVH.h
+//
+//  Created by 渡部 心 on 2016/09/11.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#ifndef MotionBVH_h
+#define MotionBVH_h
+
+#include "../defines.h"
+#include "../references.h"
+#include "../Core/Accelerator.h"
+
+namespace SLR {
+    // BVH whose nodes have bounds for each of the segments the time interval is divided into.
+    // A ray tests only the bounds of the segment containing its time,
+    // so a moving object does not inflate the nodes over the whole interval.
+    class SLR_API MotionBVH : public Accelerator {
+        struct Node {
+            uint32_t c0, c1;
+            uint32_t offsetFirstLeaf;
+            uint32_t numLeaves;
+            BoundingBox3D::Axis axis;
+            
+            Node() : c0(0), c1(0), offsetFirstLeaf(0), numLeaves(0) { };
+            
+            void initAsLeaf(uint32_t offset, uint32_t numLs) {
+                c0 = c1 = 0;
+                offsetFirstLeaf = offset;
+                numLeaves = numLs;
+            };
+            void initAsInternal(uint32_t cIdx0, uint32_t cIdx1, BoundingBox3D::Axis ax) {
+                c0 = cIdx0;
+                c1 = cIdx1;
+                axis = ax;
+                offsetFirstLeaf = numLeaves = 0;
+            };
+        };
+        
+        struct ObjInfos {
+            const std::vector<SurfaceObject*>* objs;
+            std::vector<BoundingBox3D> segmentBounds;
+            std::vector<Point3D> centroids;
+            std::vector<float> costs;
+            std::vector<uint32_t> indices;
+        };
+        
+        uint32_t m_numSegments;
+        float m_timeBegin;
+        float m_timeEnd;
+        uint32_t m_depth;
+        float m_cost;
+        BoundingBox3D m_bounds;
+        std::vector<Node> m_nodes;
+        // m_numSegments bounds for each node.
+        std::vector<BoundingBox3D> m_segmentBounds;
+        std::vector<const SurfaceObject*> m_objLists;
+        
+        // A node at the maximum depth becomes a leaf, then the traversal stack never holds more than MaxDepth entries.
+        static const uint32_t StackSize = 64;
+        static const uint32_t MaxDepth = StackSize;
+        
+        uint32_t segmentIndex(float time) const {
+            float t = (time - m_timeBegin) / (m_timeEnd - m_timeBegin);
+            if (!(t > 0.0f))
+                return 0;
+            return std::min((uint32_t)(t * m_numSegments), m_numSegments - 1);
+        }
+        
+        float averageSurfaceArea(const BoundingBox3D* segmentBounds) const {
+            float sum = 0.0f;
+            for (int s = 0; s < m_numSegments; ++s)
+                sum += segmentBounds[s].surfaceArea();
+            return sum / m_numSegments;
+        }
+        
+        uint32_t buildRecursive(ObjInfos &infos, uint32_t start, uint32_t end, uint32_t depth) {
+            auto &indices = infos.indices;
+            auto &centroids = infos.centroids;
+            const uint32_t numSegments = m_numSegments;
+            
+            uint32_t nodeIdx = (uint32_t)m_nodes.size();
+            m_nodes.emplace_back();
+            m_segmentBounds.resize(m_segmentBounds.size() + numSegments);
+            
+            if (++depth > m_depth)
+                m_depth = depth;
+            
+            std::vector<BoundingBox3D> bboxes(numSegments);
+            BoundingBox3D centroidBB;
+            float leafNodeCost = 0.0f;
+            for (uint32_t i = start; i < end; ++i) {
+                uint32_t idx = indices[i];
+                for (int s = 0; s < numSegments; ++s)
+                    bboxes[s].unify(infos.segmentBounds[numSegments * idx + s]);
+                centroidBB.unify(centroids[idx]);
+                leafNodeCost += infos.costs[idx];
+            }
+            std::copy(bboxes.begin(), bboxes.end(), m_segmentBounds.begin() + numSegments * nodeIdx);
+            BoundingBox3D::Axis widestAxis = centroidBB.widestAxis();
+            const float pcBBMin = centroidBB.minP[widestAxis];
+            const float pcBBMax = centroidBB.maxP[widestAxis];
+            
+            uint32_t numObjs = end - start;
+            SLRAssert(numObjs >= 1, "Number of objects is zero.");
+            
+            if (numObjs == 1 || depth >= MaxDepth) {
+                m_nodes[nodeIdx].initAsLeaf((uint32_t)m_objLists.size(), numObjs);
+                for (uint32_t i = start; i < end; ++i)
+                    m_objLists.push_back(infos.objs->at(indices[i]));
+                return nodeIdx;
+            }
+            
+            uint32_t splitIdx;
+            if ((pcBBMax - pcBBMin) <= 0) {
+                // partitions so that the numbers of children of both side become the same.
+                splitIdx = (start + end) / 2;
+                std::nth_element(indices.begin() + start, indices.begin() + splitIdx, indices.begin() + end, [&centroids, &widestAxis](uint32_t idx0, uint32_t idx1) {
+                    return centroids[idx0][widestAxis] < centroids[idx1][widestAxis];
+                });
+            }
+            else {
+                const float travCost = 1.2f;
+                const uint32_t numBins = 16;
+                std::vector<BoundingBox3D> binBounds(numBins * numSegments);
+                float binCosts[numBins] = {};
+                
+                for (uint32_t i = start; i < end; ++i) {
+                    uint32_t idx = indices[i];
+                    uint32_t bin = numBins * ((centroids[idx][widestAxis] - pcBBMin) / (pcBBMax - pcBBMin));
+                    bin = std::min(bin, numBins - 1);
+                    binCosts[bin] += infos.costs[idx];
+                    for (int s = 0; s < numSegments; ++s)
+                        binBounds[numSegments * bin + s].unify(infos.segmentBounds[numSegments * idx + s]);
+                }
+                
+                // evaluate SAH cost averaged over the segments for every pair of child partitions.
+                uint32_t splitPlane = 0;
+                float minCost = INFINITY;
+                float surfaceAreaParent = averageSurfaceArea(bboxes.data());
+                std::vector<BoundingBox3D> b0(numSegments), b1(numSegments);
+                for (uint32_t i = 0; i < numBins - 1; ++i) {
+                    float cost0 = 0.0f, cost1 = 0.0f;
+                    std::fill(b0.begin(), b0.end(), BoundingBox3D());
+                    std::fill(b1.begin(), b1.end(), BoundingBox3D());
+                    for (int j = 0; j <= i; ++j) {
+                        for (int s = 0; s < numSegments; ++s)
+                            b0[s].unify(binBounds[numSegments * j + s]);
+                        cost0 += binCosts[j];
+                    }
+                    for (int j = i + 1; j < numBins; ++j) {
+                        for (int s = 0; s < numSegments; ++s)
+                            b1[s].unify(binBounds[numSegments * j + s]);
+                        cost1 += binCosts[j];
+                    }
+                    if (cost0 == 0.0f || cost1 == 0.0f)
+                        continue;
+                    float cost = travCost + (averageSurfaceArea(b0.data()) * cost0 + averageSurfaceArea(b1.data()) * cost1) / surfaceAreaParent;
+                    if (cost < minCost) {
+                        minCost = cost;
+                        splitPlane = i;
+                    }
+                }
+                
+                if (minCost >= leafNodeCost) {
+                    m_nodes[nodeIdx].initAsLeaf((uint32_t)m_objLists.size(), numObjs);
+                    for (uint32_t i = start; i < end; ++i)
+                        m_objLists.push_back(infos.objs->at(indices[i]));
+                    return nodeIdx;
+                }
+                
+                float pivot = pcBBMin + (pcBBMax - pcBBMin) / numBins * (splitPlane + 1);
+                auto firstOf2ndGroup = std::partition(indices.begin() + start, indices.begin() + end, [&centroids, &widestAxis, &pivot](uint32_t idx) {
+                    return centroids[idx][widestAxis] < pivot;
+                });
+                splitIdx = std::max((uint32_t)std::distance(indices.begin() + start, firstOf2ndGroup), 1u) + start;
+            }
+            
+            uint32_t c0 = buildRecursive(infos, start, splitIdx, depth);
+            uint32_t c1 = buildRecursive(infos, splitIdx, end, depth);
+            m_nodes[nodeIdx].initAsInternal(c0, c1, widestAxis);
+            return nodeIdx;
+        }
+        
+        float calcSAHCost() const {
+            const float Ci = 1.2f;
+            float costInt = 0.0f;
+            float costObj = 0.0f;
+            for (int i = 0; i < m_nodes.size(); ++i) {
+                const Node &node = m_nodes[i];
+                float surfaceArea = averageSurfaceArea(&m_segmentBounds[m_numSegments * i]);
+                if (node.numLeaves == 0) {
+                    costInt += surfaceArea;
+                }
+                else {
+                    float costPrims = 0.0f;
+                    for (uint32_t j = 0; j < node.numLeaves; ++j)
+                        costPrims += m_objLists[node.offsetFirstLeaf + j]->costForIntersect();
+                    costObj += surfaceArea * costPrims;
+                }
+            }
+            float rootSA = averageSurfaceArea(&m_segmentBounds[0]);
+            costInt *= Ci / rootSA;
+            costObj /= rootSA;
+            
+            return costInt + costObj;
+        }
+    
+    public:
+        MotionBVH(const std::vector<SurfaceObject*> &objs, float timeBegin, float timeEnd, uint32_t numSegments = 4) :
+        m_numSegments(numSegments), m_timeBegin(timeBegin), m_timeEnd(timeEnd) {
+            SLRAssert(timeEnd > timeBegin, "MotionBVH requires a non-empty time interval.");
+            ObjInfos infos;
+            infos.objs = &objs;
+            infos.segmentBounds.resize(numSegments * objs.size());
+            infos.centroids.resize(objs.size());
+            infos.costs.resize(objs.size());
+            infos.indices.resize(objs.size());
+            for (int i = 0; i < objs.size(); ++i) {
+                BoundingBox3D centroidBB;
+                for (int s = 0; s < numSegments; ++s) {
+                    float segBegin = timeBegin + (timeEnd - timeBegin) * s / numSegments;
+                    float segEnd = timeBegin + (timeEnd - timeBegin) * (s + 1) / numSegments;
+                    BoundingBox3D bb = objs[i]->motionBounds(segBegin, segEnd);
+                    infos.segmentBounds[numSegments * i + s] = bb;
+                    centroidBB.unify(bb.centroid());
+                    m_bounds.unify(bb);
+                }
+                infos.centroids[i] = centroidBB.centroid();
+                infos.costs[i] = objs[i]->costForIntersect();
+                infos.indices[i] = i;
+            }
+            
+            m_depth = 0;
+            buildRecursive(infos, 0, (uint32_t)objs.size(), 0);
+            m_cost = calcSAHCost();
+#ifdef DEBUG
+            printf("depth: %u, cost: %g\n", m_depth, m_cost);
+#endif
+        }
+        
+        float costForIntersect() const override {
+            return m_cost;
+        }
+        
+        // The bounds cover only the time interval given at construction.
+        BoundingBox3D bounds() const override {
+            return m_bounds;
+        }
+        
+        bool intersect(Ray &ray, Intersection* isect) const override {
+            uint32_t objDepth = (uint32_t)isect->obj.size();
+            bool dirIsPositive[] = {ray.dir.x >= 0, ray.dir.y >= 0, ray.dir.z >= 0};
+            uint32_t segment = segmentIndex(ray.time);
+            
+            uint32_t idxStack[StackSize];
+            uint32_t depth = 0;
+            idxStack[depth++] = 0;
+            while (depth > 0) {
+                uint32_t nodeIdx = idxStack[--depth];
+                const Node &node = m_nodes[nodeIdx];
+                if (!m_segmentBounds[m_numSegments * nodeIdx + segment].intersect(ray))
+                    continue;
+                if (node.numLeaves == 0) {
+                    SLRRequire(depth + 2 <= StackSize, "MotionBVH::intersect: stack overflow");
+                    bool positiveDir = dirIsPositive[node.axis];
+                    idxStack[depth++] = positiveDir ? node.c1 : node.c0;
+                    idxStack[depth++] = positiveDir ? node.c0 : node.c1;
+                }
+                else {
+                    for (uint32_t i = 0; i < node.numLeaves; ++i) {
+                        uint32_t prevDepth = isect->obj.size();
+                        if (m_objLists[node.offsetFirstLeaf + i]->intersect(ray, isect)) {
+                            ray.distMax = isect->dist;
+                            isect->obj.erase(objDepth, prevDepth);
+                        }
+                    }
+                }
+            }
+            return isect->obj.size() > objDepth;
+        }
+        
+        bool occluded(const Ray &ray) const override {
+            bool dirIsPositive[] = {ray.dir.x >= 0, ray.dir.y >= 0, ray.dir.z >= 0};
+            uint32_t segment = segmentIndex(ray.time);
+            
+            uint32_t idxStack[StackSize];
+            uint32_t depth = 0;
+            idxStack[depth++] = 0;
+            while (depth > 0) {
+                uint32_t nodeIdx = idxStack[--depth];
+                const Node &node = m_nodes[nodeIdx];
+                if (!m_segmentBounds[m_numSegments * nodeIdx + segment].intersect(ray))
+                    continue;
+                if (node.numLeaves == 0) {
+                    SLRRequire(depth + 2 <= StackSize, "MotionBVH::occluded: stack overflow");
+                    bool positiveDir = dirIsPositive[node.axis];
+                    idxStack[depth++] = positiveDir ? node.c1 : node.c0;
+                    idxStack[depth++] = positiveDir ? node.c0 : node.c1;
+                }
+                else {
+                    for (uint32_t i = 0; i < node.numLeaves; ++i)
+                        if (m_objLists[node.offsetFirstLeaf + i]->occluded(ray))
+                            return true;
+                }
+            }
+            return false;
+        }
+    };
+}
+
+#endif /* MotionBVH_h */
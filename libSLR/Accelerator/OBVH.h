@@ -0,0 +1,478 @@
+//
+//  OBVH.h
+//
+//  Created by 渡部 心 on 2016/09/04.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#ifndef OBVH_h
+#define OBVH_h
+
+#include "../defines.h"
+#include "../references.h"
+#include "../Core/Accelerator.h"
+
+#include "../Accelerator/SBVH.h"
+#include <immintrin.h>
+#if defined(SLR_Defs_MSVC)
+#   include <intrin.h>
+#endif
+
+namespace SLR {
+    // 8-wide BVH collapsed from three levels of SBVH, traversed with AVX2.
+    // Data are stored as plain float arrays and loaded unaligned so that containers don't need 32-byte alignment.
+    // Only use this accelerator when OBVH::isSupported() returns true.
+    class OBVH : public Accelerator {
+        struct Children {
+            union {
+                uint32_t asUInt;
+                struct {
+                    uint idx : 31;
+                    bool isLeafNode : 1;
+                };
+            };
+            
+            bool isValid() const {
+                return asUInt != UINT32_MAX;
+            }
+        };
+        
+        struct RayAVX {
+            __m256 org_x, org_y, org_z;
+            __m256 dir_x, dir_y, dir_z;
+            __m256 invDir_x, invDir_y, invDir_z;
+            __m256 distMin, distMax;
+            bool dirIsPositive[3];
+            
+            SLR_TARGET_AVX2 RayAVX(const Ray &ray) {
+                const Vector3D invRayDir = ray.dir.reciprocal();
+                org_x = _mm256_set1_ps(ray.org.x);
+                org_y = _mm256_set1_ps(ray.org.y);
+                org_z = _mm256_set1_ps(ray.org.z);
+                dir_x = _mm256_set1_ps(ray.dir.x);
+                dir_y = _mm256_set1_ps(ray.dir.y);
+                dir_z = _mm256_set1_ps(ray.dir.z);
+                invDir_x = _mm256_set1_ps(invRayDir.x);
+                invDir_y = _mm256_set1_ps(invRayDir.y);
+                invDir_z = _mm256_set1_ps(invRayDir.z);
+                distMin = _mm256_set1_ps(ray.distMin);
+                distMax = _mm256_set1_ps(ray.distMax);
+                dirIsPositive[0] = invRayDir.x > 0.0f;
+                dirIsPositive[1] = invRayDir.y > 0.0f;
+                dirIsPositive[2] = invRayDir.z > 0.0f;
+            }
+        };
+        
+        struct Node {
+            float min_x[8], min_y[8], min_z[8];
+            float max_x[8], max_y[8], max_z[8];
+            Children children[8];
+            
+            void setInvalid(uint32_t lane) {
+                min_x[lane] = min_y[lane] = min_z[lane] = INFINITY;
+                max_x[lane] = max_y[lane] = max_z[lane] = -INFINITY;
+                children[lane].asUInt = UINT32_MAX;
+            }
+            
+            void setBounds(uint32_t lane, const BoundingBox3D &bb) {
+                min_x[lane] = bb.minP.x; min_y[lane] = bb.minP.y; min_z[lane] = bb.minP.z;
+                max_x[lane] = bb.maxP.x; max_y[lane] = bb.maxP.y; max_z[lane] = bb.maxP.z;
+            }
+            
+            BoundingBox3D getBounds(uint32_t lane) const {
+                return BoundingBox3D(Point3D(min_x[lane], min_y[lane], min_z[lane]), Point3D(max_x[lane], max_y[lane], max_z[lane]));
+            }
+            
+            SLR_TARGET_AVX2 uint32_t intersect(const RayAVX &ray, __m256* tNear) const {
+                const __m256 nx = _mm256_loadu_ps(ray.dirIsPositive[0] ? min_x : max_x);
+                const __m256 ny = _mm256_loadu_ps(ray.dirIsPositive[1] ? min_y : max_y);
+                const __m256 nz = _mm256_loadu_ps(ray.dirIsPositive[2] ? min_z : max_z);
+                const __m256 fx = _mm256_loadu_ps(ray.dirIsPositive[0] ? max_x : min_x);
+                const __m256 fy = _mm256_loadu_ps(ray.dirIsPositive[1] ? max_y : min_y);
+                const __m256 fz = _mm256_loadu_ps(ray.dirIsPositive[2] ? max_z : min_z);
+                
+                __m256 tN = ray.distMin;
+                __m256 tF = ray.distMax;
+                tN = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nx, ray.org_x), ray.invDir_x), tN);
+                tN = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(ny, ray.org_y), ray.invDir_y), tN);
+                tN = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nz, ray.org_z), ray.invDir_z), tN);
+                tF = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(fx, ray.org_x), ray.invDir_x), tF);
+                tF = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(fy, ray.org_y), ray.invDir_y), tF);
+                tF = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(fz, ray.org_z), ray.invDir_z), tF);
+                
+                *tNear = tN;
+                return _mm256_movemask_ps(_mm256_cmp_ps(tN, tF, _CMP_LE_OQ));
+            }
+        };
+        
+        // Eight triangles gathered into the SoA layout. Unused lanes have zero edges and never hit.
+        struct Triangle8 {
+            float v0_x[8], v0_y[8], v0_z[8];
+            float e1_x[8], e1_y[8], e1_z[8];
+            float e2_x[8], e2_y[8], e2_z[8];
+            const SurfaceObject* objs[8];
+            
+            void set(uint32_t lane, const SurfaceObject* obj, const Point3D &p0, const Point3D &p1, const Point3D &p2) {
+                Vector3D e1 = p1 - p0;
+                Vector3D e2 = p2 - p0;
+                v0_x[lane] = p0.x; v0_y[lane] = p0.y; v0_z[lane] = p0.z;
+                e1_x[lane] = e1.x; e1_y[lane] = e1.y; e1_z[lane] = e1.z;
+                e2_x[lane] = e2.x; e2_y[lane] = e2.y; e2_z[lane] = e2.z;
+                objs[lane] = obj;
+            }
+            
+            SLR_TARGET_AVX2 uint32_t intersect(const RayAVX &ray, __m256* t, __m256* b1, __m256* b2) const {
+                const __m256 e1x = _mm256_loadu_ps(e1_x), e1y = _mm256_loadu_ps(e1_y), e1z = _mm256_loadu_ps(e1_z);
+                const __m256 e2x = _mm256_loadu_ps(e2_x), e2y = _mm256_loadu_ps(e2_y), e2z = _mm256_loadu_ps(e2_z);
+                
+                // p = cross(dir, e2), det = dot(e1, p)
+                __m256 p_x = _mm256_sub_ps(_mm256_mul_ps(ray.dir_y, e2z), _mm256_mul_ps(ray.dir_z, e2y));
+                __m256 p_y = _mm256_sub_ps(_mm256_mul_ps(ray.dir_z, e2x), _mm256_mul_ps(ray.dir_x, e2z));
+                __m256 p_z = _mm256_sub_ps(_mm256_mul_ps(ray.dir_x, e2y), _mm256_mul_ps(ray.dir_y, e2x));
+                __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, p_x), _mm256_mul_ps(e1y, p_y)), _mm256_mul_ps(e1z, p_z));
+                __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+                
+                // d = org - v0, b1 = dot(d, p) / det
+                __m256 d_x = _mm256_sub_ps(ray.org_x, _mm256_loadu_ps(v0_x));
+                __m256 d_y = _mm256_sub_ps(ray.org_y, _mm256_loadu_ps(v0_y));
+                __m256 d_z = _mm256_sub_ps(ray.org_z, _mm256_loadu_ps(v0_z));
+                *b1 = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d_x, p_x), _mm256_mul_ps(d_y, p_y)), _mm256_mul_ps(d_z, p_z)), invDet);
+                
+                // q = cross(d, e1), b2 = dot(dir, q) / det, t = dot(e2, q) / det
+                __m256 q_x = _mm256_sub_ps(_mm256_mul_ps(d_y, e1z), _mm256_mul_ps(d_z, e1y));
+                __m256 q_y = _mm256_sub_ps(_mm256_mul_ps(d_z, e1x), _mm256_mul_ps(d_x, e1z));
+                __m256 q_z = _mm256_sub_ps(_mm256_mul_ps(d_x, e1y), _mm256_mul_ps(d_y, e1x));
+                *b2 = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ray.dir_x, q_x), _mm256_mul_ps(ray.dir_y, q_y)), _mm256_mul_ps(ray.dir_z, q_z)), invDet);
+                *t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, q_x), _mm256_mul_ps(e2y, q_y)), _mm256_mul_ps(e2z, q_z)), invDet);
+                
+                const __m256 zero = _mm256_setzero_ps();
+                __m256 mask = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(*b1, zero, _CMP_GE_OQ));
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(*b2, zero, _CMP_GE_OQ));
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(*b1, *b2), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(*t, ray.distMin, _CMP_GE_OQ));
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(*t, ray.distMax, _CMP_LE_OQ));
+                
+                return _mm256_movemask_ps(mask);
+            }
+        };
+        
+        struct Leaf {
+            uint32_t offsetTriangle8;
+            uint32_t numTriangle8s;
+            uint32_t offsetObj;
+            uint32_t numObjs;
+        };
+        
+        uint32_t m_depth;
+        float m_cost;
+        BoundingBox3D m_bounds;
+        std::vector<Node> m_nodes;
+        std::vector<Leaf> m_leaves;
+        std::vector<Triangle8> m_triangle8s;
+        std::vector<const SurfaceObject*> m_objLists;
+        
+        uint32_t createLeaf(const SurfaceObject* const* objs, uint32_t numObjs) {
+            Leaf leaf;
+            leaf.offsetTriangle8 = (uint32_t)m_triangle8s.size();
+            leaf.numTriangle8s = 0;
+            leaf.offsetObj = (uint32_t)m_objLists.size();
+            leaf.numObjs = 0;
+            
+            uint32_t lane = 8;
+            for (int i = 0; i < numObjs; ++i) {
+                const SurfaceObject* obj = objs[i];
+                Point3D p[3];
+                if (obj->getEmbeddableTriangle(&p[0], &p[1], &p[2])) {
+                    if (lane == 8) {
+                        m_triangle8s.emplace_back();
+                        Triangle8 &tri8 = m_triangle8s.back();
+                        for (int l = 0; l < 8; ++l)
+                            tri8.set(l, nullptr, Point3D::Zero, Point3D::Zero, Point3D::Zero);
+                        ++leaf.numTriangle8s;
+                        lane = 0;
+                    }
+                    m_triangle8s.back().set(lane++, obj, p[0], p[1], p[2]);
+                }
+                else {
+                    m_objLists.push_back(obj);
+                    ++leaf.numObjs;
+                }
+            }
+            
+            m_leaves.push_back(leaf);
+            return (uint32_t)m_leaves.size() - 1;
+        }
+        
+        Children collapseBBVH(const SBVH &baseBBVH, uint32_t ancestor, uint32_t depth) {
+            Children ret;
+            
+            const SBVH::Node* root = &baseBBVH.m_nodes[ancestor];
+            if (root->numLeaves > 0) {
+                ret.isLeafNode = true;
+                ret.idx = createLeaf(&baseBBVH.m_objLists[root->offsetFirstLeaf], root->numLeaves);
+                return ret;
+            }
+            
+            if (++depth > m_depth)
+                m_depth = depth;
+            
+            // gather up to 8 descendants by expanding internal nodes three levels down.
+            uint32_t descendants[8] = {root->c0, root->c1};
+            uint32_t numDescendants = 2;
+            for (int level = 1; level < 3; ++level) {
+                uint32_t expanded[8];
+                uint32_t numExpanded = 0;
+                for (int i = 0; i < numDescendants; ++i) {
+                    const SBVH::Node &node = baseBBVH.m_nodes[descendants[i]];
+                    if (node.numLeaves == 0) {
+                        expanded[numExpanded++] = node.c0;
+                        expanded[numExpanded++] = node.c1;
+                    }
+                    else {
+                        expanded[numExpanded++] = descendants[i];
+                    }
+                }
+                std::copy(expanded, expanded + numExpanded, descendants);
+                numDescendants = numExpanded;
+            }
+            
+            uint32_t nodeIdx = (uint32_t)m_nodes.size();
+            m_nodes.emplace_back();
+            for (int i = 0; i < 8; ++i)
+                m_nodes[nodeIdx].setInvalid(i);
+            
+            for (int i = 0; i < numDescendants; ++i) {
+                Children child = collapseBBVH(baseBBVH, descendants[i], depth);
+                // do NOT hold a reference to m_nodes[nodeIdx] across the recursive call.
+                m_nodes[nodeIdx].setBounds(i, baseBBVH.m_nodes[descendants[i]].bbox);
+                m_nodes[nodeIdx].children[i] = child;
+            }
+            
+            ret.isLeafNode = false;
+            ret.idx = nodeIdx;
+            return ret;
+        }
+        
+        float calcSAHCost() const {
+            const float Ci = 1.2f;
+            float costInt = 0.0f;
+            float costObj = 0.0f;
+            for (int i = 0; i < m_nodes.size(); ++i) {
+                const Node &node = m_nodes[i];
+                BoundingBox3D nodeBB;
+                for (int c = 0; c < 8; ++c) {
+                    if (node.children[c].isValid())
+                        nodeBB.unify(node.getBounds(c));
+                }
+                
+                float surfaceArea = nodeBB.surfaceArea();
+                costInt += surfaceArea;
+                SLRAssert(std::isfinite(surfaceArea), "invalid surface area value.");
+                
+                for (int c = 0; c < 8; ++c) {
+                    Children child = node.children[c];
+                    if (!child.isValid() || !child.isLeafNode)
+                        continue;
+                    const Leaf &leaf = m_leaves[child.idx];
+                    // the same units as SBVH: the cost of each triangle, though eight of them are tested at once.
+                    float costPrims = 0.0f;
+                    for (uint32_t j = 0; j < leaf.numTriangle8s; ++j) {
+                        const Triangle8 &tri8 = m_triangle8s[leaf.offsetTriangle8 + j];
+                        for (int lane = 0; lane < 8; ++lane)
+                            if (tri8.objs[lane])
+                                costPrims += tri8.objs[lane]->costForIntersect();
+                    }
+                    for (uint32_t j = 0; j < leaf.numObjs; ++j)
+                        costPrims += m_objLists[leaf.offsetObj + j]->costForIntersect();
+                    costObj += node.getBounds(c).surfaceArea() * costPrims;
+                }
+            }
+            float rootSA = m_bounds.surfaceArea();
+            costInt *= Ci / rootSA;
+            costObj /= rootSA;
+            
+            return costInt + costObj;
+        }
+        
+        SLR_TARGET_AVX2 void intersectLeaf(const Leaf &leaf, Ray &ray, RayAVX &rayAVX, Intersection* isect, uint32_t objDepth) const {
+            for (uint32_t i = 0; i < leaf.numTriangle8s; ++i) {
+                const Triangle8 &tri8 = m_triangle8s[leaf.offsetTriangle8 + i];
+                __m256 t, b1, b2;
+                uint32_t hitFlags = tri8.intersect(rayAVX, &t, &b1, &b2);
+                if (hitFlags == 0)
+                    continue;
+                float ts[8], b1s[8], b2s[8];
+                _mm256_storeu_ps(ts, t);
+                _mm256_storeu_ps(b1s, b1);
+                _mm256_storeu_ps(b2s, b2);
+                int32_t closest = -1;
+                for (int lane = 0; lane < 8; ++lane) {
+                    if (((hitFlags >> lane) & 0x1) && (closest < 0 || ts[lane] < ts[closest]))
+                        closest = lane;
+                }
+                ray.distMax = ts[closest];
+                rayAVX.distMax = _mm256_set1_ps(ray.distMax);
+                uint32_t prevDepth = isect->obj.size();
+                tri8.objs[closest]->fillEmbeddedTriangleIntersection(ray, ts[closest], b1s[closest], b2s[closest], isect);
+                isect->obj.erase(objDepth, prevDepth);
+            }
+            for (uint32_t i = 0; i < leaf.numObjs; ++i) {
+                uint32_t prevDepth = isect->obj.size();
+                if (m_objLists[leaf.offsetObj + i]->intersect(ray, isect)) {
+                    ray.distMax = isect->dist;
+                    rayAVX.distMax = _mm256_set1_ps(ray.distMax);
+                    isect->obj.erase(objDepth, prevDepth);
+                }
+            }
+        }
+        
+        SLR_TARGET_AVX2 bool occludedLeaf(const Leaf &leaf, const Ray &ray, const RayAVX &rayAVX) const {
+            for (uint32_t i = 0; i < leaf.numTriangle8s; ++i) {
+                __m256 t, b1, b2;
+                if (m_triangle8s[leaf.offsetTriangle8 + i].intersect(rayAVX, &t, &b1, &b2))
+                    return true;
+            }
+            for (uint32_t i = 0; i < leaf.numObjs; ++i)
+                if (m_objLists[leaf.offsetObj + i]->occluded(ray))
+                    return true;
+            return false;
+        }
+    
+    public:
+        OBVH(const SBVH &baseBBVH) {
+            std::chrono::system_clock::time_point tpStart, tpEnd;
+            double elapsed;
+            
+            tpStart = std::chrono::system_clock::now();
+            
+            m_depth = 0;
+            m_bounds = baseBBVH.bounds();
+            Children rootResult = collapseBBVH(baseBBVH, 0, 0);
+            if (rootResult.isLeafNode) {
+                m_nodes.emplace_back();
+                Node &node = m_nodes.back();
+                for (int i = 0; i < 8; ++i)
+                    node.setInvalid(i);
+                node.setBounds(0, baseBBVH.m_nodes[0].bbox);
+                node.children[0] = rootResult;
+            }
+            
+            tpEnd = std::chrono::system_clock::now();
+            elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(tpEnd - tpStart).count();
+            
+            m_cost = calcSAHCost();
+            printf("depth: %u, cost: %g, time: %g[s]\n", m_depth, m_cost, elapsed * 0.001f);
+        }
+        
+        static bool isSupported() {
+#if defined(SLR_Defs_MSVC)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] < 7)
+                return false;
+            __cpuid(info, 1);
+            bool osUsesXSave = (info[2] & (1 << 27)) != 0;
+            bool cpuHasAVX = (info[2] & (1 << 28)) != 0;
+            if (!osUsesXSave || !cpuHasAVX)
+                return false;
+            // check whether the OS saves the YMM registers.
+            if ((_xgetbv(0) & 0x6) != 0x6)
+                return false;
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#else
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        }
+        
+        float costForIntersect() const override {
+            return m_cost;
+        }
+        
+        BoundingBox3D bounds() const override {
+            return m_bounds;
+        }
+        
+        SLR_TARGET_AVX2 bool intersect(Ray &ray, Intersection* isect) const override {
+            uint32_t objDepth = (uint32_t)isect->obj.size();
+            RayAVX rayAVX(ray);
+            
+            const uint32_t StackSize = 256;
+            uint32_t idxStack[StackSize];
+            uint32_t depth = 0;
+            idxStack[depth++] = 0;
+            while (depth > 0) {
+                const Node &node = m_nodes[idxStack[--depth]];
+                __m256 tNear;
+                uint32_t hitFlags = node.intersect(rayAVX, &tNear);
+                if (hitFlags == 0)
+                    continue;
+                float tNears[8];
+                _mm256_storeu_ps(tNears, tNear);
+                
+                // sort hit internal children in descending order of entry distance so that the nearest one is popped first.
+                uint32_t internals[8];
+                uint32_t numInternals = 0;
+                for (int i = 0; i < 8; ++i) {
+                    const Children &child = node.children[i];
+                    if (((hitFlags >> i) & 0x1) == 0 || !child.isValid())
+                        continue;
+                    if (child.isLeafNode)
+                        continue;
+                    uint32_t j = numInternals++;
+                    for (; j > 0 && tNears[internals[j - 1]] < tNears[i]; --j)
+                        internals[j] = internals[j - 1];
+                    internals[j] = i;
+                }
+                for (int i = 0; i < numInternals; ++i) {
+                    SLRAssert(depth < StackSize, "OBVH::intersect: stack overflow");
+                    idxStack[depth++] = node.children[internals[i]].idx;
+                }
+                
+                for (int i = 0; i < 8; ++i) {
+                    const Children &child = node.children[i];
+                    if (((hitFlags >> i) & 0x1) == 0 || !child.isValid() || !child.isLeafNode)
+                        continue;
+                    intersectLeaf(m_leaves[child.idx], ray, rayAVX, isect, objDepth);
+                }
+            }
+            return isect->obj.size() > objDepth;
+        }
+        
+        SLR_TARGET_AVX2 bool occluded(const Ray &ray) const override {
+            RayAVX rayAVX(ray);
+            
+            const uint32_t StackSize = 256;
+            uint32_t idxStack[StackSize];
+            uint32_t depth = 0;
+            idxStack[depth++] = 0;
+            while (depth > 0) {
+                const Node &node = m_nodes[idxStack[--depth]];
+                __m256 tNear;
+                uint32_t hitFlags = node.intersect(rayAVX, &tNear);
+                if (hitFlags == 0)
+                    continue;
+                
+                for (int i = 0; i < 8; ++i) {
+                    const Children &child = node.children[i];
+                    if (((hitFlags >> i) & 0x1) == 0 || !child.isValid() || !child.isLeafNode)
+                        continue;
+                    if (occludedLeaf(m_leaves[child.idx], ray, rayAVX))
+                        return true;
+                }
+                for (int i = 0; i < 8; ++i) {
+                    const Children &child = node.children[i];
+                    if (((hitFlags >> i) & 0x1) == 0 || !child.isValid() || child.isLeafNode)
+                        continue;
+                    SLRAssert(depth < StackSize, "OBVH::occluded: stack overflow");
+                    idxStack[depth++] = child.idx;
+                }
+            }
+            return false;
+        }
+    };
+}
+
+#endif /* OBVH_h */
@@ -28,8 +28,7 @@ namespace SLR {
             union {
                 uint32_t asUInt;
                 struct {
-                    uint idx : 27;
-                    uint numLeaves : 4;
+                    uint idx : 31;
                     bool isLeafNode : 1;
                 };
             };
@@ -39,6 +38,33 @@ namespace SLR {
             }
         };
         
+        // Four rays in the SoA layout for testing them against a child of a node at once.
+        struct RayPacket {
+            __m128 org_x, org_y, org_z;
+            __m128 invDir_x, invDir_y, invDir_z;
+            __m128 dirIsPositive_x, dirIsPositive_y, dirIsPositive_z;
+            __m128 distMin, distMax;
+            
+            // unused lanes are left as zero and masked out by the callers.
+            void clear() {
+                org_x = org_y = org_z = _mm_setzero_ps();
+                invDir_x = invDir_y = invDir_z = _mm_setzero_ps();
+                dirIsPositive_x = dirIsPositive_y = dirIsPositive_z = _mm_setzero_ps();
+                distMin = distMax = _mm_setzero_ps();
+            }
+            
+            void set(uint32_t lane, const Ray &ray) {
+                const Vector3D invRayDir = ray.dir.reciprocal();
+                ((float*)&org_x)[lane] = ray.org.x; ((float*)&org_y)[lane] = ray.org.y; ((float*)&org_z)[lane] = ray.org.z;
+                ((float*)&invDir_x)[lane] = invRayDir.x; ((float*)&invDir_y)[lane] = invRayDir.y; ((float*)&invDir_z)[lane] = invRayDir.z;
+                ((uint32_t*)&dirIsPositive_x)[lane] = invRayDir.x > 0.0f ? UINT32_MAX : 0;
+                ((uint32_t*)&dirIsPositive_y)[lane] = invRayDir.y > 0.0f ? UINT32_MAX : 0;
+                ((uint32_t*)&dirIsPositive_z)[lane] = invRayDir.z > 0.0f ? UINT32_MAX : 0;
+                ((float*)&distMin)[lane] = ray.distMin;
+                ((float*)&distMax)[lane] = ray.distMax;
+            }
+        };
+        
         struct Node {
             __m128 min_x;
             __m128 min_y;
@@ -74,28 +100,327 @@ namespace SLR {
                 
                 return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
             }
+            
+            // tests a child against the packets, returns the mask of the active rays hitting the child.
+            uint64_t intersect(uint32_t child, const RayPacket* packets, uint32_t numPackets, uint64_t activeMask) const {
+                __m128 cMin_x = _mm_set_ps1(((const float*)&min_x)[child]);
+                __m128 cMin_y = _mm_set_ps1(((const float*)&min_y)[child]);
+                __m128 cMin_z = _mm_set_ps1(((const float*)&min_z)[child]);
+                __m128 cMax_x = _mm_set_ps1(((const float*)&max_x)[child]);
+                __m128 cMax_y = _mm_set_ps1(((const float*)&max_y)[child]);
+                __m128 cMax_z = _mm_set_ps1(((const float*)&max_z)[child]);
+                
+                uint64_t hitMask = 0;
+                for (uint32_t p = 0; p < numPackets; ++p) {
+                    uint32_t actives = (activeMask >> (4 * p)) & 0xF;
+                    if (actives == 0)
+                        continue;
+                    const RayPacket &packet = packets[p];
+                    
+                    __m128 tNear = packet.distMin;
+                    __m128 tFar = packet.distMax;
+                    
+                    tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_sel_ps(packet.dirIsPositive_x, cMin_x, cMax_x), packet.org_x), packet.invDir_x), tNear);
+                    tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_sel_ps(packet.dirIsPositive_y, cMin_y, cMax_y), packet.org_y), packet.invDir_y), tNear);
+                    tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_sel_ps(packet.dirIsPositive_z, cMin_z, cMax_z), packet.org_z), packet.invDir_z), tNear);
+                    tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_sel_ps(packet.dirIsPositive_x, cMax_x, cMin_x), packet.org_x), packet.invDir_x), tFar);
+                    tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_sel_ps(packet.dirIsPositive_y, cMax_y, cMin_y), packet.org_y), packet.invDir_y), tFar);
+                    tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_sel_ps(packet.dirIsPositive_z, cMax_z, cMin_z), packet.org_z), packet.invDir_z), tFar);
+                    
+                    hitMask |= (uint64_t)(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) & actives) << (4 * p);
+                }
+                return hitMask;
+            }
+        };
+        
+        // Four triangles gathered into the SoA layout for Moller-Trumbore test with SSE.
+        // Unused lanes have zero edges, which results in zero determinants and never hit.
+        struct Triangle4 {
+            __m128 v0_x, v0_y, v0_z;
+            __m128 e1_x, e1_y, e1_z;
+            __m128 e2_x, e2_y, e2_z;
+            const SurfaceObject* objs[4];
+            
+            void set(uint32_t lane, const SurfaceObject* obj, const Point3D &p0, const Point3D &p1, const Point3D &p2) {
+                Vector3D e1 = p1 - p0;
+                Vector3D e2 = p2 - p0;
+                ((float*)&v0_x)[lane] = p0.x; ((float*)&v0_y)[lane] = p0.y; ((float*)&v0_z)[lane] = p0.z;
+                ((float*)&e1_x)[lane] = e1.x; ((float*)&e1_y)[lane] = e1.y; ((float*)&e1_z)[lane] = e1.z;
+                ((float*)&e2_x)[lane] = e2.x; ((float*)&e2_y)[lane] = e2.y; ((float*)&e2_z)[lane] = e2.z;
+                objs[lane] = obj;
+            }
+            
+            // returns a mask of hit lanes, and the distances and barycentric coordinates for each lane.
+            uint32_t intersect(const Ray &ray, __m128* t, __m128* b1, __m128* b2) const {
+                __m128 rOrg_x = _mm_set_ps1(ray.org.x);
+                __m128 rOrg_y = _mm_set_ps1(ray.org.y);
+                __m128 rOrg_z = _mm_set_ps1(ray.org.z);
+                __m128 rDir_x = _mm_set_ps1(ray.dir.x);
+                __m128 rDir_y = _mm_set_ps1(ray.dir.y);
+                __m128 rDir_z = _mm_set_ps1(ray.dir.z);
+                
+                // p = cross(dir, e2), det = dot(e1, p)
+                __m128 p_x = _mm_sub_ps(_mm_mul_ps(rDir_y, e2_z), _mm_mul_ps(rDir_z, e2_y));
+                __m128 p_y = _mm_sub_ps(_mm_mul_ps(rDir_z, e2_x), _mm_mul_ps(rDir_x, e2_z));
+                __m128 p_z = _mm_sub_ps(_mm_mul_ps(rDir_x, e2_y), _mm_mul_ps(rDir_y, e2_x));
+                __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1_x, p_x), _mm_mul_ps(e1_y, p_y)), _mm_mul_ps(e1_z, p_z));
+                __m128 invDet = _mm_div_ps(_mm_set_ps1(1.0f), det);
+                
+                // d = org - v0, b1 = dot(d, p) / det
+                __m128 d_x = _mm_sub_ps(rOrg_x, v0_x);
+                __m128 d_y = _mm_sub_ps(rOrg_y, v0_y);
+                __m128 d_z = _mm_sub_ps(rOrg_z, v0_z);
+                *b1 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d_x, p_x), _mm_mul_ps(d_y, p_y)), _mm_mul_ps(d_z, p_z)), invDet);
+                
+                // q = cross(d, e1), b2 = dot(dir, q) / det, t = dot(e2, q) / det
+                __m128 q_x = _mm_sub_ps(_mm_mul_ps(d_y, e1_z), _mm_mul_ps(d_z, e1_y));
+                __m128 q_y = _mm_sub_ps(_mm_mul_ps(d_z, e1_x), _mm_mul_ps(d_x, e1_z));
+                __m128 q_z = _mm_sub_ps(_mm_mul_ps(d_x, e1_y), _mm_mul_ps(d_y, e1_x));
+                *b2 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rDir_x, q_x), _mm_mul_ps(rDir_y, q_y)), _mm_mul_ps(rDir_z, q_z)), invDet);
+                *t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2_x, q_x), _mm_mul_ps(e2_y, q_y)), _mm_mul_ps(e2_z, q_z)), invDet);
+                
+                const __m128 zero = _mm_setzero_ps();
+                __m128 mask = _mm_cmpneq_ps(det, zero);
+                mask = _mm_and_ps(mask, _mm_cmpge_ps(*b1, zero));
+                mask = _mm_and_ps(mask, _mm_cmpge_ps(*b2, zero));
+                mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(*b1, *b2), _mm_set_ps1(1.0f)));
+                mask = _mm_and_ps(mask, _mm_cmpge_ps(*t, _mm_set_ps1(ray.distMin)));
+                mask = _mm_and_ps(mask, _mm_cmple_ps(*t, _mm_set_ps1(ray.distMax)));
+                
+                return _mm_movemask_ps(mask);
+            }
+        };
+        
+        struct Leaf {
+            uint32_t offsetTriangle4;
+            uint32_t numTriangle4s;
+            uint32_t offsetObj;
+            uint32_t numObjs;
         };
         
         uint32_t m_depth;
         float m_cost;
         BoundingBox3D m_bounds;
         std::vector<Node> m_nodes;
+        std::vector<Leaf> m_leaves;
+        std::vector<Triangle4> m_triangle4s;
         std::vector<const SurfaceObject*> m_objLists;
         
+        uint32_t createLeaf(const SurfaceObject* const* objs, uint32_t numObjs) {
+            Leaf leaf;
+            leaf.offsetTriangle4 = (uint32_t)m_triangle4s.size();
+            leaf.numTriangle4s = 0;
+            leaf.offsetObj = (uint32_t)m_objLists.size();
+            leaf.numObjs = 0;
+            
+            uint32_t lane = 4;
+            for (int i = 0; i < numObjs; ++i) {
+                const SurfaceObject* obj = objs[i];
+                Point3D p[3];
+                if (obj->getEmbeddableTriangle(&p[0], &p[1], &p[2])) {
+                    if (lane == 4) {
+                        m_triangle4s.emplace_back();
+                        Triangle4 &tri4 = m_triangle4s.back();
+                        tri4.v0_x = tri4.v0_y = tri4.v0_z = _mm_setzero_ps();
+                        tri4.e1_x = tri4.e1_y = tri4.e1_z = _mm_setzero_ps();
+                        tri4.e2_x = tri4.e2_y = tri4.e2_z = _mm_setzero_ps();
+                        tri4.objs[0] = tri4.objs[1] = tri4.objs[2] = tri4.objs[3] = nullptr;
+                        ++leaf.numTriangle4s;
+                        lane = 0;
+                    }
+                    m_triangle4s.back().set(lane++, obj, p[0], p[1], p[2]);
+                }
+                else {
+                    m_objLists.push_back(obj);
+                    ++leaf.numObjs;
+                }
+            }
+            
+            m_leaves.push_back(leaf);
+            return (uint32_t)m_leaves.size() - 1;
+        }
+        
+        void intersectLeaf(const Leaf &leaf, Ray &ray, Intersection* isect, uint32_t objDepth) const {
+            for (uint32_t i = 0; i < leaf.numTriangle4s; ++i) {
+                const Triangle4 &tri4 = m_triangle4s[leaf.offsetTriangle4 + i];
+                __m128 t, b1, b2;
+                uint32_t hitFlags = tri4.intersect(ray, &t, &b1, &b2);
+                if (hitFlags == 0)
+                    continue;
+                const float* ts = (const float*)&t;
+                int32_t closest = -1;
+                for (int lane = 0; lane < 4; ++lane) {
+                    if (((hitFlags >> lane) & 0x1) && (closest < 0 || ts[lane] < ts[closest]))
+                        closest = lane;
+                }
+                float dist = ts[closest];
+                ray.distMax = dist;
+                uint32_t prevDepth = isect->obj.size();
+                tri4.objs[closest]->fillEmbeddedTriangleIntersection(ray, dist, ((const float*)&b1)[closest], ((const float*)&b2)[closest], isect);
+                isect->obj.erase(objDepth, prevDepth);
+            }
+            for (uint32_t i = 0; i < leaf.numObjs; ++i) {
+                uint32_t prevDepth = isect->obj.size();
+                if (m_objLists[leaf.offsetObj + i]->intersect(ray, isect)) {
+                    ray.distMax = isect->dist;
+                    isect->obj.erase(objDepth, prevDepth);
+                }
+            }
+        }
+        
+        bool occludedLeaf(const Leaf &leaf, const Ray &ray) const {
+            for (uint32_t i = 0; i < leaf.numTriangle4s; ++i) {
+                __m128 t, b1, b2;
+                if (m_triangle4s[leaf.offsetTriangle4 + i].intersect(ray, &t, &b1, &b2))
+                    return true;
+            }
+            for (uint32_t i = 0; i < leaf.numObjs; ++i)
+                if (m_objLists[leaf.offsetObj + i]->occluded(ray))
+                    return true;
+            return false;
+        }
+        
+        static const uint32_t MaxGroupSize = 64;
+        static const uint32_t MinGroupSize = 4;
+        
+        static uint32_t getEncodedOrder(const Node &node, const bool dirIsPositive[3]) {
+            const uint32_t OrderTable[] = {
+                0x0123, 0x0132, 0x1023, 0x1032,
+                0x2301, 0x3201, 0x2310, 0x3210
+            };
+            return OrderTable[4 * dirIsPositive[node.topAxis] + 2 * dirIsPositive[node.leftAxis] + 1 * dirIsPositive[node.rightAxis]];
+        }
+        
+        // Packet traversal of a group of rays sharing the same direction octant, thus the same child order.
+        // The rays are packed by four into the SoA layout and each child of a node is tested against four rays at once,
+        // each stack entry holds the mask of the rays still active for the node.
+        void intersectRayGroup(Ray* rays, Intersection* isects, const uint32_t* objDepths, const uint32_t* rayIndices, uint32_t numRays, const bool dirIsPositive[3]) const {
+            SLRRequire(numRays <= MaxGroupSize, "QBVH::intersectRayGroup: too many rays.");
+            RayPacket packets[MaxGroupSize / 4];
+            uint32_t numPackets = packRays(rays, rayIndices, numRays, packets);
+            
+            struct Entry {
+                uint32_t nodeIdx;
+                uint64_t activeMask;
+            };
+            const uint32_t StackSize = 64;
+            Entry stack[StackSize];
+            uint32_t depth = 0;
+            stack[depth++] = Entry{0, numRays < 64 ? ((uint64_t)1 << numRays) - 1 : UINT64_MAX};
+            while (depth > 0) {
+                Entry entry = stack[--depth];
+                const Node &node = m_nodes[entry.nodeIdx];
+                
+                uint32_t encodedOrder = getEncodedOrder(node, dirIsPositive);
+                uint32_t order[4] = {(encodedOrder >> 0) & 0xF, (encodedOrder >> 4) & 0xF, (encodedOrder >> 8) & 0xF, (encodedOrder >> 12) & 0xF};
+                uint64_t childMasks[4];
+                for (int i = 0; i < 4; ++i)
+                    childMasks[i] = node.children[order[i]].isValid() ? node.intersect(order[i], packets, numPackets, entry.activeMask) : 0;
+                
+                for (int i = 3; i >= 0; --i) {
+                    const Children &child = node.children[order[i]];
+                    if (childMasks[i] == 0 || child.isLeafNode)
+                        continue;
+                    SLRRequire(depth < StackSize, "QBVH::intersectRayGroup: stack overflow");
+                    stack[depth++] = Entry{child.idx, childMasks[i]};
+                }
+                for (int i = 0; i < 4; ++i) {
+                    const Children &child = node.children[order[i]];
+                    if (childMasks[i] == 0 || !child.isLeafNode)
+                        continue;
+                    const Leaf &leaf = m_leaves[child.idx];
+                    for (uint32_t r = 0; r < numRays; ++r) {
+                        if (((childMasks[i] >> r) & 0x1) == 0)
+                            continue;
+                        uint32_t rIdx = rayIndices[r];
+                        intersectLeaf(leaf, rays[rIdx], &isects[rIdx], objDepths[rIdx]);
+                        // the following node tests cull with the shortened distance.
+                        ((float*)&packets[r / 4].distMax)[r % 4] = rays[rIdx].distMax;
+                    }
+                }
+            }
+        }
+        
+        void occludedRayGroup(const Ray* rays, bool* occluded, const uint32_t* rayIndices, uint32_t numRays) const {
+            SLRRequire(numRays <= MaxGroupSize, "QBVH::occludedRayGroup: too many rays.");
+            RayPacket packets[MaxGroupSize / 4];
+            uint32_t numPackets = packRays(rays, rayIndices, numRays, packets);
+            
+            struct Entry {
+                uint32_t nodeIdx;
+                uint64_t activeMask;
+            };
+            const uint32_t StackSize = 64;
+            Entry stack[StackSize];
+            uint32_t depth = 0;
+            stack[depth++] = Entry{0, numRays < 64 ? ((uint64_t)1 << numRays) - 1 : UINT64_MAX};
+            // rays already found to be occluded drop out of the group.
+            uint64_t occludedMask = 0;
+            while (depth > 0) {
+                Entry entry = stack[--depth];
+                uint64_t activeMask = entry.activeMask & ~occludedMask;
+                if (activeMask == 0)
+                    continue;
+                const Node &node = m_nodes[entry.nodeIdx];
+                
+                uint64_t childMasks[4];
+                for (int i = 0; i < 4; ++i)
+                    childMasks[i] = node.children[i].isValid() ? node.intersect(i, packets, numPackets, activeMask) : 0;
+                
+                for (int i = 0; i < 4; ++i) {
+                    const Children &child = node.children[i];
+                    if (childMasks[i] == 0 || !child.isLeafNode)
+                        continue;
+                    const Leaf &leaf = m_leaves[child.idx];
+                    for (uint32_t r = 0; r < numRays; ++r) {
+                        if (((childMasks[i] >> r) & 0x1) == 0 || ((occludedMask >> r) & 0x1))
+                            continue;
+                        uint32_t rIdx = rayIndices[r];
+                        if (occludedLeaf(leaf, rays[rIdx])) {
+                            occluded[rIdx] = true;
+                            occludedMask |= (uint64_t)1 << r;
+                        }
+                    }
+                }
+                for (int i = 0; i < 4; ++i) {
+                    const Children &child = node.children[i];
+                    uint64_t childMask = childMasks[i] & ~occludedMask;
+                    if (childMask == 0 || child.isLeafNode)
+                        continue;
+                    SLRRequire(depth < StackSize, "QBVH::occludedRayGroup: stack overflow");
+                    stack[depth++] = Entry{child.idx, childMask};
+                }
+            }
+        }
+        
+        // packs the rays of a group into packets of four, returns the number of packets.
+        static uint32_t packRays(const Ray* rays, const uint32_t* rayIndices, uint32_t numRays, RayPacket* packets) {
+            uint32_t numPackets = (numRays + 3) / 4;
+            for (uint32_t p = 0; p < numPackets; ++p)
+                packets[p].clear();
+            for (uint32_t r = 0; r < numRays; ++r)
+                packets[r / 4].set(r % 4, rays[rayIndices[r]]);
+            return numPackets;
+        }
+        
+        // groups a chunk of rays by their direction octants.
+        static void classifyByOctant(const Ray* rays, uint32_t numRays, uint32_t octantIndices[8][MaxGroupSize], uint32_t numInOctants[8]) {
+            std::fill(numInOctants, numInOctants + 8, 0);
+            for (uint32_t i = 0; i < numRays; ++i) {
+                const Vector3D &d = rays[i].dir;
+                uint32_t octant = 4 * (d.x >= 0) + 2 * (d.y >= 0) + 1 * (d.z >= 0);
+                octantIndices[octant][numInOctants[octant]++] = i;
+            }
+        }
+        
         Children collapseBBVH(const SBVH &baseBBVH, uint32_t grandparent, uint32_t depth) {
             Children ret;
             const Children invalidChild = {UINT32_MAX};
             
             const SBVH::Node* root = &baseBBVH.m_nodes[grandparent];
             if (root->numLeaves > 0) {
-                uint32_t baseIdx = (uint32_t)m_objLists.size();
-                uint32_t numLeaves = root->numLeaves;
-                SLRAssert(numLeaves <= 16, "The number of leaves for QBVH node is currently limited to 16.");
-                for (int i = 0; i < numLeaves; ++i)
-                    m_objLists.push_back(baseBBVH.m_objLists[root->offsetFirstLeaf + i]);
                 ret.isLeafNode = true;
-                ret.numLeaves = numLeaves;
-                ret.idx = baseIdx;
+                ret.idx = createLeaf(&baseBBVH.m_objLists[root->offsetFirstLeaf], root->numLeaves);
                 return ret;
             }
             
@@ -196,7 +521,6 @@ namespace SLR {
             m_nodes[nodeIdx].children[3] = children[3];
             
             ret.isLeafNode = false;
-            ret.numLeaves = 0;
             ret.idx = nodeIdx;
             return ret;
         }
@@ -235,9 +559,17 @@ namespace SLR {
                     
                     float cSurfaceArea = cBBs[c].surfaceArea();
                     if (child.isLeafNode) {
+                        const Leaf &leaf = m_leaves[child.idx];
+                        // the same units as SBVH: the cost of each triangle, though four of them are tested at once.
                         float costPrims = 0.0f;
-                        for (uint32_t j = 0; j < child.numLeaves; ++j)
-                            costPrims += m_objLists[child.idx + j]->costForIntersect();
+                        for (uint32_t j = 0; j < leaf.numTriangle4s; ++j) {
+                            const Triangle4 &tri4 = m_triangle4s[leaf.offsetTriangle4 + j];
+                            for (int lane = 0; lane < 4; ++lane)
+                                if (tri4.objs[lane])
+                                    costPrims += tri4.objs[lane]->costForIntersect();
+                        }
+                        for (uint32_t j = 0; j < leaf.numObjs; ++j)
+                            costPrims += m_objLists[leaf.offsetObj + j]->costForIntersect();
                         costObj += cSurfaceArea * costPrims;
                     }
                 }
@@ -249,6 +581,8 @@ namespace SLR {
             return costInt + costObj;
         }
         
+        QBVH() { }
+    
     public:
         QBVH(const SBVH &baseBBVH) {
             std::chrono::system_clock::time_point tpStart, tpEnd;
@@ -284,6 +618,64 @@ namespace SLR {
             printf("depth: %u, cost: %g, time: %g[s]\n", m_depth, m_cost, elapsed * 0.001f);
         }
         
+        // Leaves are stored as their object lists and the embedded triangles are rebuilt from the objects on load.
+        void serialize(AcceleratorWriter &writer) const {
+            writer.write((uint32_t)sizeof(Node));
+            writer.write(m_depth);
+            writer.write(m_bounds);
+            writer.writeArray(m_nodes);
+            writer.write((uint32_t)m_leaves.size());
+            for (int i = 0; i < m_leaves.size(); ++i) {
+                const Leaf &leaf = m_leaves[i];
+                std::vector<const SurfaceObject*> objs;
+                for (uint32_t j = 0; j < leaf.numTriangle4s; ++j) {
+                    const Triangle4 &tri4 = m_triangle4s[leaf.offsetTriangle4 + j];
+                    for (int lane = 0; lane < 4; ++lane)
+                        if (tri4.objs[lane])
+                            objs.push_back(tri4.objs[lane]);
+                }
+                objs.insert(objs.end(), m_objLists.begin() + leaf.offsetObj, m_objLists.begin() + leaf.offsetObj + leaf.numObjs);
+                
+                writer.write((uint32_t)objs.size());
+                for (int j = 0; j < objs.size(); ++j)
+                    writer.writeObject(objs[j]);
+            }
+        }
+        
+        // returns nullptr if the data is broken or made for other objects.
+        static QBVH* deserialize(AcceleratorReader &reader) {
+            std::unique_ptr<QBVH> qbvh(new QBVH());
+            uint32_t nodeSize, numLeaves;
+            if (!reader.read(&nodeSize) || nodeSize != sizeof(Node))
+                return nullptr;
+            if (!reader.read(&qbvh->m_depth) || !reader.read(&qbvh->m_bounds) || !reader.readArray(&qbvh->m_nodes) || !reader.read(&numLeaves))
+                return nullptr;
+            std::vector<const SurfaceObject*> objs;
+            for (int i = 0; i < numLeaves; ++i) {
+                uint32_t numObjs;
+                if (!reader.read(&numObjs))
+                    return nullptr;
+                objs.resize(numObjs);
+                for (int j = 0; j < numObjs; ++j)
+                    if (!reader.readObject(&objs[j]) || !objs[j])
+                        return nullptr;
+                qbvh->createLeaf(objs.data(), numObjs);
+            }
+            for (int i = 0; i < qbvh->m_nodes.size(); ++i) {
+                const Node &node = qbvh->m_nodes[i];
+                for (int c = 0; c < 4; ++c) {
+                    Children child = node.children[c];
+                    if (child.isValid() && child.idx >= (child.isLeafNode ? qbvh->m_leaves.size() : qbvh->m_nodes.size()))
+                        return nullptr;
+                }
+            }
+            if (qbvh->m_nodes.empty() || !reader.reachedEnd())
+                return nullptr;
+            
+            qbvh->m_cost = qbvh->calcSAHCost();
+            return qbvh.release();
+        }
+        
         float costForIntersect() const override {
             return m_cost;
         }
@@ -306,11 +698,7 @@ namespace SLR {
                 if (hitFlags == 0)
                     continue;
                 
-                const uint32_t OrderTable[] = {
-                    0x0123, 0x0132, 0x1023, 0x1032,
-                    0x2301, 0x3201, 0x2310, 0x3210
-                };
-                uint32_t encodedOrder = OrderTable[4 * dirIsPositive[node.topAxis] + 2 * dirIsPositive[node.leftAxis] + 1 * dirIsPositive[node.rightAxis]];
+                uint32_t encodedOrder = getEncodedOrder(node, dirIsPositive);
                 uint32_t order[4] = {(encodedOrder >> 0) & 0xF, (encodedOrder >> 4) & 0xF, (encodedOrder >> 8) & 0xF, (encodedOrder >> 12) & 0xF};
                 Children children[] = {node.children[order[0]], node.children[order[1]], node.children[order[2]], node.children[order[3]]};
                 for (int i = 0; i < 4; ++i) {
@@ -330,13 +718,97 @@ namespace SLR {
                     const Children &child = children[i];
                     if (!child.isValid() || !child.isLeafNode)
                         continue;
-                    for (uint32_t j = 0; j < child.numLeaves; ++j)
-                        if (m_objLists[child.idx + j]->intersect(ray, isect))
-                            ray.distMax = isect->dist;
+                    intersectLeaf(m_leaves[child.idx], ray, isect, objDepth);
                 }
             }
             return isect->obj.size() > objDepth;
         }
+        
+        bool occluded(const Ray &ray) const override {
+            const uint32_t StackSize = 64;
+            uint32_t idxStack[StackSize];
+            uint32_t depth = 0;
+            idxStack[depth++] = 0;
+            while (depth > 0) {
+                const Node &node = m_nodes[idxStack[--depth]];
+                uint32_t hitFlags = node.intersect(ray);
+                if (hitFlags == 0)
+                    continue;
+                
+                // Any hit terminates the traversal, so the children are visited without ordering and leaves are tested first.
+                for (int i = 0; i < 4; ++i) {
+                    const Children &child = node.children[i];
+                    if (((hitFlags >> i) & 0x1) == 0 || !child.isValid() || !child.isLeafNode)
+                        continue;
+                    if (occludedLeaf(m_leaves[child.idx], ray))
+                        return true;
+                }
+                for (int i = 0; i < 4; ++i) {
+                    const Children &child = node.children[i];
+                    if (((hitFlags >> i) & 0x1) == 0 || !child.isValid() || child.isLeafNode)
+                        continue;
+                    SLRAssert(depth < StackSize, "QBVH::occluded: stack overflow");
+                    idxStack[depth++] = child.idx;
+                }
+            }
+            return false;
+        }
+        
+        // Rays of the same direction octant are traversed as a group when there are enough of them (e.g. primary or shadow rays in a tile),
+        // otherwise rays are traversed one by one.
+        void intersectStream(Ray* rays, Intersection* isects, bool* hits, uint32_t numRays) const override {
+            uint32_t octantIndices[8][MaxGroupSize];
+            uint32_t numInOctants[8];
+            uint32_t objDepths[MaxGroupSize];
+            for (uint32_t base = 0; base < numRays; base += MaxGroupSize) {
+                uint32_t numRaysInChunk = std::min(numRays - base, (uint32_t)MaxGroupSize);
+                Ray* chunkRays = rays + base;
+                Intersection* chunkIsects = isects + base;
+                for (uint32_t i = 0; i < numRaysInChunk; ++i)
+                    objDepths[i] = (uint32_t)chunkIsects[i].obj.size();
+                
+                classifyByOctant(chunkRays, numRaysInChunk, octantIndices, numInOctants);
+                for (int o = 0; o < 8; ++o) {
+                    if (numInOctants[o] >= MinGroupSize) {
+                        const bool dirIsPositive[] = {((o >> 2) & 0x1) == 1, ((o >> 1) & 0x1) == 1, ((o >> 0) & 0x1) == 1};
+                        intersectRayGroup(chunkRays, chunkIsects, objDepths, octantIndices[o], numInOctants[o], dirIsPositive);
+                    }
+                    else {
+                        for (uint32_t i = 0; i < numInOctants[o]; ++i) {
+                            uint32_t rIdx = octantIndices[o][i];
+                            intersect(chunkRays[rIdx], &chunkIsects[rIdx]);
+                        }
+                    }
+                }
+                
+                for (uint32_t i = 0; i < numRaysInChunk; ++i)
+                    hits[base + i] = chunkIsects[i].obj.size() > objDepths[i];
+            }
+        }
+        
+        void occludedStream(const Ray* rays, bool* occluded, uint32_t numRays) const override {
+            uint32_t octantIndices[8][MaxGroupSize];
+            uint32_t numInOctants[8];
+            for (uint32_t base = 0; base < numRays; base += MaxGroupSize) {
+                uint32_t numRaysInChunk = std::min(numRays - base, (uint32_t)MaxGroupSize);
+                const Ray* chunkRays = rays + base;
+                bool* chunkOccluded = occluded + base;
+                std::fill(chunkOccluded, chunkOccluded + numRaysInChunk, false);
+                
+                classifyByOctant(chunkRays, numRaysInChunk, octantIndices, numInOctants);
+                for (int o = 0; o < 8; ++o) {
+                    if (numInOctants[o] >= MinGroupSize) {
+                        occludedRayGroup(chunkRays, chunkOccluded, octantIndices[o], numInOctants[o]);
+                    }
+                    else {
+                        for (uint32_t i = 0; i < numInOctants[o]; ++i) {
+                            uint32_t rIdx = octantIndices[o][i];
+                            chunkOccluded[rIdx] = this->occluded(chunkRays[rIdx]);
+                        }
+                    }
+                }
+            }
+        }
     };
 }
 
@@ -11,12 +11,14 @@
 #include "../defines.h"
 #include "../references.h"
 #include "../Core/Accelerator.h"
+#include "../Helper/ThreadPool.h"
 
 namespace SLR {
     // References
     // Spatial Splits in Bounding Volume Hierarchies
     class SLR_API SBVH : public Accelerator {
         friend class QBVH;
+        friend class OBVH;
         
         struct Node {
             BoundingBox3D bbox;
@@ -48,20 +50,77 @@ namespace SLR {
             float costForIntersect;
         };
         
+        // nodes and leaves built by a thread. Subtrees built in parallel are spliced into the main one afterward.
+        struct BuildState {
+            std::vector<Node> nodes;
+            std::vector<const SurfaceObject*> objLists;
+            uint32_t depth;
+            
+            BuildState() : depth(0) { }
+        };
+        
+        struct SubtreeTask {
+            uint32_t nodeIdx;
+            uint32_t depth;
+            std::vector<Fragment> fragments;
+            uint32_t numFragments;
+            uint32_t numAdded;
+            BuildState state;
+        };
+        
+        // Upper levels are built serially with parallel binning, and they hand subtrees with fewer fragments than this over to the thread pool.
+        struct ParallelBuildContext {
+            uint32_t numThreads;
+            uint32_t subtreeTaskSize;
+            std::vector<SubtreeTask> subtreeTasks;
+        };
+        
+        static const uint32_t MinParallelBinningSize = 1 << 16;
+        static const uint32_t MinSubtreeTaskSize = 1 << 12;
+        
         uint32_t m_depth;
         float m_cost;
         BoundingBox3D m_bounds;
         std::vector<Node> m_nodes;
         std::vector<const SurfaceObject*> m_objLists;
         
-        uint32_t buildRecursive(Fragment* fragments, uint32_t currentSize, uint32_t maximumBudget, uint32_t start, uint32_t end, uint32_t depth, uint32_t* numAdded) {
+        // calls func(chunkIdx, chunkStart, chunkEnd) for each of ranges [start, end) is divided into on the thread pool.
+        template <typename Func>
+        static void parallelChunks(uint32_t start, uint32_t end, uint32_t numChunks, const Func &func) {
+            ThreadPool &threadPool = ThreadPool::sharedPool();
+            uint32_t chunkSize = (end - start + numChunks - 1) / numChunks;
+            for (uint32_t c = 0; c < numChunks; ++c) {
+                uint32_t chunkStart = std::min(start + c * chunkSize, end);
+                uint32_t chunkEnd = std::min(chunkStart + chunkSize, end);
+                threadPool.enqueue([&func, c, chunkStart, chunkEnd](uint32_t threadID) { func(c, chunkStart, chunkEnd); });
+            }
+            threadPool.wait();
+        }
+        
+        uint32_t buildRecursive(BuildState &state, ParallelBuildContext* context,
+                                Fragment* fragments, uint32_t currentSize, uint32_t maximumBudget, uint32_t start, uint32_t end, uint32_t depth, uint32_t* numAdded) {
 //#define PRINT_PROCESSING_TIME
             *numAdded = 0;
-            uint32_t nodeIdx = (uint32_t)m_nodes.size();
-            m_nodes.emplace_back();
+            uint32_t nodeIdx = (uint32_t)state.nodes.size();
+            state.nodes.emplace_back();
+            
+            // defer a small enough subtree to a task with its own copy of the fragments.
+            if (context && end - start <= context->subtreeTaskSize) {
+                context->subtreeTasks.emplace_back();
+                SubtreeTask &task = context->subtreeTasks.back();
+                task.nodeIdx = nodeIdx;
+                task.depth = depth;
+                task.numFragments = end - start;
+                task.fragments.resize(MemoryBudget * task.numFragments);
+                std::copy(fragments + start, fragments + end, task.fragments.begin());
+                return nodeIdx;
+            }
+            
+            if (++depth > state.depth)
+                state.depth = depth;
             
-            if (++depth > m_depth)
-                m_depth = depth;
+            const bool parallelBinning = context && (end - start) >= MinParallelBinningSize;
+            const uint32_t numChunks = parallelBinning ? context->numThreads : 1;
             
             std::chrono::system_clock::time_point tpStart, tpEnd;
             double elapsed;
@@ -72,11 +131,26 @@ namespace SLR {
             BoundingBox3D parentBB;
             BoundingBox3D parentCentroidBB;
             float leafNodeCost = 0.0f;
-            for (uint32_t i = start; i < end; ++i) {
-                parentBB.unify(fragments[i].bbox);
-                parentCentroidBB.unify(fragments[i].bbox.centroid());
-                float isectCost = fragments[i].costForIntersect;
-                leafNodeCost += isectCost;
+            {
+                std::vector<BoundingBox3D> chunkBBs(numChunks), chunkCentroidBBs(numChunks);
+                std::vector<float> chunkCosts(numChunks, 0.0f);
+                auto calcParentBB = [&](uint32_t c, uint32_t chunkStart, uint32_t chunkEnd) {
+                    for (uint32_t i = chunkStart; i < chunkEnd; ++i) {
+                        chunkBBs[c].unify(fragments[i].bbox);
+                        chunkCentroidBBs[c].unify(fragments[i].bbox.centroid());
+                        float isectCost = fragments[i].costForIntersect;
+                        chunkCosts[c] += isectCost;
+                    }
+                };
+                if (parallelBinning)
+                    parallelChunks(start, end, numChunks, calcParentBB);
+                else
+                    calcParentBB(0, start, end);
+                for (uint32_t c = 0; c < numChunks; ++c) {
+                    parentBB.unify(chunkBBs[c]);
+                    parentCentroidBB.unify(chunkCentroidBBs[c]);
+                    leafNodeCost += chunkCosts[c];
+                }
             }
             const BoundingBox3D::Axis widestAxisOP = parentCentroidBB.widestAxis();
             const BoundingBox3D::Axis widestAxisSP = parentBB.widestAxis();
@@ -95,15 +169,13 @@ namespace SLR {
             if (depth == 1 || depth == 2)
                 printf("calculate parent BBox (%u-%u): %g[ms]\n", start, end, elapsed * 0.001f);
 #endif
-            
+
             if (numObjs == 1) {
-                m_nodes[nodeIdx].initAsLeaf(parentBB, (uint32_t)m_objLists.size(), 1);
-                m_objLists.push_back(fragments[start].obj);
+                state.nodes[nodeIdx].initAsLeaf(parentBB, (uint32_t)state.objLists.size(), 1);
+                state.objLists.push_back(fragments[start].obj);
                 return nodeIdx;
             }
             
-            const float travCost = 1.2f;
-            
             struct ObjectBinInfo {
                 BoundingBox3D bbox;
                 uint32_t numObjs;
@@ -120,8 +192,7 @@ namespace SLR {
                 SpatialBinInfo() : numEntries(0), numExits(0), sumCostEntries(0.0f), sumCostExits(0.0f) {}
             };
             
-            const uint32_t numObjBins = 32;
-            ObjectBinInfo objBinInfos[numObjBins];
+            ObjectBinInfo objBinInfos[NumObjectBins];
             uint32_t splitPlaneOP = 0;
             float minCostByOP = INFINITY;
             
@@ -129,30 +200,46 @@ namespace SLR {
                 tpStart = std::chrono::system_clock::now();
                 
                 // Object Binning
-                for (uint32_t i = start; i < end; ++i) {
-                    const Fragment &fragment = fragments[i];
-                    
-                    uint32_t binIdx = numObjBins * ((fragment.bbox.centerOfAxis(widestAxisOP) - pcBBMin) / (pcBBMax - pcBBMin));
-                    binIdx = std::min(binIdx, numObjBins - 1);
-                    
-                    ++objBinInfos[binIdx].numObjs;
-                    objBinInfos[binIdx].sumCost += fragment.costForIntersect;
-                    objBinInfos[binIdx].bbox.unify(fragment.bbox);
+                std::vector<std::array<ObjectBinInfo, NumObjectBins>> chunkBinInfos(numChunks);
+                auto binObjects = [&](uint32_t c, uint32_t chunkStart, uint32_t chunkEnd) {
+                    ObjectBinInfo* binInfos = chunkBinInfos[c].data();
+                    for (uint32_t i = chunkStart; i < chunkEnd; ++i) {
+                        const Fragment &fragment = fragments[i];
+                        
+                        uint32_t binIdx = NumObjectBins * ((fragment.bbox.centerOfAxis(widestAxisOP) - pcBBMin) / (pcBBMax - pcBBMin));
+                        binIdx = std::min(binIdx, NumObjectBins - 1);
+                        
+                        ++binInfos[binIdx].numObjs;
+                        binInfos[binIdx].sumCost += fragment.costForIntersect;
+                        binInfos[binIdx].bbox.unify(fragment.bbox);
+                    }
+                };
+                if (parallelBinning)
+                    parallelChunks(start, end, numChunks, binObjects);
+                else
+                    binObjects(0, start, end);
+                for (uint32_t c = 0; c < numChunks; ++c) {
+                    for (uint32_t b = 0; b < NumObjectBins; ++b) {
+                        const ObjectBinInfo &src = chunkBinInfos[c][b];
+                        objBinInfos[b].numObjs += src.numObjs;
+                        objBinInfos[b].sumCost += src.sumCost;
+                        objBinInfos[b].bbox.unify(src.bbox);
+                    }
                 }
                 
                 // evaluate SAH cost for every pair of child partitions and determine a plane with the minimum cost.
-                for (uint32_t i = 0; i < numObjBins - 1; ++i) {
+                for (uint32_t i = 0; i < NumObjectBins - 1; ++i) {
                     BoundingBox3D b0, b1;
                     float cost0 = 0.0f, cost1 = 0.0f;
                     for (int j = 0; j <= i; ++j) {
                         b0.unify(objBinInfos[j].bbox);
                         cost0 += objBinInfos[j].sumCost;
                     }
-                    for (int j = i + 1; j < numObjBins; ++j) {
+                    for (int j = i + 1; j < NumObjectBins; ++j) {
                         b1.unify(objBinInfos[j].bbox);
                         cost1 += objBinInfos[j].sumCost;
                     }
-                    float cost = travCost + (b0.surfaceArea() * cost0 + b1.surfaceArea() * cost1) / surfaceAreaParent;
+                    float cost = TraversalCost + (b0.surfaceArea() * cost0 + b1.surfaceArea() * cost1) / surfaceAreaParent;
                     if (cost < minCostByOP) {
                         minCostByOP = cost;
                         splitPlaneOP = i;
@@ -172,60 +259,76 @@ namespace SLR {
             BoundingBox3D bbLeftOP, bbRightOP;
             for (int j = 0; j <= splitPlaneOP; ++j)
                 bbLeftOP.unify(objBinInfos[j].bbox);
-            for (int j = splitPlaneOP + 1; j < numObjBins; ++j)
+            for (int j = splitPlaneOP + 1; j < NumObjectBins; ++j)
                 bbRightOP.unify(objBinInfos[j].bbox);
             BoundingBox3D overlappedBB = intersection(bbLeftOP, bbRightOP);
             float overlappedSA = 0;
             if (overlappedBB.isValid())
                 overlappedSA = overlappedBB.surfaceArea();
             
-            const uint32_t numSBins = 16;
-            const float spatialBinWidth = parentBB.width(widestAxisSP) / numSBins;
-            SpatialBinInfo sBinInfos[numSBins];
+            const float spatialBinWidth = parentBB.width(widestAxisSP) / NumSpatialBins;
+            SpatialBinInfo sBinInfos[NumSpatialBins];
             uint32_t splitPlaneSP = 0;
             float minCostBySP = INFINITY;
             
-            float alpha = 1e-5;
-            if (overlappedSA / m_bounds.surfaceArea() > alpha) {
+            if (overlappedSA / m_bounds.surfaceArea() > SpatialSplitThreshold) {
                 tpStart = std::chrono::system_clock::now();
                 
                 // Spatial Binning
-                for (int i = start; i < end; ++i) {
-                    const Fragment &fragment = fragments[i];
-                    
-                    const BoundingBox3D &bbox = fragment.bbox;
-                    uint32_t entryBin = numSBins * ((bbox.minP[widestAxisSP] - pBBMin) / (pBBMax - pBBMin));
-                    uint32_t exitBin = numSBins * ((bbox.maxP[widestAxisSP] - pBBMin) / (pBBMax - pBBMin));
-                    entryBin = std::min(entryBin, numSBins - 1);
-                    exitBin = std::min(exitBin, numSBins - 1);
-                    
-                    ++sBinInfos[entryBin].numEntries;
-                    ++sBinInfos[exitBin].numExits;
-                    
-                    float isectCost = fragment.costForIntersect;
-                    sBinInfos[entryBin].sumCostEntries += isectCost;
-                    sBinInfos[exitBin].sumCostExits += isectCost;
-                    
-                    for (int binIdx = entryBin; binIdx <= exitBin; ++binIdx) {
-                        float splitPosMin = binIdx * spatialBinWidth + pBBMin;
-                        BoundingBox3D choppedBB = fragment.obj->choppedBounds(widestAxisSP, splitPosMin, splitPosMin + spatialBinWidth);
-                        sBinInfos[binIdx].bbox.unify(intersection(choppedBB, bbox));
+                std::vector<std::array<SpatialBinInfo, NumSpatialBins>> chunkBinInfos(numChunks);
+                auto binSpatially = [&](uint32_t c, uint32_t chunkStart, uint32_t chunkEnd) {
+                    SpatialBinInfo* binInfos = chunkBinInfos[c].data();
+                    for (uint32_t i = chunkStart; i < chunkEnd; ++i) {
+                        const Fragment &fragment = fragments[i];
+                        
+                        const BoundingBox3D &bbox = fragment.bbox;
+                        uint32_t entryBin = NumSpatialBins * ((bbox.minP[widestAxisSP] - pBBMin) / (pBBMax - pBBMin));
+                        uint32_t exitBin = NumSpatialBins * ((bbox.maxP[widestAxisSP] - pBBMin) / (pBBMax - pBBMin));
+                        entryBin = std::min(entryBin, NumSpatialBins - 1);
+                        exitBin = std::min(exitBin, NumSpatialBins - 1);
+                        
+                        ++binInfos[entryBin].numEntries;
+                        ++binInfos[exitBin].numExits;
+                        
+                        float isectCost = fragment.costForIntersect;
+                        binInfos[entryBin].sumCostEntries += isectCost;
+                        binInfos[exitBin].sumCostExits += isectCost;
+                        
+                        for (int binIdx = entryBin; binIdx <= exitBin; ++binIdx) {
+                            float splitPosMin = binIdx * spatialBinWidth + pBBMin;
+                            BoundingBox3D choppedBB = fragment.obj->choppedBounds(widestAxisSP, splitPosMin, splitPosMin + spatialBinWidth);
+                            binInfos[binIdx].bbox.unify(intersection(choppedBB, bbox));
+                        }
+                    }
+                };
+                if (parallelBinning)
+                    parallelChunks(start, end, numChunks, binSpatially);
+                else
+                    binSpatially(0, start, end);
+                for (uint32_t c = 0; c < numChunks; ++c) {
+                    for (uint32_t b = 0; b < NumSpatialBins; ++b) {
+                        const SpatialBinInfo &src = chunkBinInfos[c][b];
+                        sBinInfos[b].numEntries += src.numEntries;
+                        sBinInfos[b].numExits += src.numExits;
+                        sBinInfos[b].sumCostEntries += src.sumCostEntries;
+                        sBinInfos[b].sumCostExits += src.sumCostExits;
+                        sBinInfos[b].bbox.unify(src.bbox);
                     }
                 }
                 
                 // evaluate SAH cost for every pair of child partitions and determine a plane with the minimum cost.
-                for (uint32_t i = 0; i < numSBins - 1; ++i) {
+                for (uint32_t i = 0; i < NumSpatialBins - 1; ++i) {
                     BoundingBox3D b0, b1;
                     float cost0 = 0.0f, cost1 = 0.0f;
                     for (int j = 0; j <= i; ++j) {
                         b0.unify(sBinInfos[j].bbox);
                         cost0 += sBinInfos[j].sumCostEntries;
                     }
-                    for (int j = i + 1; j < numSBins; ++j) {
+                    for (int j = i + 1; j < NumSpatialBins; ++j) {
                         b1.unify(sBinInfos[j].bbox);
                         cost1 += sBinInfos[j].sumCostExits;
                     }
-                    float cost = travCost + (b0.surfaceArea() * cost0 + b1.surfaceArea() * cost1) / surfaceAreaParent;
+                    float cost = TraversalCost + (b0.surfaceArea() * cost0 + b1.surfaceArea() * cost1) / surfaceAreaParent;
                     if (cost < minCostBySP) {
                         minCostBySP = cost;
                         splitPlaneSP = i;
@@ -241,15 +344,15 @@ namespace SLR {
             }
             
             if (leafNodeCost < minCostByOP && leafNodeCost < minCostBySP) {
-                m_nodes[nodeIdx].initAsLeaf(parentBB, (uint32_t)m_objLists.size(), numObjs);
+                state.nodes[nodeIdx].initAsLeaf(parentBB, (uint32_t)state.objLists.size(), numObjs);
                 for (uint32_t i = start; i < end; ++i)
-                    m_objLists.push_back(fragments[i].obj);
+                    state.objLists.push_back(fragments[i].obj);
                 return nodeIdx;
             }
             else if (minCostByOP < minCostBySP) {
                 tpStart = std::chrono::system_clock::now();
                 
-                float pivot = pcBBMin + (pcBBMax - pcBBMin) / numObjBins * (splitPlaneOP + 1);
+                float pivot = pcBBMin + (pcBBMax - pcBBMin) / NumObjectBins * (splitPlaneOP + 1);
                 auto firstOf2ndGroup = std::partition(fragments + start, fragments + end, [&widestAxisOP, &pivot](const Fragment &fragment) {
                     return fragment.bbox.centerOfAxis(widestAxisOP) < pivot;
                 });
@@ -262,11 +365,11 @@ namespace SLR {
                 if (depth == 1 || depth == 2)
                     printf("Object Partitioning: %g[ms]\n", elapsed * 0.001f);
 #endif
-                
+
                 uint32_t numLeftAdded, numRightAdded;
-                uint32_t c0 = buildRecursive(fragments, currentSize, maximumBudget, start, splitIdx, depth, &numLeftAdded);
-                uint32_t c1 = buildRecursive(fragments, currentSize + numLeftAdded, maximumBudget, splitIdx + numLeftAdded, end + numLeftAdded, depth, &numRightAdded);
-                m_nodes[nodeIdx].initAsInternal(parentBB, c0, c1, widestAxisOP);
+                uint32_t c0 = buildRecursive(state, context, fragments, currentSize, maximumBudget, start, splitIdx, depth, &numLeftAdded);
+                uint32_t c1 = buildRecursive(state, context, fragments, currentSize + numLeftAdded, maximumBudget, splitIdx + numLeftAdded, end + numLeftAdded, depth, &numRightAdded);
+                state.nodes[nodeIdx].initAsInternal(parentBB, c0, c1, widestAxisOP);
                 *numAdded += numLeftAdded + numRightAdded;
                 return nodeIdx;
             }
@@ -277,7 +380,7 @@ namespace SLR {
                 uint32_t numRightsBySplit = 0;
                 for (int j = 0; j <= splitPlaneSP; ++j)
                     numLeftsBySplit += sBinInfos[j].numEntries;
-                for (int j = splitPlaneSP + 1; j < numSBins; ++j)
+                for (int j = splitPlaneSP + 1; j < NumSpatialBins; ++j)
                     numRightsBySplit += sBinInfos[j].numExits;
                 
                 uint32_t numLeftIndices = 0, numRightIndices = 0;
@@ -286,18 +389,18 @@ namespace SLR {
                 Fragment* rightFragments = newFragments + numLeftsBySplit;
                 for (int i = start; i < end; ++i) {
                     BoundingBox3D &bbox = fragments[i].bbox;
-                    uint32_t entryBin = numSBins * ((bbox.minP[widestAxisSP] - pBBMin) / (pBBMax - pBBMin));
-                    uint32_t exitBin = numSBins * ((bbox.maxP[widestAxisSP] - pBBMin) / (pBBMax - pBBMin));
-                    entryBin = std::min(entryBin, numSBins - 1);
-                    exitBin = std::min(exitBin, numSBins - 1);
-                    
+                    uint32_t entryBin = NumSpatialBins * ((bbox.minP[widestAxisSP] - pBBMin) / (pBBMax - pBBMin));
+                    uint32_t exitBin = NumSpatialBins * ((bbox.maxP[widestAxisSP] - pBBMin) / (pBBMax - pBBMin));
+                    entryBin = std::min(entryBin, NumSpatialBins - 1);
+                    exitBin = std::min(exitBin, NumSpatialBins - 1);
+
 //                    // consider unsplitting
 //                    float isectCost = fragments[i].obj->costForIntersect();
 //                    float splitCost = splitPlane.leftBBox.surfaceArea() * splitPlane.leftCost + splitPlane.rightBBox.surfaceArea() * splitPlane.rightCost;
 //                    float leftAlignCost = calcUnion(splitPlane.leftBBox, bbox).surfaceArea() * splitPlane.leftCost + splitPlane.rightBBox.surfaceArea() * (splitPlane.rightCost - isectCost);
 //                    float rightAlignCost = splitPlane.leftBBox.surfaceArea() * (splitPlane.leftCost - isectCost) + calcUnion(splitPlane.rightBBox, bbox).surfaceArea() * splitPlane.rightCost;
 //                    int32_t cheapest = cheapest = splitCost < leftAlignCost ? (splitCost < rightAlignCost ? 0 : 1) : (leftAlignCost < rightAlignCost ? -1 : 1);
-                    
+
                     if (exitBin <= splitPlaneSP) {
                         leftFragments[numLeftIndices++] = fragments[i];
                     }
@@ -336,17 +439,44 @@ namespace SLR {
                 if (depth == 1 || depth == 2)
                     printf("Spatial Partitioning: %g[ms]\n", elapsed * 0.001f);
 #endif
-                
+
                 uint32_t numLeftAdded, numRightAdded;
-                uint32_t c0 = buildRecursive(fragments, currentSize + *numAdded, maximumBudget, start, splitIdx, depth, &numLeftAdded);
-                uint32_t c1 = buildRecursive(fragments, currentSize + *numAdded + numLeftAdded, maximumBudget, splitIdx + numLeftAdded, end + *numAdded + numLeftAdded, depth, &numRightAdded);
-                m_nodes[nodeIdx].initAsInternal(parentBB, c0, c1, widestAxisSP);
+                uint32_t c0 = buildRecursive(state, context, fragments, currentSize + *numAdded, maximumBudget, start, splitIdx, depth, &numLeftAdded);
+                uint32_t c1 = buildRecursive(state, context, fragments, currentSize + *numAdded + numLeftAdded, maximumBudget, splitIdx + numLeftAdded, end + *numAdded + numLeftAdded, depth, &numRightAdded);
+                state.nodes[nodeIdx].initAsInternal(parentBB, c0, c1, widestAxisSP);
                 *numAdded += numLeftAdded + numRightAdded;
                 return nodeIdx;
             }
 #undef PRINT_PROCESSING_TIME
         }
         
+        // moves a subtree built by a task into the place of its placeholder node.
+        static void spliceSubtree(BuildState &state, const SubtreeTask &task) {
+            const BuildState &subState = task.state;
+            uint32_t baseNodeIdx = (uint32_t)state.nodes.size();
+            uint32_t baseObjIdx = (uint32_t)state.objLists.size();
+            auto globalIndex = [&task, &baseNodeIdx](uint32_t localIdx) {
+                return localIdx == 0 ? task.nodeIdx : baseNodeIdx + localIdx - 1;
+            };
+            
+            state.objLists.insert(state.objLists.end(), subState.objLists.begin(), subState.objLists.end());
+            for (uint32_t i = 0; i < subState.nodes.size(); ++i) {
+                Node node = subState.nodes[i];
+                if (node.numLeaves > 0) {
+                    node.offsetFirstLeaf += baseObjIdx;
+                }
+                else {
+                    node.c0 = globalIndex(node.c0);
+                    node.c1 = globalIndex(node.c1);
+                }
+                if (i == 0)
+                    state.nodes[task.nodeIdx] = node;
+                else
+                    state.nodes.push_back(node);
+            }
+            state.depth = std::max(state.depth, subState.depth);
+        }
+        
         float calcSAHCost() const {
             const float Ci = 1.2f;
             const float Cl = 0.0f;
@@ -375,14 +505,22 @@ namespace SLR {
             return costInt + costLeaf + costObj;
         }
         
+        SBVH() { }
+    
     public:
+        // build parameters, which the structure depends on besides the objects.
+        static constexpr float TraversalCost = 1.2f;
+        static const uint32_t NumObjectBins = 32;
+        static const uint32_t NumSpatialBins = 16;
+        static const uint32_t MemoryBudget = 5;
+        static constexpr float SpatialSplitThreshold = 1e-5f;
+        
         SBVH(const std::vector<SurfaceObject*> &objs) {
             std::chrono::system_clock::time_point tpStart, tpEnd;
             double elapsed;
             
             tpStart = std::chrono::system_clock::now();
             
-            const uint32_t MemoryBudget = 5;
             Fragment* fragments = new Fragment[MemoryBudget * objs.size()];
             for (int i = 0; i < objs.size(); ++i) {
                 BoundingBox3D bb = objs[i]->bounds();
@@ -392,11 +530,40 @@ namespace SLR {
                 fragments[i].costForIntersect = objs[i]->costForIntersect();
             }
             
-            m_depth = 0;
+            const uint32_t numObjs = (uint32_t)objs.size();
+            ParallelBuildContext context;
+            context.numThreads = ThreadPool::sharedPool().numThreads();
+            context.subtreeTaskSize = std::max(numObjs / (8 * context.numThreads), MinSubtreeTaskSize);
+            bool buildInParallel = context.numThreads > 1 && numObjs > 2 * context.subtreeTaskSize;
+            
+            BuildState state;
             uint32_t numAdded;
-            buildRecursive(fragments, (uint32_t)objs.size(), MemoryBudget * (uint32_t)objs.size(), 0, (uint32_t)objs.size(), 0, &numAdded);
+            buildRecursive(state, buildInParallel ? &context : nullptr, fragments, numObjs, MemoryBudget * numObjs, 0, numObjs, 0, &numAdded);
             delete[] fragments;
             
+            if (buildInParallel) {
+                ThreadPool &threadPool = ThreadPool::sharedPool();
+                for (int i = 0; i < context.subtreeTasks.size(); ++i) {
+                    SubtreeTask* task = &context.subtreeTasks[i];
+                    threadPool.enqueue([this, task](uint32_t threadID) {
+                        buildRecursive(task->state, nullptr, task->fragments.data(), task->numFragments, MemoryBudget * task->numFragments,
+                                       0, task->numFragments, task->depth, &task->numAdded);
+                        task->fragments = std::vector<Fragment>();
+                    });
+                }
+                threadPool.wait();
+                
+                for (int i = 0; i < context.subtreeTasks.size(); ++i) {
+                    const SubtreeTask &task = context.subtreeTasks[i];
+                    spliceSubtree(state, task);
+                    numAdded += task.numAdded;
+                }
+            }
+            
+            m_depth = state.depth;
+            m_nodes = std::move(state.nodes);
+            m_objLists = std::move(state.objLists);
+            
             tpEnd = std::chrono::system_clock::now();
             elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(tpEnd - tpStart).count();
             
@@ -406,6 +573,40 @@ namespace SLR {
 //#endif
         }
         
+        void serialize(AcceleratorWriter &writer) const {
+            writer.write((uint32_t)sizeof(Node));
+            writer.write(m_depth);
+            writer.write(m_bounds);
+            writer.writeArray(m_nodes);
+            writer.write((uint32_t)m_objLists.size());
+            for (int i = 0; i < m_objLists.size(); ++i)
+                writer.writeObject(m_objLists[i]);
+        }
+        
+        // returns nullptr if the data is broken or made for other objects.
+        static SBVH* deserialize(AcceleratorReader &reader) {
+            std::unique_ptr<SBVH> sbvh(new SBVH());
+            uint32_t nodeSize, numObjs;
+            if (!reader.read(&nodeSize) || nodeSize != sizeof(Node))
+                return nullptr;
+            if (!reader.read(&sbvh->m_depth) || !reader.read(&sbvh->m_bounds) || !reader.readArray(&sbvh->m_nodes) || !reader.read(&numObjs))
+                return nullptr;
+            sbvh->m_objLists.resize(numObjs);
+            for (int i = 0; i < numObjs; ++i)
+                if (!reader.readObject(&sbvh->m_objLists[i]) || !sbvh->m_objLists[i])
+                    return nullptr;
+            for (int i = 0; i < sbvh->m_nodes.size(); ++i) {
+                const Node &node = sbvh->m_nodes[i];
+                if (node.numLeaves > 0 ? node.offsetFirstLeaf + node.numLeaves > numObjs : (node.c0 >= sbvh->m_nodes.size() || node.c1 >= sbvh->m_nodes.size()))
+                    return nullptr;
+            }
+            if (sbvh->m_nodes.empty() || !reader.reachedEnd())
+                return nullptr;
+            
+            sbvh->m_cost = sbvh->calcSAHCost();
+            return sbvh.release();
+        }
+        
         float costForIntersect() const override {
             return m_cost;
         }
@@ -433,13 +634,43 @@ namespace SLR {
                     idxStack[depth++] = positiveDir ? node.c0 : node.c1;
                 }
                 else {
-                    for (uint32_t i = 0; i < node.numLeaves; ++i)
-                        if (m_objLists[node.offsetFirstLeaf + i]->intersect(ray, isect))
+                    for (uint32_t i = 0; i < node.numLeaves; ++i) {
+                        uint32_t prevDepth = isect->obj.size();
+                        if (m_objLists[node.offsetFirstLeaf + i]->intersect(ray, isect)) {
                             ray.distMax = isect->dist;
+                            isect->obj.erase(objDepth, prevDepth);
+                        }
+                    }
                 }
             }
             return isect->obj.size() > objDepth;
         }
+        
+        bool occluded(const Ray &ray) const override {
+            bool dirIsPositive[] = {ray.dir.x >= 0, ray.dir.y >= 0, ray.dir.z >= 0};
+            
+            const uint32_t StackSize = 64;
+            uint32_t idxStack[StackSize];
+            uint32_t depth = 0;
+            idxStack[depth++] = 0;
+            while (depth > 0) {
+                const Node &node = m_nodes[idxStack[--depth]];
+                if (!node.bbox.intersect(ray))
+                    continue;
+                if (node.numLeaves == 0) {
+                    SLRAssert(depth < StackSize, "SBVH::occluded: stack overflow");
+                    bool positiveDir = dirIsPositive[node.axis];
+                    idxStack[depth++] = positiveDir ? node.c1 : node.c0;
+                    idxStack[depth++] = positiveDir ? node.c0 : node.c1;
+                }
+                else {
+                    for (uint32_t i = 0; i < node.numLeaves; ++i)
+                        if (m_objLists[node.offsetFirstLeaf + i]->occluded(ray))
+                            return true;
+                }
+            }
+            return false;
+        }
     };    
 }
 
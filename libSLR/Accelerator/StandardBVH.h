@@ -273,13 +273,43 @@ namespace SLR {
                     idxStack[depth++] = positiveDir ? node.c0 : node.c1;
                 }
                 else {
-                    for (uint32_t i = 0; i < node.numLeaves; ++i)
-                        if (m_objLists[node.offsetFirstLeaf + i]->intersect(ray, isect))
+                    for (uint32_t i = 0; i < node.numLeaves; ++i) {
+                        uint32_t prevDepth = isect->obj.size();
+                        if (m_objLists[node.offsetFirstLeaf + i]->intersect(ray, isect)) {
                             ray.distMax = isect->dist;
+                            isect->obj.erase(objDepth, prevDepth);
+                        }
+                    }
                 }
             }
             return isect->obj.size() > objDepth;
         }
+        
+        bool occluded(const Ray &ray) const override {
+            bool dirIsPositive[] = {ray.dir.x >= 0, ray.dir.y >= 0, ray.dir.z >= 0};
+            
+            const uint32_t StackSize = 64;
+            uint32_t idxStack[StackSize];
+            uint32_t depth = 0;
+            idxStack[depth++] = 0;
+            while (depth > 0) {
+                const Node &node = m_nodes[idxStack[--depth]];
+                if (!node.bbox.intersect(ray))
+                    continue;
+                if (node.numLeaves == 0) {
+                    SLRAssert(depth < StackSize, "StandardBVH::occluded: stack overflow");
+                    bool positiveDir = dirIsPositive[node.axis];
+                    idxStack[depth++] = positiveDir ? node.c1 : node.c0;
+                    idxStack[depth++] = positiveDir ? node.c0 : node.c1;
+                }
+                else {
+                    for (uint32_t i = 0; i < node.numLeaves; ++i)
+                        if (m_objLists[node.offsetFirstLeaf + i]->occluded(ray))
+                            return true;
+                }
+            }
+            return false;
+        }
     };
 }
 
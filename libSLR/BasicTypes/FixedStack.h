@@ -0,0 +1,55 @@
+//
+//  FixedStack.h
+//
+//  Created by 渡部 心 on 2016/10/03.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#ifndef SLR_FixedStack_h
+#define SLR_FixedStack_h
+
+#include "../defines.h"
+#include "../references.h"
+
+namespace SLR {
+    // stack with inline storage, it never allocates and copies only the elements in use.
+    template <typename T, uint32_t Capacity>
+    class FixedStack {
+        T m_elems[Capacity];
+        uint32_t m_size;
+    public:
+        FixedStack() : m_size(0) { };
+        FixedStack(const FixedStack &s) : m_size(s.m_size) {
+            std::copy(s.m_elems, s.m_elems + m_size, m_elems);
+        };
+        FixedStack &operator=(const FixedStack &s) {
+            m_size = s.m_size;
+            std::copy(s.m_elems, s.m_elems + m_size, m_elems);
+            return *this;
+        };
+        
+        void push(const T &value) {
+            SLRAssert(m_size < Capacity, "FixedStack: overflow.");
+            m_elems[m_size++] = value;
+        };
+        void pop() {
+            SLRAssert(m_size > 0, "FixedStack: underflow.");
+            --m_size;
+        };
+        const T &top() const { return m_elems[m_size - 1]; };
+        T &top() { return m_elems[m_size - 1]; };
+        
+        uint32_t size() const { return m_size; };
+        bool empty() const { return m_size == 0; };
+        void clear() { m_size = 0; };
+        
+        // removes the elements in [begin, end) and moves down the ones above them.
+        void erase(uint32_t begin, uint32_t end) {
+            SLRAssert(begin <= end && end <= m_size, "FixedStack: invalid range.");
+            std::copy(m_elems + end, m_elems + m_size, m_elems + begin);
+            m_size -= end - begin;
+        };
+    };
+}
+
+#endif
@@ -37,6 +37,13 @@ namespace SLR {
             selectedLambda = wls.selectedLambda;
             flags = wls.flags;
         }
+        WavelengthSamplesTemplate &operator=(const WavelengthSamplesTemplate &wls) {
+            for (int i = 0; i < N; ++i)
+                lambdas[i] = wls.lambdas[i];
+            selectedLambda = wls.selectedLambda;
+            flags = wls.flags;
+            return *this;
+        }
         
         RealType &operator[](uint32_t index) {
             SLRAssert(index < N, "\"index\" is out of range [0, %u].", N - 1);
@@ -236,10 +243,16 @@ namespace SLR {
             SLRAssert(!std::isinf(u) && !std::isnan(u) && !std::isinf(v) && !std::isnan(v) && !std::isinf(scale) && !std::isnan(scale), "Invalid value.");
         }
         
-        SampledSpectrumTemplate<RealType, N> evaluate(const WavelengthSamplesTemplate<RealType, N> &wls) const override {
+        // resolves the spectrum into a weighted sum (including the scale) of at most 4 tabulated spectra.
+        // Unused entries have zero weights. Returns false if the point is out of the grid.
+        bool computeCoefficients(uint8_t usedIndices[4], float weights[4]) const {
             using namespace Upsampling;
+            for (int i = 0; i < 4; ++i) {
+                usedIndices[i] = 0;
+                weights[i] = 0.0f;
+            }
             if (u < 0.0f || u >= GridWidth || v < 0.0f || v >= GridHeight)
-                return SampledSpectrumTemplate<RealType, N>::Zero;
+                return false;
             
             int32_t ui = (int32_t)u;
             int32_t vi = (int32_t)v;
@@ -252,8 +265,7 @@ namespace SLR {
             const uint8_t* indices = cell->idx;
             const uint8_t numPoints = cell->num_points;
             
-            uint8_t usedIndices[4] = {UINT8_MAX, UINT8_MAX, UINT8_MAX, UINT8_MAX};
-            float weights[4] = {0, 0, 0, 0};
+            bool found = false;
             if (cell->inside) { // fast path for normal inner quads:
                 // the layout of the vertices in the quad is:
                 //  2  3
@@ -269,6 +281,7 @@ namespace SLR {
                 usedIndices[1] = indices[1];
                 usedIndices[2] = indices[2];
                 usedIndices[3] = indices[3];
+                found = true;
             }
             else {
                 // need to go through triangulation :(
@@ -306,11 +319,19 @@ namespace SLR {
                     usedIndices[0] = idx;
                     usedIndices[1] = indices[i];
                     usedIndices[2] = indices[0];
+                    found = true;
                     break;
                 }
             }
-            SLRAssert(usedIndices[0] != UINT8_MAX, "Adjacent points must be selected at this point.");
-            
+            SLRAssert(found, "Adjacent points must be selected at this point.");
+            (void)found; // only checked in debug builds.
+            for (int i = 0; i < 4; ++i)
+                weights[i] *= scale;
+            return true;
+        }
+        
+        static SampledSpectrumTemplate<RealType, N> evaluateCoefficients(const uint8_t usedIndices[4], const float weights[4], const WavelengthSamplesTemplate<RealType, N> &wls) {
+            using namespace Upsampling;
             SampledSpectrumTemplate<RealType, N> ret(0.0);
             for (int i = 0; i < WavelengthSamplesTemplate<RealType, N>::NumComponents; ++i) {
                 RealType lambda = wls[i];
@@ -321,21 +342,20 @@ namespace SLR {
                 uint32_t sBinNext = (sBin + 1 < NumWavelengthSamples) ? (sBin + 1) : (NumWavelengthSamples - 1);
                 SLRAssert(sBin < NumWavelengthSamples && sBinNext < NumWavelengthSamples, "Spectrum bin index is out of range.");
                 RealType t = sBinF - sBin;
-                if (cell->inside) {
-                    for (int j = 0; j < 4; ++j) {
-                        const float* spectrum = spectrum_data_points[usedIndices[j]].spectrum;
-                        ret[i] += weights[j] * (spectrum[sBin] * (1 - t) + spectrum[sBinNext] * t);
-                    }
-                }
-                else {
-                    for (int j = 0; j < 3; ++j) {
-                        const float* spectrum = spectrum_data_points[usedIndices[j]].spectrum;
-                        ret[i] += weights[j] * (spectrum[sBin] * (1 - t) + spectrum[sBinNext] * t);
-                    }
+                for (int j = 0; j < 4; ++j) {
+                    const float* spectrum = spectrum_data_points[usedIndices[j]].spectrum;
+                    ret[i] += weights[j] * (spectrum[sBin] * (1 - t) + spectrum[sBinNext] * t);
                 }
             }
-            
-            return ret * scale;
+            return ret;
+        }
+        
+        SampledSpectrumTemplate<RealType, N> evaluate(const WavelengthSamplesTemplate<RealType, N> &wls) const override {
+            uint8_t usedIndices[4];
+            float weights[4];
+            if (!computeCoefficients(usedIndices, weights))
+                return SampledSpectrumTemplate<RealType, N>::Zero;
+            return evaluateCoefficients(usedIndices, weights, wls);
         }
         
         ContinuousSpectrumTemplate<RealType, N>* createScaled(RealType scale) const override {
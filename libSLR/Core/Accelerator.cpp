@@ -6,3 +6,220 @@
 //
 
 #include "Accelerator.h"
+#include "../Accelerator/StandardBVH.h"
+#include "../Accelerator/SBVH.h"
+#include "../Accelerator/QBVH.h"
+#include "../Accelerator/OBVH.h"
+#include "../Accelerator/MotionBVH.h"
+
+#include <fstream>
+
+namespace SLR {
+    static const uint64_t FNV_OFFSET_BASIS_64 = 14695981039346656037U;
+    static const uint64_t FNV_PRIME_64 = 1099511628211LLU;
+    
+    static const uint32_t CacheMagic = 0x43524C53; // "SLRC"
+    static const uint32_t CacheVersion = 2;
+    
+    struct CacheHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t type;
+        uint32_t numObjs;
+        uint64_t hash;
+    };
+    
+    static void hashBytes(uint64_t* hash, const void* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        for (int i = 0; i < size; ++i)
+            *hash = (FNV_PRIME_64 * *hash) ^ bytes[i];
+    }
+    
+    // The key depends on the format version, the type and the build parameters of the structure
+    // and the geometry of the objects (the vertices of triangles, the bounds otherwise) in their order.
+    static uint64_t calcCacheKey(AcceleratorType type, const std::vector<SurfaceObject*> &objs) {
+        uint64_t hash = FNV_OFFSET_BASIS_64;
+        
+        uint32_t format[] = {CacheVersion, (uint32_t)type, (uint32_t)objs.size(), SBVH::NumObjectBins, SBVH::NumSpatialBins, SBVH::MemoryBudget};
+        float buildParams[] = {SBVH::TraversalCost, SBVH::SpatialSplitThreshold};
+        hashBytes(&hash, format, sizeof(format));
+        hashBytes(&hash, buildParams, sizeof(buildParams));
+        
+        for (int i = 0; i < objs.size(); ++i) {
+            const SurfaceObject* obj = objs[i];
+            Point3D p[3];
+            if (obj->getEmbeddableTriangle(&p[0], &p[1], &p[2])) {
+                float values[] = {p[0].x, p[0].y, p[0].z, p[1].x, p[1].y, p[1].z, p[2].x, p[2].y, p[2].z};
+                hashBytes(&hash, values, sizeof(values));
+            }
+            else {
+                BoundingBox3D bb = obj->bounds();
+                float values[] = {bb.minP.x, bb.minP.y, bb.minP.z, bb.maxP.x, bb.maxP.y, bb.maxP.z};
+                hashBytes(&hash, values, sizeof(values));
+            }
+            float cost = obj->costForIntersect();
+            hashBytes(&hash, &cost, sizeof(cost));
+        }
+        return hash;
+    }
+    
+    static std::string getCachePath(const std::string &dir, AcceleratorType type, uint64_t key) {
+        const char* typeName = type == AcceleratorType::QBVH ? "QBVH" : "SBVH";
+        char name[64];
+        snprintf(name, sizeof(name), "%s_%016llx.cache", typeName, (unsigned long long)key);
+        return dir + "/" + name;
+    }
+    
+    template <typename AcceleratorClass>
+    static AcceleratorClass* loadFromCache(const std::string &dir, AcceleratorType type, const std::vector<SurfaceObject*> &objs, uint64_t key) {
+        // plain read of the whole file, the reader copies the arrays out of it.
+        std::string path = getCachePath(dir, type, key);
+        std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+        if (!ifs)
+            return nullptr;
+        std::streamoff fileSize = ifs.tellg();
+        if (fileSize < (std::streamoff)sizeof(CacheHeader))
+            return nullptr;
+        std::vector<uint8_t> data((size_t)fileSize);
+        ifs.seekg(0);
+        if (!ifs.read((char*)data.data(), fileSize))
+            return nullptr;
+        
+        CacheHeader header;
+        std::memcpy(&header, data.data(), sizeof(CacheHeader));
+        if (header.magic != CacheMagic || header.version != CacheVersion ||
+            header.type != (uint32_t)type || header.numObjs != objs.size() || header.hash != key)
+            return nullptr;
+        
+        AcceleratorReader reader(objs, data.data() + sizeof(CacheHeader), data.size() - sizeof(CacheHeader));
+        AcceleratorClass* accel = AcceleratorClass::deserialize(reader);
+        if (accel)
+            printf("loaded acceleration structure from %s\n", path.c_str());
+        else
+            printf("ignored invalid acceleration structure cache %s\n", path.c_str());
+        return accel;
+    }
+    
+    template <typename AcceleratorClass>
+    static void storeToCache(const std::string &dir, AcceleratorType type, const std::vector<SurfaceObject*> &objs, uint64_t key, const AcceleratorClass &accel) {
+        AcceleratorWriter writer(objs);
+        accel.serialize(writer);
+        
+        CacheHeader header;
+        header.magic = CacheMagic;
+        header.version = CacheVersion;
+        header.type = (uint32_t)type;
+        header.numObjs = (uint32_t)objs.size();
+        header.hash = key;
+        
+        // write into a temporary file first so that concurrent jobs never see a partially written cache.
+        std::string path = getCachePath(dir, type, key);
+        std::string tempPath = path + "." + std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+        {
+            std::ofstream ofs(tempPath, std::ios::binary);
+            if (!ofs)
+                return;
+            ofs.write((const char*)&header, sizeof(header));
+            ofs.write((const char*)writer.data().data(), writer.data().size());
+            if (!ofs)
+                return;
+        }
+        // replace the existing cache in one step, readers see either the old file or the new one.
+#if defined(SLR_Defs_Windows)
+        bool replaced = MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        bool replaced = std::rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+        if (!replaced)
+            std::remove(tempPath.c_str());
+    }
+    
+    static SBVH* createSBVH(const std::string &cacheDir, const std::vector<SurfaceObject*> &objs) {
+        if (cacheDir.empty())
+            return new SBVH(objs);
+        
+        uint64_t key = calcCacheKey(AcceleratorType::SBVH, objs);
+        if (SBVH* sbvh = loadFromCache<SBVH>(cacheDir, AcceleratorType::SBVH, objs, key))
+            return sbvh;
+        SBVH* sbvh = new SBVH(objs);
+        storeToCache(cacheDir, AcceleratorType::SBVH, objs, key, *sbvh);
+        return sbvh;
+    }
+    
+    std::string Accelerator::s_cacheDirectory;
+    float Accelerator::s_timeBegin = 0.0f;
+    float Accelerator::s_timeEnd = 0.0f;
+    
+    Accelerator* Accelerator::create(AcceleratorType type, const std::vector<SurfaceObject*> &objs) {
+        const uint32_t MaxSizeForStandardBVH = 16;
+        
+        switch (type) {
+            case AcceleratorType::StandardBVH:
+                return new StandardBVH(objs, StandardBVH::Partitioning::BinnedSAH);
+            case AcceleratorType::SBVH:
+                return createSBVH(s_cacheDirectory, objs);
+            case AcceleratorType::QBVH: {
+                uint64_t key = 0;
+                if (!s_cacheDirectory.empty()) {
+                    key = calcCacheKey(AcceleratorType::QBVH, objs);
+                    if (QBVH* qbvh = loadFromCache<QBVH>(s_cacheDirectory, AcceleratorType::QBVH, objs, key))
+                        return qbvh;
+                }
+                std::unique_ptr<SBVH> sbvh(createSBVH(s_cacheDirectory, objs));
+                QBVH* qbvh = new QBVH(*sbvh);
+                if (!s_cacheDirectory.empty())
+                    storeToCache(s_cacheDirectory, AcceleratorType::QBVH, objs, key, *qbvh);
+                return qbvh;
+            }
+            case AcceleratorType::OBVH: {
+                std::unique_ptr<SBVH> sbvh(createSBVH(s_cacheDirectory, objs));
+                if (OBVH::isSupported())
+                    return new OBVH(*sbvh);
+                printf("OBVH is not supported on this CPU, falling back to QBVH.\n");
+                return new QBVH(*sbvh);
+            }
+            case AcceleratorType::MotionBVH: {
+                if (s_timeEnd > s_timeBegin)
+                    return new MotionBVH(objs, s_timeBegin, s_timeEnd);
+                printf("MotionBVH requires a non-empty time interval, falling back to StandardBVH.\n");
+                return new StandardBVH(objs, StandardBVH::Partitioning::BinnedSAH);
+            }
+            case AcceleratorType::Auto:
+            default:
+                break;
+        }
+        
+        Accelerator* best;
+        if (objs.size() <= MaxSizeForStandardBVH) {
+            best = new StandardBVH(objs, StandardBVH::Partitioning::BinnedSAH);
+        }
+        else {
+            SBVH* sbvh = createSBVH(s_cacheDirectory, objs);
+            Accelerator* wideBVH;
+            if (OBVH::isSupported())
+                wideBVH = new OBVH(*sbvh);
+            else
+                wideBVH = new QBVH(*sbvh);
+            if (wideBVH->costForIntersect() <= sbvh->costForIntersect()) {
+                delete sbvh;
+                best = wideBVH;
+            }
+            else {
+                delete wideBVH;
+                best = sbvh;
+            }
+        }
+        
+        // The structures above use the bounds swept over the whole time interval for moving objects.
+        bool hasMotion = std::any_of(objs.begin(), objs.end(), [](const SurfaceObject* obj) { return obj->hasMotion(); });
+        if (hasMotion && s_timeEnd > s_timeBegin) {
+            MotionBVH* motionBVH = new MotionBVH(objs, s_timeBegin, s_timeEnd);
+            if (motionBVH->costForIntersect() < best->costForIntersect()) {
+                delete best;
+                return motionBVH;
+            }
+            delete motionBVH;
+        }
+        return best;
+    }
+}
@@ -12,17 +12,118 @@
 #include "../references.h"
 #include "../Core/geometry.h"
 #include "../Core/SurfaceObject.h"
+#include <cstring>
 
 namespace SLR {
+    // Serializes an accelerator into a flat byte sequence for the on-disk cache.
+    // Object pointers are stored as indices into the list of objects the accelerator was built from.
+    class SLR_API AcceleratorWriter {
+        std::map<const SurfaceObject*, uint32_t> m_objIndices;
+        std::vector<uint8_t> m_data;
+    public:
+        AcceleratorWriter(const std::vector<SurfaceObject*> &objs) {
+            for (int i = 0; i < objs.size(); ++i)
+                m_objIndices[objs[i]] = i;
+        }
+        
+        template <typename T>
+        void write(const T &value) {
+            const uint8_t* bytes = (const uint8_t*)&value;
+            m_data.insert(m_data.end(), bytes, bytes + sizeof(T));
+        }
+        template <typename T>
+        void writeArray(const std::vector<T> &values) {
+            write((uint32_t)values.size());
+            const uint8_t* bytes = (const uint8_t*)values.data();
+            m_data.insert(m_data.end(), bytes, bytes + sizeof(T) * values.size());
+        }
+        void writeObject(const SurfaceObject* obj) {
+            write(obj ? m_objIndices.at(obj) : UINT32_MAX);
+        }
+        
+        const std::vector<uint8_t> &data() const { return m_data; }
+    };
+    
+    class SLR_API AcceleratorReader {
+        const std::vector<SurfaceObject*> &m_objs;
+        const uint8_t* m_cur;
+        const uint8_t* m_end;
+    public:
+        AcceleratorReader(const std::vector<SurfaceObject*> &objs, const uint8_t* data, size_t size) : m_objs(objs), m_cur(data), m_end(data + size) { }
+        
+        template <typename T>
+        bool read(T* value) {
+            if (m_end - m_cur < sizeof(T))
+                return false;
+            std::memcpy(value, m_cur, sizeof(T));
+            m_cur += sizeof(T);
+            return true;
+        }
+        template <typename T>
+        bool readArray(std::vector<T>* values) {
+            uint32_t numValues;
+            if (!read(&numValues) || (m_end - m_cur) / sizeof(T) < numValues)
+                return false;
+            values->resize(numValues);
+            std::memcpy(values->data(), m_cur, sizeof(T) * numValues);
+            m_cur += sizeof(T) * numValues;
+            return true;
+        }
+        bool readObject(const SurfaceObject** obj) {
+            uint32_t idx;
+            if (!read(&idx))
+                return false;
+            if (idx == UINT32_MAX) {
+                *obj = nullptr;
+                return true;
+            }
+            if (idx >= m_objs.size())
+                return false;
+            *obj = m_objs[idx];
+            return true;
+        }
+        
+        bool reachedEnd() const { return m_cur == m_end; }
+    };
+    
+    
+    
     class SLR_API Accelerator {
+        static std::string s_cacheDirectory;
+        static float s_timeBegin;
+        static float s_timeEnd;
     public:
         virtual ~Accelerator() {}
         
+        // Auto uses a standard BVH for a small number of objects.
+        // Otherwise it builds an SBVH, collapses it into the widest BVH the CPU supports and keeps whichever has the lower SAH cost.
+        // All the SAH costs are in the same units: a traversal cost per node plus the intersection cost of each primitive,
+        // also when a wide BVH tests several embedded triangles at once.
+        // SBVH and QBVH are loaded from the cache directory if it is set and has an entry for the same objects, and stored there otherwise.
+        static Accelerator* create(AcceleratorType type, const std::vector<SurfaceObject*> &objs);
+        // An empty path disables the cache.
+        static void setCacheDirectory(const std::string &path) { s_cacheDirectory = path; }
+        // time interval for MotionBVH, which auto mode uses for moving objects when it is cheaper.
+        static void setTimeInterval(float timeBegin, float timeEnd) { s_timeBegin = timeBegin; s_timeEnd = timeEnd; }
+        
         virtual float costForIntersect() const = 0;
         
         virtual BoundingBox3D bounds() const = 0;
         
         virtual bool intersect(Ray &ray, Intersection* isect) const = 0;
+        // returns true as soon as any primitive is found in the ray's segment, without resolving the closest one.
+        virtual bool occluded(const Ray &ray) const = 0;
+        
+        // Stream versions of the above for a batch of rays.
+        // Accelerators can override these to exploit coherence among the rays.
+        virtual void intersectStream(Ray* rays, Intersection* isects, bool* hits, uint32_t numRays) const {
+            for (uint32_t i = 0; i < numRays; ++i)
+                hits[i] = intersect(rays[i], &isects[i]);
+        }
+        virtual void occludedStream(const Ray* rays, bool* occluded, uint32_t numRays) const {
+            for (uint32_t i = 0; i < numRays; ++i)
+                occluded[i] = this->occluded(rays[i]);
+        }
         
         bool intersect(Ray &ray, SurfacePoint* surfPt) const {
             Intersection isect;
@@ -12,19 +12,26 @@ namespace SLR {
     static const uint32_t s_log2_tileWidth = 3;
     static const uint32_t s_tileWidth = 1 << s_log2_tileWidth;
     static const uint32_t s_localMask = (1 << s_log2_tileWidth) - 1;
+    // number of the components of a pixel in the splat buffer.
+    static const uint32_t s_numSplatComponents = sizeof(DiscretizedSpectrum) / sizeof(SpectrumFloat);
     
     ImageSensor::ImageSensor(float sensitivity) :
-    m_data(nullptr), m_separatedData(nullptr), m_numSeparated(0), m_sensitivity(sensitivity)
+    m_data(nullptr), m_statistics(nullptr), m_separatedData(nullptr), m_numSeparated(0), m_splatData(nullptr), m_sensitivity(sensitivity)
     {}
     
     ImageSensor::ImageSensor(uint32_t width, uint32_t height, float sensitivity) :
-    m_data(nullptr), m_separatedData(nullptr), m_numSeparated(0), m_sensitivity(sensitivity) {
+    m_data(nullptr), m_statistics(nullptr), m_separatedData(nullptr), m_numSeparated(0), m_splatData(nullptr), m_sensitivity(sensitivity) {
         init(width, height);
     }
     
     ImageSensor::~ImageSensor() {
+        waitForExport();
         if (m_data)
             SLR_freealign(m_data);
+        if (m_statistics)
+            SLR_freealign(m_statistics);
+        if (m_splatData)
+            SLR_freealign(m_splatData);
         if (m_separatedData) {
             for (int i = 0; i < m_numSeparated; ++i)
                 SLR_freealign(m_separatedData[i]);
@@ -33,10 +40,17 @@ namespace SLR {
     }
     
     void ImageSensor::init(uint32_t width, uint32_t height) {
+        waitForExport();
         m_width = width;
         m_height = height;
         if (m_data)
             SLR_freealign(m_data);
+        if (m_statistics)
+            SLR_freealign(m_statistics);
+        m_statistics = nullptr;
+        if (m_splatData)
+            SLR_freealign(m_splatData);
+        m_splatData = nullptr;
         
         m_numTileX = (width + (s_tileWidth - 1)) >> s_log2_tileWidth;
         m_numTileY = (height + (s_tileWidth - 1)) >> s_log2_tileWidth;
@@ -60,7 +74,30 @@ namespace SLR {
         }
         clearSeparatedBuffers();
     }
-
+    
+    size_t ImageSensor::numSplatValues() const {
+        return m_allocSize / sizeof(SpectrumStorage) * s_numSplatComponents;
+    }
+    
+    void ImageSensor::enableSplatBuffer() {
+        if (m_splatData)
+            return;
+        size_t numValues = numSplatValues();
+        m_splatData = (std::atomic<double>*)SLR_memalign(sizeof(std::atomic<double>) * numValues, SLR_L1_Cacheline_Size);
+        SLRAssert(m_splatData, "Failed to allocate the splat buffer.");
+        for (size_t i = 0; i < numValues; ++i)
+            new (m_splatData + i) std::atomic<double>(0.0);
+    }
+    
+    void ImageSensor::enableStatistics() {
+        if (m_statistics)
+            return;
+        size_t numPixels = m_allocSize / sizeof(SpectrumStorage);
+        m_statistics = (PixelStatistics*)SLR_memalign(sizeof(PixelStatistics) * numPixels, SLR_L1_Cacheline_Size);
+        SLRAssert(m_statistics, "Failed to allocate the statistics buffer.");
+        std::memset(m_statistics, 0, sizeof(PixelStatistics) * numPixels);
+    }
+    
     uint32_t ImageSensor::tileWidth() const {
         return s_tileWidth;
     }
@@ -74,6 +111,12 @@ namespace SLR {
             SpectrumStorage &dst = *((SpectrumStorage*)m_data + i);
             dst = SpectrumStorage(0.0);
         }
+        if (m_statistics)
+            std::memset(m_statistics, 0, sizeof(PixelStatistics) * (m_allocSize / sizeof(SpectrumStorage)));
+        if (m_splatData) {
+            for (size_t i = 0; i < numSplatValues(); ++i)
+                m_splatData[i].store(0.0, std::memory_order_relaxed);
+        }
     }
     
     void ImageSensor::clearSeparatedBuffers() {
@@ -85,6 +128,14 @@ namespace SLR {
         }
     }
     
+    uint32_t ImageSensor::pixelIndex(uint32_t x, uint32_t y) const {
+        uint32_t tx = x >> s_log2_tileWidth;
+        uint32_t ty = y >> s_log2_tileWidth;
+        uint32_t lx = x & s_localMask;
+        uint32_t ly = y & s_localMask;
+        return (ty * (uint32_t)m_numTileX + tx) * s_tileWidth * s_tileWidth + ly * s_tileWidth + lx;
+    }
+    
     DiscretizedSpectrum ImageSensor::pixel(uint32_t x, uint32_t y) const {
         uint32_t tx = x >> s_log2_tileWidth;
         uint32_t ty = y >> s_log2_tileWidth;
@@ -126,6 +177,13 @@ namespace SLR {
         uint32_t ipy = std::min((uint32_t)py, m_height - 1);
 		SLRAssert(!contribution.hasInf() && !contribution.hasNaN(), "invalid value: (%u, %u), %s", ipx, ipy, contribution.toString().c_str());
         pixel(ipx, ipy).add(wls, contribution);
+        if (m_statistics) {
+            PixelStatistics &stats = m_statistics[pixelIndex(ipx, ipy)];
+            double Y = contribution.luminance();
+            stats.sumY += Y;
+            stats.sumY2 += Y * Y;
+            ++stats.numSamples;
+        }
     }
     
     void ImageSensor::add(uint32_t idx, float px, float py, const WavelengthSamples &wls, const SampledSpectrum &contribution) {
@@ -135,25 +193,153 @@ namespace SLR {
         pixel(idx, ipx, ipy).add(wls, contribution);
     }
     
-    void ImageSensor::saveImage(const std::string &filepath, float scale, float* scaleSeparated) const {
-        struct BMP_RGB {
-            uint8_t B, G, R;
-        };
+    void ImageSensor::splat(float px, float py, const WavelengthSamples &wls, const SampledSpectrum &contribution) {
+        uint32_t ipx = std::min((uint32_t)px, m_width - 1);
+        uint32_t ipy = std::min((uint32_t)py, m_height - 1);
+        SLRAssert(!contribution.hasInf() && !contribution.hasNaN(), "invalid value: (%u, %u), %s", ipx, ipy, contribution.toString().c_str());
+        
+        // bin the contribution in the same way as the main buffer, then add only the touched components.
+        SpectrumStorage binned;
+        binned.add(wls, contribution);
+        const DiscretizedSpectrum &value = binned.value.result;
+        std::atomic<double>* dst = m_splatData + (size_t)pixelIndex(ipx, ipy) * s_numSplatComponents;
+        for (int i = 0; i < s_numSplatComponents; ++i) {
+            double v = value[i];
+            if (v == 0.0)
+                continue;
+            double cur = dst[i].load(std::memory_order_relaxed);
+            while (!dst[i].compare_exchange_weak(cur, cur + v, std::memory_order_relaxed));
+        }
+    }
+    
+    DiscretizedSpectrum ImageSensor::splatPixel(uint32_t x, uint32_t y) const {
+        DiscretizedSpectrum ret(0.0f);
+        const std::atomic<double>* src = m_splatData + (size_t)pixelIndex(x, y) * s_numSplatComponents;
+        for (int i = 0; i < s_numSplatComponents; ++i)
+            ret[i] = (SpectrumFloat)src[i].load(std::memory_order_relaxed);
+        return ret;
+    }
+    
+    uint32_t ImageSensor::numSamples(uint32_t x, uint32_t y) const {
+        return m_statistics ? m_statistics[pixelIndex(x, y)].numSamples : 0;
+    }
+    
+    float ImageSensor::tileRelativeError(uint32_t tileX, uint32_t tileY, float minLuminance) const {
+        SLRAssert(m_statistics, "Statistics are not enabled.");
+        uint32_t endX = std::min((tileX + 1) << s_log2_tileWidth, m_width);
+        uint32_t endY = std::min((tileY + 1) << s_log2_tileWidth, m_height);
+        float maxError = 0.0f;
+        for (uint32_t y = tileY << s_log2_tileWidth; y < endY; ++y) {
+            for (uint32_t x = tileX << s_log2_tileWidth; x < endX; ++x) {
+                const PixelStatistics &stats = m_statistics[pixelIndex(x, y)];
+                if (stats.numSamples < 2)
+                    return INFINITY;
+                double mean = stats.sumY / stats.numSamples;
+                double variance = std::max((stats.sumY2 - stats.numSamples * mean * mean) / (stats.numSamples - 1), 0.0);
+                double error = std::sqrt(variance / stats.numSamples) / std::max(mean, (double)minLuminance);
+                maxError = std::max(maxError, (float)error);
+            }
+        }
+        return maxError;
+    }
+    
+    struct SensorStateHeader {
+        uint32_t width;
+        uint32_t height;
+        uint32_t storageSize;
+        uint32_t numSeparated;
+        uint32_t hasStatistics;
+        uint32_t hasSplatBuffer;
+    };
+    
+    void ImageSensor::serialize(std::vector<uint8_t>* data) const {
+        SensorStateHeader header;
+        header.width = m_width;
+        header.height = m_height;
+        header.storageSize = sizeof(SpectrumStorage);
+        header.numSeparated = m_numSeparated;
+        header.hasStatistics = m_statistics != nullptr;
+        header.hasSplatBuffer = m_splatData != nullptr;
         
+        size_t statsSize = m_statistics ? sizeof(PixelStatistics) * (m_allocSize / sizeof(SpectrumStorage)) : 0;
+        size_t splatSize = m_splatData ? sizeof(double) * numSplatValues() : 0;
+        size_t offset = data->size();
+        data->resize(offset + sizeof(header) + m_allocSize * (1 + m_numSeparated) + statsSize + splatSize);
+        uint8_t* dst = data->data() + offset;
+        std::memcpy(dst, &header, sizeof(header));
+        dst += sizeof(header);
+        std::memcpy(dst, m_data, m_allocSize);
+        dst += m_allocSize;
+        for (int i = 0; i < m_numSeparated; ++i) {
+            std::memcpy(dst, m_separatedData[i], m_allocSize);
+            dst += m_allocSize;
+        }
+        if (m_statistics) {
+            std::memcpy(dst, m_statistics, statsSize);
+            dst += statsSize;
+        }
+        if (m_splatData) {
+            for (size_t i = 0; i < numSplatValues(); ++i) {
+                double value = m_splatData[i].load(std::memory_order_relaxed);
+                std::memcpy(dst + sizeof(double) * i, &value, sizeof(double));
+            }
+        }
+    }
+    
+    bool ImageSensor::deserialize(const uint8_t* data, size_t size) {
+        SensorStateHeader header;
+        if (size < sizeof(header))
+            return false;
+        std::memcpy(&header, data, sizeof(header));
+        if (header.width != m_width || header.height != m_height || header.storageSize != sizeof(SpectrumStorage) ||
+            header.numSeparated != m_numSeparated || header.hasStatistics != (m_statistics != nullptr) ||
+            header.hasSplatBuffer != (m_splatData != nullptr))
+            return false;
+        size_t statsSize = m_statistics ? sizeof(PixelStatistics) * (m_allocSize / sizeof(SpectrumStorage)) : 0;
+        size_t splatSize = m_splatData ? sizeof(double) * numSplatValues() : 0;
+        if (size != sizeof(header) + m_allocSize * (1 + m_numSeparated) + statsSize + splatSize)
+            return false;
+        
+        const uint8_t* src = data + sizeof(header);
+        std::memcpy(m_data, src, m_allocSize);
+        src += m_allocSize;
+        for (int i = 0; i < m_numSeparated; ++i) {
+            std::memcpy(m_separatedData[i], src, m_allocSize);
+            src += m_allocSize;
+        }
+        if (m_statistics) {
+            std::memcpy(m_statistics, src, statsSize);
+            src += statsSize;
+        }
+        if (m_splatData) {
+            for (size_t i = 0; i < numSplatValues(); ++i) {
+                double value;
+                std::memcpy(&value, src + sizeof(double) * i, sizeof(double));
+                m_splatData[i].store(value, std::memory_order_relaxed);
+            }
+        }
+        return true;
+    }
+    
+    void ImageSensor::resolveRows(uint32_t rowBegin, uint32_t rowEnd, float scale, const float* scaleSeparated, float* RGBs) const {
         float* scales = (float*)alloca(sizeof(float) * m_numSeparated);
         float sensitivity = std::isinf(m_sensitivity) ? 1.0f : m_sensitivity;
         for (int i = 0; i < m_numSeparated; ++i)
             scales[i] = (scaleSeparated ? scaleSeparated[i] : scale) * sensitivity;
         scale *= sensitivity;
         
-        uint32_t byteWidth = 3 * m_width + m_width % 4;
-        uint8_t* bmp = (uint8_t*)malloc(m_height * byteWidth);
-        for (int i = 0; i < m_height; ++i) {
+        for (int i = rowBegin; i < rowEnd; ++i) {
             for (int j = 0; j < m_width; ++j) {
-                CompensatedSum<DiscretizedSpectrum> pixSum = pixel(j, i) * scale;
+                float pixScale = scale;
+                if (m_statistics) {
+                    uint32_t numPixSamples = numSamples(j, i);
+                    pixScale = numPixSamples > 0 ? scale / numPixSamples : 0.0f;
+                }
+                DiscretizedSpectrum pix = pixel(j, i) * pixScale;
                 for (int b = 0; b < m_numSeparated; ++b)
-                    pixSum += pixel(b, j, i) * scales[b];
-                DiscretizedSpectrum pix = pixSum.result;
+                    pix += pixel(b, j, i) * scales[b];
+                if (m_splatData)
+                    pix += splatPixel(j, i) * scale;
                 if (pix.hasInf())
                     printf("(%u, %u): has an infinite value!\n%s\n", j, i, pix.toString().c_str());
                 if (pix.hasNaN())
@@ -161,11 +347,25 @@ namespace SLR {
                 if (pix.hasMinus())
                     printf("(%u, %u): has a minus value!\n%s\n", j, i, pix.toString().c_str());
                 
+                pix.getRGB(RGBs + 3 * (m_width * i + j));
+            }
+        }
+    }
+    
+    static void encodeBMP(const std::string &filepath, const float* RGBs, uint32_t width, uint32_t height) {
+        struct BMP_RGB {
+            uint8_t B, G, R;
+        };
+        
+        uint32_t byteWidth = 3 * width + width % 4;
+        uint8_t* bmp = (uint8_t*)malloc(height * byteWidth);
+        for (int i = 0; i < height; ++i) {
+            for (int j = 0; j < width; ++j) {
                 float RGB[3];
-                pix.getRGB(RGB);
-                RGB[0] = RGB[0] < 0.0f ? 0.0f : RGB[0];
-                RGB[1] = RGB[1] < 0.0f ? 0.0f : RGB[1];
-                RGB[2] = RGB[2] < 0.0f ? 0.0f : RGB[2];
+                const float* src = RGBs + 3 * (width * i + j);
+                RGB[0] = src[0] < 0.0f ? 0.0f : src[0];
+                RGB[1] = src[1] < 0.0f ? 0.0f : src[1];
+                RGB[2] = src[2] < 0.0f ? 0.0f : src[2];
                 
                 float Y = 0.222485 * RGB[0] + 0.716905 * RGB[1] + 0.060610 * RGB[2];
                 float scaleY = Y != 0 ? (1.0f - std::exp(-Y)) / Y : 0.0f;
@@ -173,7 +373,7 @@ namespace SLR {
                 RGB[1] = std::min(scaleY * RGB[1], 1.0f);
                 RGB[2] = std::min(scaleY * RGB[2], 1.0f);
                 
-                uint32_t idx = (m_height - i - 1) * byteWidth + 3 * j;
+                uint32_t idx = (height - i - 1) * byteWidth + 3 * j;
                 BMP_RGB &dst = *(BMP_RGB*)(bmp + idx);
                 dst.R = uint8_t(256 * std::min(sRGB_gamma(RGB[0]), 0.999f));
                 dst.G = uint8_t(256 * std::min(sRGB_gamma(RGB[1]), 0.999f));
@@ -181,7 +381,60 @@ namespace SLR {
             }
         }
         
-        saveBMP(filepath.c_str(), bmp, m_width, m_height);
+        saveBMP(filepath.c_str(), bmp, width, height);
         free(bmp);
     }
+    
+    void ImageSensor::saveImage(const std::string &filepath, float scale, float* scaleSeparated) const {
+        std::vector<float> RGBs(3 * m_width * m_height);
+        resolveRows(0, m_height, scale, scaleSeparated, RGBs.data());
+        encodeBMP(filepath, RGBs.data(), m_width, m_height);
+    }
+    
+    bool ImageSensor::copyAccumulationTo(ImageSensor* dst) const {
+        if (dst->m_width != m_width || dst->m_height != m_height || dst->m_numSeparated != m_numSeparated ||
+            (dst->m_statistics != nullptr) != (m_statistics != nullptr) || (dst->m_splatData != nullptr) != (m_splatData != nullptr))
+            return false;
+        std::memcpy(dst->m_data, m_data, m_allocSize);
+        for (int i = 0; i < m_numSeparated; ++i)
+            std::memcpy(dst->m_separatedData[i], m_separatedData[i], m_allocSize);
+        if (m_statistics)
+            std::memcpy(dst->m_statistics, m_statistics, sizeof(PixelStatistics) * (m_allocSize / sizeof(SpectrumStorage)));
+        if (m_splatData) {
+            for (size_t i = 0; i < numSplatValues(); ++i)
+                dst->m_splatData[i].store(m_splatData[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        return true;
+    }
+    
+    void ImageSensor::saveImageAsync(const std::string &filepath, float scale, const float* scaleSeparated) {
+        waitForExport();
+        
+        // The copy is only a few memory copies, the per-pixel resolve runs on the exporter while the next pass renders.
+        if (!m_exportSnapshot || !copyAccumulationTo(m_exportSnapshot.get())) {
+            m_exportSnapshot.reset(new ImageSensor(m_width, m_height, m_sensitivity));
+            if (m_statistics)
+                m_exportSnapshot->enableStatistics();
+            if (m_numSeparated > 0)
+                m_exportSnapshot->addSeparatedBuffers(m_numSeparated);
+            if (m_splatData)
+                m_exportSnapshot->enableSplatBuffer();
+            copyAccumulationTo(m_exportSnapshot.get());
+        }
+        std::vector<float> scales;
+        if (scaleSeparated)
+            scales.assign(scaleSeparated, scaleSeparated + m_numSeparated);
+        
+        const ImageSensor* snapshot = m_exportSnapshot.get();
+        m_exporter = std::thread([snapshot, filepath, scale, scales]() {
+            std::vector<float> RGBs(3 * snapshot->m_width * snapshot->m_height);
+            snapshot->resolveRows(0, snapshot->m_height, scale, scales.empty() ? nullptr : scales.data(), RGBs.data());
+            encodeBMP(filepath, RGBs.data(), snapshot->m_width, snapshot->m_height);
+        });
+    }
+    
+    void ImageSensor::waitForExport() {
+        if (m_exporter.joinable())
+            m_exporter.join();
+    }
 }
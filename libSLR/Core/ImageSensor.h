@@ -13,12 +13,23 @@
 #include "../BasicTypes/RGBTypes.h"
 #include "../BasicTypes/SpectrumTypes.h"
 #include "../BasicTypes/CompensatedSum.h"
+#include <thread>
+#include <atomic>
 
 namespace SLR {
     class SLR_API ImageSensor {
+        // per-pixel moments of the sample luminance, used to estimate the error of the pixel value.
+        struct PixelStatistics {
+            double sumY;
+            double sumY2;
+            uint32_t numSamples;
+        };
+        
         uint8_t* m_data;
+        PixelStatistics* m_statistics;
         uint8_t** m_separatedData;
         uint32_t m_numSeparated;
+        std::atomic<double>* m_splatData;
         uint32_t m_width;
         uint32_t m_height;
         float m_sensitivity;
@@ -26,6 +37,18 @@ namespace SLR {
         size_t m_numTileX;
         size_t m_numTileY;
         size_t m_allocSize;
+        
+        std::thread m_exporter;
+        // copy of the accumulation resolved by the exporter while the sensor is accumulated again.
+        std::unique_ptr<ImageSensor> m_exportSnapshot;
+        
+        uint32_t pixelIndex(uint32_t x, uint32_t y) const;
+        size_t numSplatValues() const;
+        DiscretizedSpectrum splatPixel(uint32_t x, uint32_t y) const;
+        // resolves the scaled pixel values of the rows [rowBegin, rowEnd) into linear RGB.
+        void resolveRows(uint32_t rowBegin, uint32_t rowEnd, float scale, const float* scaleSeparated, float* RGBs) const;
+        // copies the accumulation into "dst", which must have been set up with the same resolution and buffers.
+        bool copyAccumulationTo(ImageSensor* dst) const;
     public:
         ImageSensor(float sensitivity);
         ImageSensor(uint32_t width, uint32_t height, float sensitivity);
@@ -33,6 +56,16 @@ namespace SLR {
         
         void init(uint32_t width, uint32_t height);
         void addSeparatedBuffers(uint32_t numBuffers);
+        // A single buffer shared by all the threads for contributions to arbitrary pixels, e.g. light tracing in BPT.
+        // splat() accumulates into it with atomic operations, so its size doesn't depend on the number of threads.
+        // It is scaled in the same way as the main buffer without the per-pixel normalization.
+        void enableSplatBuffer();
+        bool hasSplatBuffer() const { return m_splatData != nullptr; };
+        
+        // With statistics enabled, each add() to the main buffer counts as one sample of the pixel
+        // and saveImage() normalizes the main buffer by the per-pixel sample count.
+        void enableStatistics();
+        bool hasStatistics() const { return m_statistics != nullptr; };
         
         void clear();
         void clearSeparatedBuffers();
@@ -51,8 +84,23 @@ namespace SLR {
         
         void add(float px, float py, const WavelengthSamples &wls, const SampledSpectrum &contribution);
         void add(uint32_t idx, float px, float py, const WavelengthSamples &wls, const SampledSpectrum &contribution);
+        void splat(float px, float py, const WavelengthSamples &wls, const SampledSpectrum &contribution);
+        
+        uint32_t numSamples(uint32_t x, uint32_t y) const;
+        // the largest relative standard error of the pixel means in the tile.
+        // "minLuminance" bounds the denominator so that nearly black pixels don't dominate.
+        float tileRelativeError(uint32_t tileX, uint32_t tileY, float minLuminance) const;
         
         void saveImage(const std::string &filepath, float scale = 1.0f, float* scaleSeparated = nullptr) const;
+        // copies the accumulation, then resolves, tone-maps, encodes and writes the copy on a background thread.
+        // The sensor can be accumulated again as soon as this returns, but it must be called between passes to take a consistent copy.
+        void saveImageAsync(const std::string &filepath, float scale = 1.0f, const float* scaleSeparated = nullptr);
+        void waitForExport();
+        
+        // raw accumulation of all the buffers for a checkpoint.
+        // deserialize() fails unless the sensor has been set up with the same resolution and buffers.
+        void serialize(std::vector<uint8_t>* data) const;
+        bool deserialize(const uint8_t* data, size_t size);
     };    
 }
 
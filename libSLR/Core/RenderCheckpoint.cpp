@@ -0,0 +1,134 @@
+//
+//  RenderCheckpoint.cpp
+//
+//  Created by 渡部 心 on 2016/10/16.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#include "RenderCheckpoint.h"
+#include "ImageSensor.h"
+#include "light_path_samplers.h"
+
+#include <fstream>
+
+namespace SLR {
+    static const uint32_t CheckpointMagic = 0x4B524C53; // "SLRK"
+    static const uint32_t CheckpointVersion = 2;
+    
+    struct CheckpointHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t numSamples;
+        uint32_t exportPass;
+        uint32_t imageIndex;
+        uint32_t numRNGs;
+        double elapsed;
+    };
+    
+    RenderCheckpoint::RenderCheckpoint(const std::string &path) : m_path(path), m_writing(false) {
+    }
+    
+    RenderCheckpoint::~RenderCheckpoint() {
+        if (m_writer.joinable())
+            m_writer.join();
+    }
+    
+    void RenderCheckpoint::writeBuffer() {
+        // write into a temporary file first so that an interruption never leaves a partially written checkpoint.
+        std::string tempPath = m_path + ".tmp";
+        bool success;
+        {
+            std::ofstream ofs(tempPath, std::ios::binary);
+            ofs.write((const char*)m_buffer.data(), m_buffer.size());
+            success = (bool)ofs;
+        }
+        if (success) {
+            // replace the previous checkpoint in one step so that there is always a valid one on the disk.
+#if defined(SLR_Defs_Windows)
+            success = MoveFileExA(tempPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            success = std::rename(tempPath.c_str(), m_path.c_str()) == 0;
+#endif
+        }
+        if (!success)
+            printf("failed to write the checkpoint %s\n", m_path.c_str());
+        m_writing = false;
+    }
+    
+    bool RenderCheckpoint::write(const ImageSensor &sensor, const Progress &progress, const IndependentLightPathSampler* samplers, uint32_t numSamplers,
+                                 bool waitForPrevious) {
+        if (!enabled() || (m_writing && !waitForPrevious))
+            return false;
+        if (m_writer.joinable())
+            m_writer.join();
+        
+        CheckpointHeader header;
+        header.magic = CheckpointMagic;
+        header.version = CheckpointVersion;
+        header.numSamples = progress.numSamples;
+        header.exportPass = progress.exportPass;
+        header.imageIndex = progress.imageIndex;
+        header.numRNGs = numSamplers;
+        header.elapsed = progress.elapsed;
+        
+        m_buffer.resize(sizeof(header) + sizeof(uint32_t) * 4 * numSamplers);
+        std::memcpy(m_buffer.data(), &header, sizeof(header));
+        uint32_t* states = (uint32_t*)(m_buffer.data() + sizeof(header));
+        for (int i = 0; i < numSamplers; ++i)
+            samplers[i].getRNG().getState(states + 4 * i);
+        sensor.serialize(&m_buffer);
+        
+        m_writing = true;
+        m_writer = std::thread(&RenderCheckpoint::writeBuffer, this);
+        return true;
+    }
+    
+    bool RenderCheckpoint::read(ImageSensor* sensor, Progress* progress, IndependentLightPathSampler* samplers, uint32_t numSamplers) const {
+        if (!enabled())
+            return false;
+        std::ifstream ifs(m_path, std::ios::binary | std::ios::ate);
+        if (!ifs)
+            return false;
+        std::vector<uint8_t> data((size_t)ifs.tellg());
+        ifs.seekg(0);
+        ifs.read((char*)data.data(), data.size());
+        if (!ifs || data.size() < sizeof(CheckpointHeader))
+            return false;
+        
+        CheckpointHeader header;
+        std::memcpy(&header, data.data(), sizeof(header));
+        size_t statesSize = sizeof(uint32_t) * 4 * header.numRNGs;
+        if (header.magic != CheckpointMagic || header.version != CheckpointVersion || data.size() < sizeof(header) + statesSize)
+            return false;
+        if (!sensor->deserialize(data.data() + sizeof(header) + statesSize, data.size() - sizeof(header) - statesSize)) {
+            printf("the checkpoint %s doesn't match the current sensor.\n", m_path.c_str());
+            return false;
+        }
+        
+        if (header.numRNGs != numSamplers)
+            printf("the checkpoint was written with %u threads, now %u threads.\n", header.numRNGs, numSamplers);
+        const uint32_t* states = (const uint32_t*)(data.data() + sizeof(header));
+        for (int i = 0; i < std::min(numSamplers, header.numRNGs); ++i)
+            samplers[i].getRNG().setState(states + 4 * i);
+        
+        // the fresh seeds of the threads beyond the stored ones come from the same top-level stream as the original run's seeds
+        // and restart their sequences from the beginning, so reseed them from a stream derived from the stored states and the resumed pass instead.
+        if (numSamplers > header.numRNGs) {
+            uint32_t mixed = header.numSamples * 0x9E3779B9;
+            for (int i = 0; i < 4 * header.numRNGs; ++i)
+                mixed = (mixed ^ states[i]) * 0x01000193;
+            XORShiftRNG extraRand((int32_t)mixed);
+            for (int i = header.numRNGs; i < numSamplers; ++i) {
+                uint32_t state[4];
+                XORShiftRNG((int32_t)extraRand.getUInt()).getState(state);
+                samplers[i].getRNG().setState(state);
+            }
+        }
+        
+        progress->numSamples = header.numSamples;
+        progress->exportPass = header.exportPass;
+        progress->imageIndex = header.imageIndex;
+        progress->elapsed = header.elapsed;
+        return true;
+    }
+}
@@ -0,0 +1,50 @@
+//
+//  RenderCheckpoint.h
+//
+//  Created by 渡部 心 on 2016/10/16.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#ifndef __SLR__RenderCheckpoint__
+#define __SLR__RenderCheckpoint__
+
+#include "../defines.h"
+#include "../references.h"
+#include <thread>
+#include <atomic>
+
+namespace SLR {
+    class IndependentLightPathSampler;
+    
+    // On-disk snapshot of a progressive render: the raw accumulation of the sensor, the progress of the passes and the RNG state of each thread.
+    // write() copies the state and stores it into the file on a background thread, so it has to be called between passes
+    // but the workers don't wait for the disk.
+    class SLR_API RenderCheckpoint {
+    public:
+        struct Progress {
+            uint32_t numSamples;
+            uint32_t exportPass;
+            uint32_t imageIndex;
+            double elapsed;
+        };
+    private:
+        std::string m_path;
+        std::vector<uint8_t> m_buffer;
+        std::thread m_writer;
+        std::atomic<bool> m_writing;
+        
+        void writeBuffer();
+    public:
+        RenderCheckpoint(const std::string &path);
+        ~RenderCheckpoint();
+        
+        bool enabled() const { return !m_path.empty(); };
+        
+        // returns false without writing if the previous checkpoint is still being written unless "waitForPrevious" is true.
+        bool write(const ImageSensor &sensor, const Progress &progress, const IndependentLightPathSampler* samplers, uint32_t numSamplers,
+                   bool waitForPrevious = false);
+        bool read(ImageSensor* sensor, Progress* progress, IndependentLightPathSampler* samplers, uint32_t numSamplers) const;
+    };
+}
+
+#endif
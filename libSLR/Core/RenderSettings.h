@@ -19,6 +19,13 @@ namespace SLR {
         TimeEnd,
         Brightness, 
         RNGSeed,
+        TopLevelAccelerator,
+        InstanceAccelerator,
+        AcceleratorCacheDirectory,
+        CompactVertices,
+        CheckpointPath,
+        CheckpointInterval,
+        Resume,
     };
     
     class SLR_API RenderSettings {
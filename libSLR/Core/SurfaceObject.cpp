@@ -9,11 +9,10 @@
 #include "surface_material.h"
 #include "Transform.h"
 #include "distributions.h"
-#include "../Accelerator/StandardBVH.h"
-#include "../Accelerator/SBVH.h"
-#include "../Accelerator/QBVH.h"
+#include "Accelerator.h"
 #include "textures.h"
 #include "../Surface/InfiniteSphere.h"
+#include "../Surface/TriangleMesh.h"
 #include "../SurfaceMaterials/IBLEmission.h"
 #include "../Memory/ArenaAllocator.h"
 #include "../BSDFs/basic_BSDFs.h"
@@ -31,6 +30,74 @@ namespace SLR {
     
     
     
+    static inline float safeAcos(float x) {
+        return std::acos(std::min(std::max(x, -1.0f), 1.0f));
+    }
+    
+    float LightBounds::importance(const Point3D &shadingPoint) const {
+        if (power == 0.0f)
+            return 0.0f;
+        // treat the bounding box as its bounding sphere.
+        Point3D center = bbox.centroid();
+        float sqRadius = 0.25f * (bbox.maxP - bbox.minP).sqLength();
+        Vector3D dir = shadingPoint - center;
+        float sqDist = dir.sqLength();
+        if (sqDist <= sqRadius)
+            return power / std::max(sqRadius, 1e-12f);
+        
+        float dist = std::sqrt(sqDist);
+        float thetaW = safeAcos(dot(axis, dir / dist));
+        float thetaB = std::asin(std::sqrt(sqRadius / sqDist));
+        // minimum angle between the direction to the shading point and the normals in the bounds.
+        float thetaP = std::max(thetaW - safeAcos(cosThetaO) - thetaB, 0.0f);
+        if (thetaP >= safeAcos(cosThetaE))
+            return 0.0f;
+        return power * std::max(std::cos(thetaP), 0.0f) / sqDist;
+    }
+    
+    LightBounds calcUnion(const LightBounds &b0, const LightBounds &b1) {
+        if (b0.power == 0.0f)
+            return b1;
+        if (b1.power == 0.0f)
+            return b0;
+        
+        LightBounds ret;
+        ret.bbox = calcUnion(b0.bbox, b1.bbox);
+        ret.cosThetaE = std::min(b0.cosThetaE, b1.cosThetaE);
+        ret.power = b0.power + b1.power;
+        
+        // the smallest cone containing both normal cones.
+        float theta0 = safeAcos(b0.cosThetaO);
+        float theta1 = safeAcos(b1.cosThetaO);
+        float thetaD = safeAcos(dot(b0.axis, b1.axis));
+        if (std::min(thetaD + theta1, (float)M_PI) <= theta0) {
+            ret.axis = b0.axis;
+            ret.cosThetaO = b0.cosThetaO;
+            return ret;
+        }
+        if (std::min(thetaD + theta0, (float)M_PI) <= theta1) {
+            ret.axis = b1.axis;
+            ret.cosThetaO = b1.cosThetaO;
+            return ret;
+        }
+        float thetaO = 0.5f * (theta0 + thetaD + theta1);
+        Vector3D rotAxis = cross(b0.axis, b1.axis);
+        if (thetaO >= M_PI || rotAxis.sqLength() == 0.0f) {
+            ret.axis = b0.axis;
+            ret.cosThetaO = -1.0f;
+            return ret;
+        }
+        // rotate the axis of b0 toward b1.
+        rotAxis = normalize(rotAxis);
+        float thetaR = thetaO - theta0;
+        float cosR = std::cos(thetaR), sinR = std::sin(thetaR);
+        ret.axis = normalize(cosR * b0.axis + sinR * cross(rotAxis, b0.axis) + (1 - cosR) * dot(rotAxis, b0.axis) * rotAxis);
+        ret.cosThetaO = std::cos(thetaO);
+        return ret;
+    }
+    
+    
+    
     bool SurfaceObject::intersect(Ray &ray, SurfacePoint *surfPt) const {
         Intersection isect;
         if (!intersect(ray, &isect))
@@ -43,8 +110,7 @@ namespace SLR {
         SLRAssert(shdP.atInfinity == false && lightP.atInfinity == false, "Points must be in finite region.");
         float dist = distance(lightP.p, shdP.p);
         Ray ray(shdP.p, (lightP.p - shdP.p) / dist, time, Ray::Epsilon, dist * (1 - Ray::Epsilon));
-        Intersection isect;
-        return !intersect(ray, &isect);
+        return !occluded(ray);
     }
     
     
@@ -57,6 +123,12 @@ namespace SLR {
         return true;
     }
     
+    void SingleSurfaceObject::fillEmbeddedTriangleIntersection(const Ray &ray, float dist, float b1, float b2, Intersection* isect) const {
+        m_surface->fillEmbeddedTriangleIntersection(ray, dist, b1, b2, isect);
+        isect->time = ray.time;
+        isect->obj.push(this);
+    }
+    
     void SingleSurfaceObject::getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const {
         m_surface->getSurfacePoint(isect, surfPt);
         surfPt->obj = this;
@@ -79,6 +151,12 @@ namespace SLR {
         return light.top() == this ? 1.0f : 0.0f;
     }
     
+    LightBounds SingleSurfaceObject::lightBounds() const {
+        LightBounds ret(bounds(), Vector3D::Ez, -1.0f, 0.0f, importance());
+        m_surface->normalBounds(&ret.axis, &ret.cosThetaO);
+        return ret;
+    }
+    
     SampledSpectrum SingleSurfaceObject::sample(const Light &light, const LightPosQuery &query, const LightPosSample &smp, LightPosQueryResult* result) const {
         if (light.top()!= this) {
             result->areaPDF = 0.0f;
@@ -120,9 +198,8 @@ namespace SLR {
     }
     
     
-    void BumpSingleSurfaceObject::getSurfacePoint(const Intersection &isect, SurfacePoint *surfPt) const {
-        SingleSurfaceObject::getSurfacePoint(isect, surfPt);
-        Vector3D nLocal = m_normalMap->evaluate(*surfPt);
+    static void applyNormalMap(const Normal3DTexture* normalMap, SurfacePoint* surfPt) {
+        Vector3D nLocal = normalMap->evaluate(*surfPt);
         Vector3D tLocal = Vector3D::Ex - dot(nLocal, Vector3D::Ex) * nLocal;
         Vector3D bLocal = Vector3D::Ey - dot(nLocal, Vector3D::Ey) * nLocal;
         Vector3D t = normalize(surfPt->shadingFrame.fromLocal(tLocal));
@@ -133,6 +210,234 @@ namespace SLR {
         surfPt->shadingFrame.z = n;
     }
     
+    void BumpSingleSurfaceObject::getSurfacePoint(const Intersection &isect, SurfacePoint *surfPt) const {
+        SingleSurfaceObject::getSurfacePoint(isect, surfPt);
+        applyNormalMap(m_normalMap, surfPt);
+    }
+    
+    
+    
+    Triangle TriangleSurfaceObject::getTriangle(Vertex storage[3], bool withShadingFrame) const {
+        const TriangleConstants* constants = &m_mesh->m_triangleConstants[m_primIndex];
+        if (m_mesh->m_compact) {
+            m_mesh->decodeVertices(m_primIndex, withShadingFrame, storage);
+            return Triangle(storage + 0, storage + 1, storage + 2, getMaterialGroup().alphaTexture, constants);
+        }
+        const uint32_t* indices = &m_mesh->m_indices[3 * m_primIndex];
+        const Vertex* vertices = m_mesh->m_vertices.data();
+        return Triangle(vertices + indices[0], vertices + indices[1], vertices + indices[2], getMaterialGroup().alphaTexture, constants);
+    }
+    
+    const TriangleMeshMaterialGroup &TriangleSurfaceObject::getMaterialGroup() const {
+        return m_mesh->m_materialGroups[m_mesh->m_materialIndices[m_primIndex]];
+    }
+    
+    BoundingBox3D TriangleSurfaceObject::bounds() const {
+        Vertex vertices[3];
+        return getTriangle(vertices, false).bounds();
+    }
+    
+    BoundingBox3D TriangleSurfaceObject::choppedBounds(BoundingBox3D::Axis chopAxis, float minChopPos, float maxChopPos) const {
+        Vertex vertices[3];
+        return getTriangle(vertices, false).choppedBounds(chopAxis, minChopPos, maxChopPos);
+    }
+    
+    void TriangleSurfaceObject::splitBounds(BoundingBox3D::Axis splitAxis, float splitPos, BoundingBox3D* bbox0, BoundingBox3D* bbox1) const {
+        Vertex vertices[3];
+        getTriangle(vertices, false).splitBounds(splitAxis, splitPos, bbox0, bbox1);
+    }
+    
+    bool TriangleSurfaceObject::intersect(Ray &ray, Intersection* isect) const {
+        Vertex vertices[3];
+        if (!getTriangle(vertices, false).intersect(ray, isect))
+            return false;
+        isect->time = ray.time;
+        isect->obj.push(this);
+        return true;
+    }
+    
+    bool TriangleSurfaceObject::occluded(const Ray &ray) const {
+        Vertex vertices[3];
+        return getTriangle(vertices, false).occluded(ray);
+    }
+    
+    bool TriangleSurfaceObject::getEmbeddableTriangle(Point3D* p0, Point3D* p1, Point3D* p2) const {
+        Vertex vertices[3];
+        return getTriangle(vertices, false).getEmbeddableTriangle(p0, p1, p2);
+    }
+    
+    void TriangleSurfaceObject::fillEmbeddedTriangleIntersection(const Ray &ray, float dist, float b1, float b2, Intersection* isect) const {
+        Vertex vertices[3];
+        getTriangle(vertices, false).fillEmbeddedTriangleIntersection(ray, dist, b1, b2, isect);
+        isect->time = ray.time;
+        isect->obj.push(this);
+    }
+    
+    Point3D TriangleSurfaceObject::getIntersectionPoint(const Intersection &isect) const {
+        Vertex vertices[3];
+        return getTriangle(vertices, false).getIntersectionPoint(isect);
+    }
+    
+    const SurfaceMaterial* TriangleSurfaceObject::getSurfaceMaterial() const {
+        return getMaterialGroup().material;
+    }
+    
+    void TriangleSurfaceObject::getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const {
+        Vertex vertices[3];
+        getTriangle(vertices, true).getSurfacePoint(isect, surfPt);
+        surfPt->obj = this;
+        if (const Normal3DTexture* normalMap = getMaterialGroup().normalMap)
+            applyNormalMap(normalMap, surfPt);
+    }
+    
+    bool TriangleSurfaceObject::isEmitting() const {
+        return getMaterialGroup().material->isEmitting();
+    }
+    
+    float TriangleSurfaceObject::importance() const {
+        return 1.0f;// TODO: consider a total power emitted from this object.
+    }
+    
+    void TriangleSurfaceObject::selectLight(float u, Light* light, float* prob) const {
+        light->push(this);
+        *prob = 1.0f;
+    }
+    
+    float TriangleSurfaceObject::evaluateProb(const Light &light) const {
+        return light.top() == this ? 1.0f : 0.0f;
+    }
+    
+    LightBounds TriangleSurfaceObject::lightBounds() const {
+        Vertex vertices[3];
+        Triangle triangle = getTriangle(vertices, true);
+        LightBounds ret(triangle.bounds(), Vector3D::Ez, -1.0f, 0.0f, importance());
+        // a normal map can tilt the emitting hemisphere arbitrarily.
+        if (!getMaterialGroup().normalMap)
+            triangle.normalBounds(&ret.axis, &ret.cosThetaO);
+        return ret;
+    }
+    
+    SampledSpectrum TriangleSurfaceObject::sample(const Light &light, const LightPosQuery &query, const LightPosSample &smp, LightPosQueryResult* result) const {
+        if (light.top() != this) {
+            result->areaPDF = 0.0f;
+            return SampledSpectrum::Zero;
+        }
+        Vertex vertices[3];
+        getTriangle(vertices, true).sample(smp.uPos[0], smp.uPos[1], &result->surfPt, &result->areaPDF);
+        result->posType = DirectionType::LowFreq;
+        result->surfPt.obj = this;
+        return getMaterialGroup().material->emittance(result->surfPt, query.wls);
+    }
+    
+    Ray TriangleSurfaceObject::sampleRay(const Light &light,
+                                         const LightPosQuery &lightPosQuery, const LightPosSample &lightPosSample, LightPosQueryResult* lightPosResult, SampledSpectrum* Le0, EDF** edf,
+                                         const EDFQuery &edfQuery, const EDFSample &edfSample, EDFQueryResult* edfResult, SampledSpectrum* Le1,
+                                         ArenaAllocator &mem) const {
+        *Le0 = sample(light, lightPosQuery, lightPosSample, lightPosResult);
+        *edf = lightPosResult->surfPt.createEDF(lightPosQuery.wls, mem);
+        *Le1 = (*edf)->sample(edfQuery, edfSample, edfResult);
+        return Ray(lightPosResult->surfPt.p, lightPosResult->surfPt.shadingFrame.fromLocal(edfResult->dir_sn), lightPosQuery.time, Ray::Epsilon);
+    }
+    
+    BSDF* TriangleSurfaceObject::createBSDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const {
+        return getMaterialGroup().material->getBSDF(surfPt, wls, mem);
+    }
+    
+    float TriangleSurfaceObject::evaluateAreaPDF(const SurfacePoint& surfPt) const {
+        Vertex vertices[3];
+        return getTriangle(vertices, false).evaluateAreaPDF(surfPt);
+    }
+    
+    SampledSpectrum TriangleSurfaceObject::emittance(const SurfacePoint& surfPt, const WavelengthSamples &wls) const {
+        return getMaterialGroup().material->emittance(surfPt, wls);
+    }
+    
+    EDF* TriangleSurfaceObject::createEDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const {
+        return getMaterialGroup().material->getEDF(surfPt, wls, mem);
+    }
+    
+    
+    
+    bool TriangleMeshSurfaceObject::s_useCompactVertices = false;
+    
+    TriangleMeshSurfaceObject::TriangleMeshSurfaceObject(std::vector<Vertex> &&vertices, std::vector<uint32_t> &&indices, std::vector<uint16_t> &&materialIndices,
+                                                         const std::vector<TriangleMeshMaterialGroup> &materialGroups) :
+    m_compact(s_useCompactVertices), m_indices(std::move(indices)), m_materialIndices(std::move(materialIndices)), m_materialGroups(materialGroups) {
+        if (m_compact) {
+            m_positions.resize(vertices.size());
+            m_compactAttributes.resize(vertices.size());
+            for (int i = 0; i < vertices.size(); ++i) {
+                m_positions[i] = vertices[i].position;
+                m_compactAttributes[i] = CompactVertexAttribute(vertices[i]);
+            }
+            std::vector<Vertex>().swap(vertices);
+        }
+        else {
+            m_vertices = std::move(vertices);
+        }
+        
+        uint32_t numTriangles = (uint32_t)m_materialIndices.size();
+        SLRAssert(m_indices.size() == 3 * numTriangles, "The numbers of indices and material indices are inconsistent.");
+        m_triangles.resize(numTriangles);
+        for (uint32_t i = 0; i < numTriangles; ++i)
+            m_triangles[i] = TriangleSurfaceObject(this, i);
+        updateTriangleConstants();
+    }
+    
+    void TriangleMeshSurfaceObject::decodeVertices(uint32_t primIndex, bool withShadingFrame, Vertex vertices[3]) const {
+        const uint32_t* indices = &m_indices[3 * primIndex];
+        for (int i = 0; i < 3; ++i) {
+            const CompactVertexAttribute &attr = m_compactAttributes[indices[i]];
+            Vertex &v = vertices[i];
+            v.position = m_positions[indices[i]];
+            v.texCoord = attr.decodeTexCoord();
+            if (withShadingFrame) {
+                v.normal = attr.decodeNormal();
+                v.tangent = attr.decodeTangent();
+            }
+        }
+    }
+    
+    void TriangleMeshSurfaceObject::updateTriangleConstants() {
+        uint32_t numTriangles = (uint32_t)m_triangles.size();
+        m_triangleConstants.resize(numTriangles);
+        for (uint32_t i = 0; i < numTriangles; ++i) {
+            if (m_compact) {
+                Vertex vertices[3];
+                decodeVertices(i, false, vertices);
+                m_triangleConstants[i] = TriangleConstants::calculate(vertices[0], vertices[1], vertices[2]);
+            }
+            else {
+                const uint32_t* indices = &m_indices[3 * i];
+                m_triangleConstants[i] = TriangleConstants::calculate(m_vertices[indices[0]], m_vertices[indices[1]], m_vertices[indices[2]]);
+            }
+        }
+    }
+    
+    void TriangleMeshSurfaceObject::applyTransform(const StaticTransform &transform) {
+        if (m_compact) {
+            for (int i = 0; i < m_positions.size(); ++i) {
+                CompactVertexAttribute &attr = m_compactAttributes[i];
+                Vertex v;
+                v.position = transform * m_positions[i];
+                v.normal = normalize(transform * attr.decodeNormal());
+                v.tangent = normalize(transform * attr.decodeTangent());
+                v.texCoord = attr.decodeTexCoord();
+                m_positions[i] = v.position;
+                attr = CompactVertexAttribute(v);
+            }
+        }
+        else {
+            for (int i = 0; i < m_vertices.size(); ++i) {
+                Vertex &v = m_vertices[i];
+                v.position = transform * v.position;
+                v.normal = normalize(transform * v.normal);
+                v.tangent = normalize(transform * v.tangent);
+            }
+        }
+        updateTriangleConstants();
+    }
+    
     
     InfiniteSphereSurfaceObject::InfiniteSphereSurfaceObject(const Scene* scene, const IBLEmission* emitter) : m_scene(scene) {
         m_surface = new InfiniteSphere();
@@ -223,39 +528,128 @@ namespace SLR {
     
     
     
-    SurfaceObjectAggregate::SurfaceObjectAggregate(std::vector<SurfaceObject*> &objs) {
-//        SBVH sbvh(objs);
-//        m_accelerator = new QBVH(sbvh);
-        m_accelerator = new SBVH(objs);
-//        m_accelerator = new StandardBVH(objs, StandardBVH::Partitioning::BinnedSAH);
+    static inline uint32_t hashPointer(const void* ptr) {
+        uint64_t v = (uint64_t)(uintptr_t)ptr;
+        v ^= v >> 33;
+        v *= 0xff51afd7ed558ccdULL;
+        v ^= v >> 33;
+        return (uint32_t)v;
+    }
+    
+    SurfaceObjectAggregate::SurfaceObjectAggregate(std::vector<SurfaceObject*> &objs, AcceleratorType accelType) {
+        m_accelerator = Accelerator::create(accelType, objs);
         
         std::vector<const SurfaceObject*> lights;
         std::vector<float> lightImportances;
+        std::vector<LightBounds> lightBounds;
+        m_instancingDepth = 0;
         for (int i = 0; i < objs.size(); ++i) {
             const SurfaceObject* obj = objs[i];
+            m_instancingDepth = std::max(m_instancingDepth, obj->instancingDepth());
             if (obj->isEmitting()) {
                 lights.push_back(obj);
                 lightImportances.push_back(obj->importance());
+                lightBounds.push_back(obj->lightBounds());
             }
         }
         
-        m_lightList = new const SurfaceObject*[lightImportances.size()];
-        m_lightDist1D = new RegularConstantDiscrete1D(lightImportances);
+        m_numLights = (uint32_t)lights.size();
+        m_lightList = new const SurfaceObject*[m_numLights];
+        m_lightDist1D = new RegularConstantDiscrete1D(lightImportances, true);
+        
+        uint32_t tableSize = 1;
+        while (tableSize < 2 * m_numLights)
+            tableSize <<= 1;
+        m_lightIndexTable.resize(tableSize, LightIndexEntry{nullptr, 0});
+        m_lightIndexMask = tableSize - 1;
         
-        for (int i = 0; i < lights.size(); ++i) {
+        for (int i = 0; i < m_numLights; ++i) {
             const SurfaceObject* light = lights[i];
             m_lightList[i] = light;
-            m_revMap[light] = i;
+            
+            uint32_t slot = hashPointer(light) & m_lightIndexMask;
+            while (m_lightIndexTable[slot].light != nullptr && m_lightIndexTable[slot].light != light)
+                slot = (slot + 1) & m_lightIndexMask;
+            m_lightIndexTable[slot] = LightIndexEntry{light, (uint32_t)i};
+        }
+        
+        if (m_numLights > 0) {
+            std::vector<uint32_t> indices(m_numLights);
+            for (uint32_t i = 0; i < m_numLights; ++i)
+                indices[i] = i;
+            m_lightNodes.reserve(2 * m_numLights - 1);
+            m_lightTrails.resize(m_numLights);
+            buildLightBVH(lightBounds, indices.data(), m_numLights, 0, 0);
         }
     }
     
+    // Lights are split at the median of their centers along the widest axis, so the depth stays within log2 of the number of lights.
+    void SurfaceObjectAggregate::buildLightBVH(const std::vector<LightBounds> &lightBounds, uint32_t* indices, uint32_t numIndices, uint32_t depth, uint64_t trail) {
+        SLRAssert(depth < 64, "Light hierarchy is too deep.");
+        uint32_t nodeIdx = (uint32_t)m_lightNodes.size();
+        m_lightNodes.emplace_back();
+        if (numIndices == 1) {
+            LightBVHNode &leaf = m_lightNodes[nodeIdx];
+            leaf.bounds = lightBounds[indices[0]];
+            leaf.index = indices[0];
+            leaf.isLeaf = true;
+            m_lightTrails[indices[0]] = trail;
+            return;
+        }
+        
+        BoundingBox3D centroidBounds;
+        for (uint32_t i = 0; i < numIndices; ++i)
+            centroidBounds.unify(lightBounds[indices[i]].bbox.centroid());
+        BoundingBox3D::Axis axis = centroidBounds.widestAxis();
+        uint32_t numLeft = numIndices / 2;
+        std::nth_element(indices, indices + numLeft, indices + numIndices, [&lightBounds, axis](uint32_t a, uint32_t b) {
+            return lightBounds[a].bbox.centerOfAxis(axis) < lightBounds[b].bbox.centerOfAxis(axis);
+        });
+        
+        buildLightBVH(lightBounds, indices, numLeft, depth + 1, trail);
+        uint32_t secondIdx = (uint32_t)m_lightNodes.size();
+        buildLightBVH(lightBounds, indices + numLeft, numIndices - numLeft, depth + 1, trail | (1ull << depth));
+        
+        LightBVHNode &node = m_lightNodes[nodeIdx];
+        node.bounds = calcUnion(m_lightNodes[nodeIdx + 1].bounds, m_lightNodes[secondIdx].bounds);
+        node.index = secondIdx;
+        node.isLeaf = false;
+    }
+    
+    float SurfaceObjectAggregate::evaluateFirstChildProb(uint32_t nodeIdx, const Point3D &shadingPoint) const {
+        const LightBounds &bounds0 = m_lightNodes[nodeIdx + 1].bounds;
+        const LightBounds &bounds1 = m_lightNodes[m_lightNodes[nodeIdx].index].bounds;
+        float imp0 = bounds0.importance(shadingPoint);
+        float imp1 = bounds1.importance(shadingPoint);
+        // fall back to the powers when neither child seems to contribute, so that every light remains selectable.
+        if (imp0 + imp1 == 0.0f) {
+            imp0 = bounds0.power;
+            imp1 = bounds1.power;
+        }
+        if (imp0 + imp1 == 0.0f)
+            return 0.5f;
+        return imp0 / (imp0 + imp1);
+    }
+    
     SurfaceObjectAggregate::~SurfaceObjectAggregate() {
         delete m_accelerator;
         
-        delete m_lightList;
+        delete[] m_lightList;
         delete m_lightDist1D;
     };
     
+    int32_t SurfaceObjectAggregate::findLightIndex(const SurfaceObject* light) const {
+        uint32_t slot = hashPointer(light) & m_lightIndexMask;
+        while (true) {
+            const LightIndexEntry &entry = m_lightIndexTable[slot];
+            if (entry.light == light)
+                return entry.index;
+            if (entry.light == nullptr)
+                return -1;
+            slot = (slot + 1) & m_lightIndexMask;
+        }
+    }
+    
     float SurfaceObjectAggregate::costForIntersect() const {
         return m_accelerator->costForIntersect();
     }
@@ -268,8 +662,20 @@ namespace SLR {
         return m_accelerator->intersect(ray, isect);
     }
     
+    bool SurfaceObjectAggregate::occluded(const Ray &ray) const {
+        return m_accelerator->occluded(ray);
+    }
+    
+    void SurfaceObjectAggregate::intersectStream(Ray* rays, Intersection* isects, bool* hits, uint32_t numRays) const {
+        m_accelerator->intersectStream(rays, isects, hits, numRays);
+    }
+    
+    void SurfaceObjectAggregate::occludedStream(const Ray* rays, bool* occluded, uint32_t numRays) const {
+        m_accelerator->occludedStream(rays, occluded, numRays);
+    }
+    
     bool SurfaceObjectAggregate::isEmitting() const {
-        return m_revMap.size() > 0;
+        return m_numLights > 0;
     }
     
     float SurfaceObjectAggregate::importance() const {
@@ -292,23 +698,81 @@ namespace SLR {
         // float prob = calcProb(light.top()) * light.top()->evaluateProb(light);
         // light.push(this);
         // return prob;
-        if (m_revMap.count(light.top()) == 0)
+        int32_t lIdx = findLightIndex(light.top());
+        if (lIdx < 0)
             return 0.0f;
-        float prob = m_lightDist1D->evaluatePMF(m_revMap.at(light.top()));
+        float prob = m_lightDist1D->evaluatePMF(lIdx);
         return prob * light.top()->evaluateProb(light);
     }
     
+    LightBounds SurfaceObjectAggregate::lightBounds() const {
+        return m_lightNodes.empty() ? LightBounds() : m_lightNodes[0].bounds;
+    }
+    
+    void SurfaceObjectAggregate::selectLightFrom(const Point3D &shadingPoint, float time, float u, Light* light, float* prob) const {
+        *prob = 1.0f;
+        uint32_t nodeIdx = 0;
+        while (!m_lightNodes[nodeIdx].isLeaf) {
+            float prob0 = evaluateFirstChildProb(nodeIdx, shadingPoint);
+            if (u < prob0) {
+                u = std::min(u / prob0, 0.99999994f);
+                *prob *= prob0;
+                nodeIdx = nodeIdx + 1;
+            }
+            else {
+                u = std::min((u - prob0) / (1 - prob0), 0.99999994f);
+                *prob *= 1 - prob0;
+                nodeIdx = m_lightNodes[nodeIdx].index;
+            }
+        }
+        const SurfaceObject* obj = m_lightList[m_lightNodes[nodeIdx].index];
+        float cProb;
+        obj->selectLightFrom(shadingPoint, time, u, light, &cProb);
+        *prob *= cProb;
+    }
+    
+    float SurfaceObjectAggregate::evaluateProbFrom(const Point3D &shadingPoint, float time, const Light &light) const {
+        int32_t lIdx = findLightIndex(light.top());
+        if (lIdx < 0)
+            return 0.0f;
+        float prob = 1.0f;
+        uint64_t trail = m_lightTrails[lIdx];
+        uint32_t nodeIdx = 0;
+        while (!m_lightNodes[nodeIdx].isLeaf) {
+            float prob0 = evaluateFirstChildProb(nodeIdx, shadingPoint);
+            if (trail & 1) {
+                prob *= 1 - prob0;
+                nodeIdx = m_lightNodes[nodeIdx].index;
+            }
+            else {
+                prob *= prob0;
+                nodeIdx = nodeIdx + 1;
+            }
+            trail >>= 1;
+        }
+        return prob * light.top()->evaluateProbFrom(shadingPoint, time, light);
+    }
+    
     
     
     BoundingBox3D TransformedSurfaceObject::bounds() const {
         return m_transform->motionBounds(m_surfObj->bounds());
     }
     
+    BoundingBox3D TransformedSurfaceObject::motionBounds(float timeBegin, float timeEnd) const {
+        return m_transform->motionBounds(m_surfObj->motionBounds(timeBegin, timeEnd), timeBegin, timeEnd);
+    }
+    
     bool TransformedSurfaceObject::intersect(Ray &ray, Intersection *isect) const {
         Ray localRay;
-        StaticTransform sampledTF;
-        m_transform->sample(ray.time, &sampledTF);
-        localRay = invert(sampledTF) * ray;
+        if (m_isStatic) {
+            localRay = m_staticInvTF * ray;
+        }
+        else {
+            StaticTransform sampledTF;
+            m_transform->sample(ray.time, &sampledTF);
+            localRay = invert(sampledTF) * ray;
+        }
         if (!m_surfObj->intersect(localRay, isect))
             return false;
         ray.distMax = localRay.distMax;
@@ -316,11 +780,19 @@ namespace SLR {
         return true;
     }
     
+    bool TransformedSurfaceObject::occluded(const Ray &ray) const {
+        if (m_isStatic)
+            return m_surfObj->occluded(m_staticInvTF * ray);
+        StaticTransform sampledTF;
+        m_transform->sample(ray.time, &sampledTF);
+        return m_surfObj->occluded(invert(sampledTF) * ray);
+    }
+    
     Point3D TransformedSurfaceObject::getIntersectionPoint(const Intersection &isect) const {
         isect.obj.pop();
         Point3D ret = isect.obj.top()->getIntersectionPoint(isect);
         StaticTransform sampledTF;
-        m_transform->sample(isect.time, &sampledTF);
+        sampleTransform(isect.time, &sampledTF);
         ret = sampledTF * ret;
         isect.obj.push(this);
         return ret;
@@ -330,7 +802,7 @@ namespace SLR {
         isect.obj.pop();
         isect.obj.top()->getSurfacePoint(isect, surfPt);
         StaticTransform sampledTF;
-        m_transform->sample(isect.time, &sampledTF);
+        sampleTransform(isect.time, &sampledTF);
         *surfPt = sampledTF * *surfPt;
         isect.obj.push(this);
     }
@@ -357,6 +829,41 @@ namespace SLR {
         return prob;
     }
     
+    LightBounds TransformedSurfaceObject::lightBounds() const {
+        LightBounds ret = m_surfObj->lightBounds();
+        ret.bbox = bounds();
+        if (!m_isStatic) {
+            ret.cosThetaO = -1.0f;
+            return ret;
+        }
+        ret.axis = normalize(m_staticTF * Normal3D(ret.axis));
+        // angles are preserved only by a similarity transform.
+        float lx = (m_staticTF * Vector3D::Ex).length();
+        float ly = (m_staticTF * Vector3D::Ey).length();
+        float lz = (m_staticTF * Vector3D::Ez).length();
+        if (std::max(std::max(lx, ly), lz) > 1.001f * std::min(std::min(lx, ly), lz))
+            ret.cosThetaO = -1.0f;
+        return ret;
+    }
+    
+    void TransformedSurfaceObject::selectLightFrom(const Point3D &shadingPoint, float time, float u, Light* light, float* prob) const {
+        StaticTransform sampledTF;
+        sampleTransform(time, &sampledTF);
+        m_surfObj->selectLightFrom(m_isStatic ? m_staticInvTF * shadingPoint : invert(sampledTF) * shadingPoint, time, u, light, prob);
+        light->push(this);
+    }
+    
+    float TransformedSurfaceObject::evaluateProbFrom(const Point3D &shadingPoint, float time, const Light &light) const {
+        if (light.top() != this)
+            return 0.0f;
+        StaticTransform sampledTF;
+        sampleTransform(time, &sampledTF);
+        light.pop();
+        float prob = m_surfObj->evaluateProbFrom(m_isStatic ? m_staticInvTF * shadingPoint : invert(sampledTF) * shadingPoint, time, light);
+        light.push(this);
+        return prob;
+    }
+    
     SampledSpectrum TransformedSurfaceObject::sample(const Light &light, const LightPosQuery &query, const LightPosSample &smp, LightPosQueryResult* result) const {
         if (light.top() != this) {
             result->areaPDF = 0.0f;
@@ -365,7 +872,7 @@ namespace SLR {
         light.pop();
         SampledSpectrum M = light.top()->sample(light, query, smp, result);
         StaticTransform sampledTF;
-        m_transform->sample(query.time, &sampledTF);
+        sampleTransform(query.time, &sampledTF);
         result->surfPt = sampledTF * result->surfPt;
         light.push(this);
         return M;
@@ -385,7 +892,7 @@ namespace SLR {
         light.pop();
         Ray ray = light.top()->sampleRay(light, lightPosQuery, lightPosSample, lightPosResult, Le0, edf, edfQuery, edfSample, edfResult, Le1, mem);
         StaticTransform sampledTF;
-        m_transform->sample(lightPosQuery.time, &sampledTF);
+        sampleTransform(lightPosQuery.time, &sampledTF);
         lightPosResult->surfPt = sampledTF * lightPosResult->surfPt;
         light.push(this);
         return sampledTF * ray;
@@ -415,18 +922,35 @@ namespace SLR {
         return false;
     }
     
+    bool Scene::occluded(const Ray &ray) const {
+        // The environment sphere is only hit by rays of infinite extent and never occludes a shadow ray.
+        return m_aggregate->occluded(ray);
+    }
+    
+    void Scene::intersectStream(Ray* rays, Intersection* isects, bool* hits, uint32_t numRays) const {
+        m_aggregate->intersectStream(rays, isects, hits, numRays);
+        if (m_envSphere) {
+            for (uint32_t i = 0; i < numRays; ++i) {
+                if (!hits[i])
+                    hits[i] = m_envSphere->intersect(rays[i], &isects[i]);
+            }
+        }
+    }
+    
+    void Scene::occludedStream(const Ray* rays, bool* occluded, uint32_t numRays) const {
+        m_aggregate->occludedStream(rays, occluded, numRays);
+    }
+    
     bool Scene::testVisibility(const SurfacePoint &shdP, const SurfacePoint &lightP, float time) const {
+        return !occluded(createVisibilityRay(shdP, lightP, time));
+    }
+    
+    Ray Scene::createVisibilityRay(const SurfacePoint &shdP, const SurfacePoint &lightP, float time) {
         SLRAssert(shdP.atInfinity == false, "Shading point must be in finite region.");
-        Ray ray;
-        if (lightP.atInfinity) {
-            ray = Ray(shdP.p, normalize(lightP.p - Point3D::Zero), time, Ray::Epsilon, FLT_MAX);
-        }
-        else {
-            float dist = distance(lightP.p, shdP.p);
-            ray = Ray(shdP.p, (lightP.p - shdP.p) / dist, time, Ray::Epsilon, dist * (1 - Ray::Epsilon));
-        }
-        Intersection isect;
-        return !intersect(ray, &isect);
+        if (lightP.atInfinity)
+            return Ray(shdP.p, normalize(lightP.p - Point3D::Zero), time, Ray::Epsilon, FLT_MAX);
+        float dist = distance(lightP.p, shdP.p);
+        return Ray(shdP.p, (lightP.p - shdP.p) / dist, time, Ray::Epsilon, dist * (1 - Ray::Epsilon));
     }
     
     void Scene::selectLight(float u, Light* light, float* prob) const {
@@ -464,4 +988,41 @@ namespace SLR {
         SLRAssert(!std::isnan(ret) && !std::isinf(ret), "%g", ret);
         return ret;
     }
+    
+    // The choice between the aggregate and the environment stays the same as the point-independent version.
+    void Scene::selectLight(const Point3D &shadingPoint, float time, float u, Light* light, float* prob) const {
+        if (m_envSphere) {
+            float sumImps = m_aggregate->importance() + m_envSphere->importance();
+            float su = sumImps * u;
+            if (su < m_aggregate->importance()) {
+                u = u / (m_aggregate->importance() / sumImps);
+                m_aggregate->selectLightFrom(shadingPoint, time, u, light, prob);
+                *prob *= m_aggregate->importance() / sumImps;
+            }
+            else {
+                u = (u - m_aggregate->importance()) / (m_envSphere->importance() / sumImps);
+                m_envSphere->selectLight(u, light, prob);
+                *prob *= m_envSphere->importance() / sumImps;
+            }
+        }
+        else {
+            m_aggregate->selectLightFrom(shadingPoint, time, u, light, prob);
+        }
+    }
+    
+    float Scene::evaluateProb(const Point3D &shadingPoint, float time, const Light &light) const {
+        float ret = 0.0f;
+        if (m_envSphere) {
+            float sumImps = m_aggregate->importance() + m_envSphere->importance();
+            if (light.top() == m_envSphere)
+                ret = m_envSphere->importance() / sumImps;
+            else
+                ret = m_aggregate->importance() / sumImps * m_aggregate->evaluateProbFrom(shadingPoint, time, light);
+        }
+        else {
+            ret = m_aggregate->evaluateProbFrom(shadingPoint, time, light);
+        }
+        SLRAssert(!std::isnan(ret) && !std::isinf(ret), "%g", ret);
+        return ret;
+    }
 }
@@ -12,6 +12,8 @@
 #include "../references.h"
 #include "geometry.h"
 #include "directional_distribution_functions.h"
+#include "Transform.h"
+#include "../Surface/TriangleMesh.h"
 
 namespace SLR {
     struct SLR_API LightPosQuery {
@@ -32,10 +34,10 @@ namespace SLR {
     };
     
     class SLR_API Light {
-        mutable std::stack<const SurfaceObject*> m_hierarchy;
+        mutable SurfaceObjectStack m_hierarchy;
     public:
         Light() { }
-        Light(const std::stack<const SurfaceObject*> &hierarchy) : m_hierarchy(hierarchy) { }
+        Light(const SurfaceObjectStack &hierarchy) : m_hierarchy(hierarchy) { }
         
         void push(const SurfaceObject* obj) const { m_hierarchy.push(obj); }
         void pop() const { m_hierarchy.pop(); }
@@ -47,6 +49,26 @@ namespace SLR {
                       ArenaAllocator &mem) const;
     };
     
+    // Spatial and directional extent of the emission of a light or a group of lights.
+    // The normals of the emitting surfaces are within acos(cosThetaO) around the axis,
+    // and each point emits within acos(cosThetaE) around its normal.
+    struct SLR_API LightBounds {
+        BoundingBox3D bbox;
+        Vector3D axis;
+        float cosThetaO;
+        float cosThetaE;
+        float power;
+        
+        LightBounds() : axis(Vector3D::Ez), cosThetaO(-1.0f), cosThetaE(0.0f), power(0.0f) { }
+        LightBounds(const BoundingBox3D &bb, const Vector3D &ax, float cosO, float cosE, float pw) :
+        bbox(bb), axis(ax), cosThetaO(cosO), cosThetaE(cosE), power(pw) { }
+        
+        // conservative estimate of the contribution to a shading point.
+        float importance(const Point3D &shadingPoint) const;
+    };
+    
+    SLR_API LightBounds calcUnion(const LightBounds &b0, const LightBounds &b1);
+    
     
     
     class SLR_API SurfaceObject {
@@ -56,6 +78,11 @@ namespace SLR {
         
         virtual float costForIntersect() const = 0;
         virtual BoundingBox3D bounds() const = 0;
+        // bounds within the time interval for accelerators that separate motion in time.
+        virtual BoundingBox3D motionBounds(float timeBegin, float timeEnd) const { return bounds(); }
+        virtual bool hasMotion() const { return false; }
+        // number of objects a hit on this object pushes onto the hierarchy of an intersection, at most MaxInstancingDepth.
+        virtual uint32_t instancingDepth() const { return 1; }
         virtual BoundingBox3D choppedBounds(BoundingBox3D::Axis chopAxis, float minChopPos, float maxChopPos) const {
             BoundingBox3D baseBBox = bounds();
             if (maxChopPos < baseBBox.minP[chopAxis])
@@ -87,6 +114,11 @@ namespace SLR {
             bbox1->minP[splitAxis] = std::max(bbox1->minP[splitAxis], splitPos);
         }
         virtual bool intersect(Ray &ray, Intersection* isect) const = 0;
+        virtual bool occluded(const Ray &ray) const = 0;
+        // Accelerators can embed the vertices of a plain triangle (without alpha test) into their leaves,
+        // and complete the intersection from a distance and barycentric coordinates.
+        virtual bool getEmbeddableTriangle(Point3D* p0, Point3D* p1, Point3D* p2) const { return false; }
+        virtual void fillEmbeddedTriangleIntersection(const Ray &ray, float dist, float b1, float b2, Intersection* isect) const { SLRAssert_NotImplemented(); }
         virtual Point3D getIntersectionPoint(const Intersection &isect) const { return isect.obj.top()->getIntersectionPoint(isect); }
         virtual const SurfaceMaterial* getSurfaceMaterial() const { SLRAssert_NotImplemented(); return nullptr; }
         virtual void getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const { isect.obj.top()->getSurfacePoint(isect, surfPt); }
@@ -95,6 +127,10 @@ namespace SLR {
         virtual float importance() const = 0;
         virtual void selectLight(float u, Light* light, float* prob) const = 0;
         virtual float evaluateProb(const Light &light) const = 0;
+        virtual LightBounds lightBounds() const { return LightBounds(bounds(), Vector3D::Ez, -1.0f, 0.0f, importance()); }
+        // selection adapted to a shading point, objects without a light hierarchy ignore the point.
+        virtual void selectLightFrom(const Point3D &shadingPoint, float time, float u, Light* light, float* prob) const { selectLight(u, light, prob); }
+        virtual float evaluateProbFrom(const Point3D &shadingPoint, float time, const Light &light) const { return evaluateProb(light); }
         
         virtual SampledSpectrum sample(const Light &light, const LightPosQuery &query, const LightPosSample &smp, LightPosQueryResult* result) const {
             return light.top()->sample(light, query, smp, result);
@@ -106,6 +142,12 @@ namespace SLR {
             return light.top()->sampleRay(light, lightPosQuery, lightPosSample, lightPosResult, Le0, edf, edfQuery, edfSample, edfResult, Le1, mem);
         }
         
+        // called through SurfacePoint for the object which produced the point.
+        virtual BSDF* createBSDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const { SLRAssert_NotImplemented(); return nullptr; }
+        virtual float evaluateAreaPDF(const SurfacePoint& surfPt) const { SLRAssert_NotImplemented(); return 0.0f; }
+        virtual SampledSpectrum emittance(const SurfacePoint& surfPt, const WavelengthSamples &wls) const { return SampledSpectrum::Zero; }
+        virtual EDF* createEDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const { SLRAssert_NotImplemented(); return nullptr; }
+        
         bool intersect(Ray &ray, SurfacePoint* surfPt) const;
         bool testVisibility(const SurfacePoint &shdP, const SurfacePoint &lightP, float time) const;
     };
@@ -130,7 +172,10 @@ namespace SLR {
             m_surface->splitBounds(chopAxis, splitPos, bbox0, bbox1);
         }
         bool intersect(Ray &ray, Intersection* isect) const override;
-        Point3D getIntersectionPoint(const Intersection &isect) const override { return isect.p; }
+        bool occluded(const Ray &ray) const override { return m_surface->occluded(ray); }
+        bool getEmbeddableTriangle(Point3D* p0, Point3D* p1, Point3D* p2) const override { return m_surface->getEmbeddableTriangle(p0, p1, p2); }
+        void fillEmbeddedTriangleIntersection(const Ray &ray, float dist, float b1, float b2, Intersection* isect) const override;
+        Point3D getIntersectionPoint(const Intersection &isect) const override { return m_surface->getIntersectionPoint(isect); }
         const SurfaceMaterial* getSurfaceMaterial() const override { return m_material; }
         void getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const override;
         
@@ -138,6 +183,7 @@ namespace SLR {
         float importance() const override;
         void selectLight(float u, Light* light, float* prob) const override;
         float evaluateProb(const Light &light) const override;
+        LightBounds lightBounds() const override;
         
         SampledSpectrum sample(const Light &light, const LightPosQuery &query, const LightPosSample &smp, LightPosQueryResult* result) const override;
         virtual Ray sampleRay(const Light &light,
@@ -145,11 +191,11 @@ namespace SLR {
                               const EDFQuery &edfQuery, const EDFSample &edfSample, EDFQueryResult* edfResult, SampledSpectrum* Le1,
                               ArenaAllocator &mem) const override;
         
-        virtual BSDF* createBSDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const;
+        BSDF* createBSDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const override;
         
-        virtual float evaluateAreaPDF(const SurfacePoint& surfPt) const;
-        virtual SampledSpectrum emittance(const SurfacePoint& surfPt, const WavelengthSamples &wls) const;
-        virtual EDF* createEDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const;
+        float evaluateAreaPDF(const SurfacePoint& surfPt) const override;
+        SampledSpectrum emittance(const SurfacePoint& surfPt, const WavelengthSamples &wls) const override;
+        EDF* createEDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const override;
     };
     
     class SLR_API BumpSingleSurfaceObject : public SingleSurfaceObject {
@@ -161,9 +207,96 @@ namespace SLR {
         void getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const override;
     };
     
+    struct SLR_API TriangleMeshMaterialGroup {
+        const SurfaceMaterial* material;
+        const Normal3DTexture* normalMap;
+        const FloatTexture* alphaTexture;
+    };
+    
+    // A triangle of TriangleMeshSurfaceObject, it refers to the mesh by a primitive index instead of holding its own surface and material.
+    class SLR_API TriangleSurfaceObject : public SurfaceObject {
+        const TriangleMeshSurfaceObject* m_mesh;
+        uint32_t m_primIndex;
+        
+        // For a compact mesh, the vertices are decoded into the given storage.
+        Triangle getTriangle(Vertex storage[3], bool withShadingFrame) const;
+        const TriangleMeshMaterialGroup &getMaterialGroup() const;
+    public:
+        TriangleSurfaceObject() : m_mesh(nullptr), m_primIndex(0) { }
+        TriangleSurfaceObject(const TriangleMeshSurfaceObject* mesh, uint32_t primIndex) : m_mesh(mesh), m_primIndex(primIndex) { }
+        
+        float costForIntersect() const override { return 1.0f; }
+        BoundingBox3D bounds() const override;
+        BoundingBox3D choppedBounds(BoundingBox3D::Axis chopAxis, float minChopPos, float maxChopPos) const override;
+        void splitBounds(BoundingBox3D::Axis splitAxis, float splitPos, BoundingBox3D* bbox0, BoundingBox3D* bbox1) const override;
+        bool intersect(Ray &ray, Intersection* isect) const override;
+        bool occluded(const Ray &ray) const override;
+        bool getEmbeddableTriangle(Point3D* p0, Point3D* p1, Point3D* p2) const override;
+        void fillEmbeddedTriangleIntersection(const Ray &ray, float dist, float b1, float b2, Intersection* isect) const override;
+        Point3D getIntersectionPoint(const Intersection &isect) const override;
+        const SurfaceMaterial* getSurfaceMaterial() const override;
+        void getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const override;
+        
+        bool isEmitting() const override;
+        float importance() const override;
+        void selectLight(float u, Light* light, float* prob) const override;
+        float evaluateProb(const Light &light) const override;
+        LightBounds lightBounds() const override;
+        
+        SampledSpectrum sample(const Light &light, const LightPosQuery &query, const LightPosSample &smp, LightPosQueryResult* result) const override;
+        Ray sampleRay(const Light &light,
+                      const LightPosQuery &lightPosQuery, const LightPosSample &lightPosSample, LightPosQueryResult* lightPosResult, SampledSpectrum* Le0, EDF** edf,
+                      const EDFQuery &edfQuery, const EDFSample &edfSample, EDFQueryResult* edfResult, SampledSpectrum* Le1,
+                      ArenaAllocator &mem) const override;
+        
+        BSDF* createBSDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const override;
+        
+        float evaluateAreaPDF(const SurfacePoint& surfPt) const override;
+        SampledSpectrum emittance(const SurfacePoint& surfPt, const WavelengthSamples &wls) const override;
+        EDF* createEDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem) const override;
+    };
+    
+    // Owns the vertex and index buffers and per-triangle material indices of a mesh.
+    // Its triangles are exposed to accelerators as a contiguous array of TriangleSurfaceObject.
+    // A compact mesh keeps only the positions in full precision and packs the other attributes into CompactVertexAttribute.
+    class SLR_API TriangleMeshSurfaceObject {
+        friend class TriangleSurfaceObject;
+        
+        static bool s_useCompactVertices;
+        
+        bool m_compact;
+        std::vector<Vertex> m_vertices;
+        std::vector<Point3D> m_positions;
+        std::vector<CompactVertexAttribute> m_compactAttributes;
+        std::vector<uint32_t> m_indices;
+        std::vector<uint16_t> m_materialIndices;
+        std::vector<TriangleMeshMaterialGroup> m_materialGroups;
+        std::vector<TriangleConstants> m_triangleConstants;
+        std::vector<TriangleSurfaceObject> m_triangles;
+        
+        void decodeVertices(uint32_t primIndex, bool withShadingFrame, Vertex vertices[3]) const;
+        void updateTriangleConstants();
+    public:
+        // the format is chosen by setUseCompactVertices() at the construction time.
+        TriangleMeshSurfaceObject(std::vector<Vertex> &&vertices, std::vector<uint32_t> &&indices, std::vector<uint16_t> &&materialIndices,
+                                  const std::vector<TriangleMeshMaterialGroup> &materialGroups);
+        // the triangles refer to this mesh by address.
+        TriangleMeshSurfaceObject(const TriangleMeshSurfaceObject &) = delete;
+        TriangleMeshSurfaceObject &operator=(const TriangleMeshSurfaceObject &) = delete;
+        
+        void applyTransform(const StaticTransform &transform);
+        
+        bool isCompact() const { return m_compact; }
+        uint32_t numVertices() const { return (uint32_t)(m_compact ? m_positions.size() : m_vertices.size()); }
+        uint32_t numTriangles() const { return (uint32_t)m_triangles.size(); }
+        TriangleSurfaceObject* triangle(uint32_t idx) { return &m_triangles[idx]; }
+        
+        static void setUseCompactVertices(bool compact) { s_useCompactVertices = compact; }
+    };
+    
     class SLR_API InfiniteSphereSurfaceObject : public SingleSurfaceObject {
         const Scene* m_scene;
-        const RegularConstantContinuous2D* m_dist;
+        const Continuous2DDistribution* m_dist;
     public:
         InfiniteSphereSurfaceObject(const Scene* scene, const IBLEmission* emitter);
         ~InfiniteSphereSurfaceObject();
@@ -185,22 +318,53 @@ namespace SLR {
     
     
     class SLR_API SurfaceObjectAggregate : public SurfaceObject {
+        struct LightIndexEntry {
+            const SurfaceObject* light;
+            uint32_t index;
+        };
+        
+        // The first child of an internal node immediately follows it and "index" points to the second one.
+        // "index" of a leaf is the index of its light in m_lightList.
+        struct LightBVHNode {
+            LightBounds bounds;
+            uint32_t index;
+            bool isLeaf;
+        };
+        
         Accelerator* m_accelerator;
         const SurfaceObject** m_lightList;
         RegularConstantDiscrete1D* m_lightDist1D;
-        std::map<const SurfaceObject*, uint32_t> m_revMap;
+        uint32_t m_numLights;
+        // open addressing hash table from a light to its index in m_lightList.
+        std::vector<LightIndexEntry> m_lightIndexTable;
+        uint32_t m_lightIndexMask;
+        std::vector<LightBVHNode> m_lightNodes;
+        // child choices from the root to the leaf of each light, one bit per depth.
+        std::vector<uint64_t> m_lightTrails;
+        uint32_t m_instancingDepth;
+        
+        int32_t findLightIndex(const SurfaceObject* light) const;
+        void buildLightBVH(const std::vector<LightBounds> &lightBounds, uint32_t* indices, uint32_t numIndices, uint32_t depth, uint64_t trail);
+        float evaluateFirstChildProb(uint32_t nodeIdx, const Point3D &shadingPoint) const;
     public:
-        SurfaceObjectAggregate(std::vector<SurfaceObject*> &objs);
+        SurfaceObjectAggregate(std::vector<SurfaceObject*> &objs, AcceleratorType accelType = AcceleratorType::Auto);
         ~SurfaceObjectAggregate();
         
         float costForIntersect() const override;
         BoundingBox3D bounds() const override;
+        uint32_t instancingDepth() const override { return m_instancingDepth; }
         bool intersect(Ray &ray, Intersection* isect) const override;
+        bool occluded(const Ray &ray) const override;
+        void intersectStream(Ray* rays, Intersection* isects, bool* hits, uint32_t numRays) const;
+        void occludedStream(const Ray* rays, bool* occluded, uint32_t numRays) const;
         
         bool isEmitting() const override;
         float importance() const override;
         void selectLight(float u, Light* light, float* prob) const override;
         float evaluateProb(const Light &light) const override;
+        LightBounds lightBounds() const override;
+        void selectLightFrom(const Point3D &shadingPoint, float time, float u, Light* light, float* prob) const override;
+        float evaluateProbFrom(const Point3D &shadingPoint, float time, const Light &light) const override;
     };
     
     
@@ -208,13 +372,30 @@ namespace SLR {
     class SLR_API TransformedSurfaceObject : public SurfaceObject {
         const SurfaceObject* m_surfObj;
         const Transform* m_transform;
+        // A static transform is sampled once with its inverse, that is world-to-object transform.
+        bool m_isStatic;
+        StaticTransform m_staticTF;
+        StaticTransform m_staticInvTF;
         friend class Light;
+        
+        void sampleTransform(float time, StaticTransform* tf) const {
+            if (m_isStatic)
+                *tf = m_staticTF;
+            else
+                m_transform->sample(time, tf);
+        }
     public:
-        TransformedSurfaceObject(const SurfaceObject* surfObj, const Transform* transform) : m_surfObj(surfObj), m_transform(transform) { }
+        TransformedSurfaceObject(const SurfaceObject* surfObj, const Transform* transform) : m_surfObj(surfObj) {
+            setTransform(transform);
+        }
         
         float costForIntersect() const override { return m_surfObj->costForIntersect(); }
         BoundingBox3D bounds() const override;
+        BoundingBox3D motionBounds(float timeBegin, float timeEnd) const override;
+        bool hasMotion() const override { return !m_isStatic || m_surfObj->hasMotion(); }
+        uint32_t instancingDepth() const override { return m_surfObj->instancingDepth() + 1; }
         bool intersect(Ray &ray, Intersection* isect) const override;
+        bool occluded(const Ray &ray) const override;
         Point3D getIntersectionPoint(const Intersection &isect) const override;
         void getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const override;
         
@@ -222,6 +403,9 @@ namespace SLR {
         float importance() const override;
         void selectLight(float u, Light* light, float* prob) const override;
         float evaluateProb(const Light &light) const override;
+        LightBounds lightBounds() const override;
+        void selectLightFrom(const Point3D &shadingPoint, float time, float u, Light* light, float* prob) const override;
+        float evaluateProbFrom(const Point3D &shadingPoint, float time, const Light &light) const override;
         
         SampledSpectrum sample(const Light &light, const LightPosQuery &query, const LightPosSample &smp, LightPosQueryResult* result) const override;
         Ray sampleRay(const Light &light,
@@ -231,7 +415,14 @@ namespace SLR {
         
         const SurfaceMaterial* getSurfaceMaterial() const override { return m_surfObj->getSurfaceMaterial(); }
         
-        void setTransform(const Transform* t) { m_transform = t; }
+        void setTransform(const Transform* t) {
+            m_transform = t;
+            m_isStatic = m_transform->isStatic();
+            if (m_isStatic) {
+                m_transform->sample(0.0f, &m_staticTF);
+                m_staticInvTF = invert(m_staticTF);
+            }
+        }
     };
     
     
@@ -254,9 +445,17 @@ namespace SLR {
         float getWorldDiscArea() const { return m_worldDiscArea; }
         
         bool intersect(Ray &ray, Intersection* isect) const;
+        bool occluded(const Ray &ray) const;
+        void intersectStream(Ray* rays, Intersection* isects, bool* hits, uint32_t numRays) const;
+        void occludedStream(const Ray* rays, bool* occluded, uint32_t numRays) const;
         bool testVisibility(const SurfacePoint &shdP, const SurfacePoint &lightP, float time) const;
+        // shadow ray tested by testVisibility(), for testing many of them with occludedStream().
+        static Ray createVisibilityRay(const SurfacePoint &shdP, const SurfacePoint &lightP, float time);
         void selectLight(float u, Light* light, float* prob) const;
         float evaluateProb(const Light &light) const;
+        // the probabilities depend on the shading point from which the light is seen.
+        void selectLight(const Point3D &shadingPoint, float time, float u, Light* light, float* prob) const;
+        float evaluateProb(const Point3D &shadingPoint, float time, const Light &light) const;
     };
 }
 
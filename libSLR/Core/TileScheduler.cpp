@@ -0,0 +1,167 @@
+//
+//  TileScheduler.cpp
+//
+//  Created by 渡部 心 on 2016/10/02.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#include "TileScheduler.h"
+#include "../Helper/ThreadPool.h"
+
+namespace SLR {
+    // Only one job of a region exists at a time, it enqueues the next one when it still has samples to render.
+    struct TileScheduler::RegionJob {
+        ThreadPool* threadPool;
+        const TileFunction* func;
+        const JobEndFunction* jobEndFunc;
+        const TileScheduler* scheduler;
+        Region region;
+        uint32_t numRemainingSamples;
+        uint32_t samplesPerJob;
+        double elapsed;
+        
+        void kernel(uint32_t threadID) {
+            uint32_t numSamples = std::min(numRemainingSamples, samplesPerJob);
+            std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+            for (int s = 0; s < numSamples; ++s) {
+                for (int ty = region.tileY; ty < region.tileY + region.numTilesY; ++ty)
+                    for (int tx = region.tileX; tx < region.tileX + region.numTilesX; ++tx)
+                        if (scheduler->isTileActive(tx, ty))
+                            (*func)(threadID, tx, ty);
+            }
+            if (*jobEndFunc)
+                (*jobEndFunc)(threadID);
+            elapsed += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            
+            numRemainingSamples -= numSamples;
+            if (numRemainingSamples > 0)
+                threadPool->enqueue(std::bind(&RegionJob::kernel, this, std::placeholders::_1));
+        }
+    };
+    
+    TileScheduler::TileScheduler(uint32_t numTilesX, uint32_t numTilesY) :
+    m_numTilesX(numTilesX), m_numTilesY(numTilesY) {
+        m_tileCosts.resize(m_numTilesX * m_numTilesY, 1.0);
+        m_summedCosts.resize((m_numTilesX + 1) * (m_numTilesY + 1), 0.0);
+        m_activeTiles.resize(m_numTilesX * m_numTilesY, 1);
+    }
+    
+    void TileScheduler::buildSummedCosts() {
+        const uint32_t stride = m_numTilesX + 1;
+        for (int y = 0; y < m_numTilesY; ++y) {
+            double rowSum = 0.0;
+            for (int x = 0; x < m_numTilesX; ++x) {
+                if (m_activeTiles[y * m_numTilesX + x])
+                    rowSum += m_tileCosts[y * m_numTilesX + x];
+                m_summedCosts[(y + 1) * stride + (x + 1)] = m_summedCosts[y * stride + (x + 1)] + rowSum;
+            }
+        }
+    }
+    
+    uint32_t TileScheduler::numActiveTiles(const Region &region) const {
+        uint32_t numActive = 0;
+        for (int ty = region.tileY; ty < region.tileY + region.numTilesY; ++ty)
+            for (int tx = region.tileX; tx < region.tileX + region.numTilesX; ++tx)
+                numActive += m_activeTiles[ty * m_numTilesX + tx];
+        return numActive;
+    }
+    
+    double TileScheduler::cost(const Region &region) const {
+        const uint32_t stride = m_numTilesX + 1;
+        uint32_t x0 = region.tileX, x1 = region.tileX + region.numTilesX;
+        uint32_t y0 = region.tileY, y1 = region.tileY + region.numTilesY;
+        return m_summedCosts[y1 * stride + x1] - m_summedCosts[y0 * stride + x1] - m_summedCosts[y1 * stride + x0] + m_summedCosts[y0 * stride + x0];
+    }
+    
+    void TileScheduler::subdivide(const Region &region, double targetCost, std::vector<Region>* regions) const {
+        if (region.numTiles() == 1 || cost(region) <= targetCost) {
+            regions->push_back(region);
+            return;
+        }
+        
+        // split the longer axis at the position that balances the costs of both sides.
+        bool splitX = region.numTilesX >= region.numTilesY;
+        uint32_t numTiles = splitX ? region.numTilesX : region.numTilesY;
+        double totalCost = cost(region);
+        uint32_t bestPos = numTiles / 2;
+        double bestDiff = INFINITY;
+        for (uint32_t pos = 1; pos < numTiles; ++pos) {
+            Region left = region;
+            if (splitX)
+                left.numTilesX = pos;
+            else
+                left.numTilesY = pos;
+            double diff = std::fabs(2 * cost(left) - totalCost);
+            if (diff < bestDiff) {
+                bestDiff = diff;
+                bestPos = pos;
+            }
+        }
+        
+        Region left = region, right = region;
+        if (splitX) {
+            left.numTilesX = bestPos;
+            right.tileX += bestPos;
+            right.numTilesX -= bestPos;
+        }
+        else {
+            left.numTilesY = bestPos;
+            right.tileY += bestPos;
+            right.numTilesY -= bestPos;
+        }
+        subdivide(left, targetCost, regions);
+        subdivide(right, targetCost, regions);
+    }
+    
+    void TileScheduler::render(ThreadPool &threadPool, uint32_t numSamples, const TileFunction &func, const JobEndFunction &jobEndFunc) {
+        if (numSamples == 0 || m_numTilesX == 0 || m_numTilesY == 0)
+            return;
+        
+        buildSummedCosts();
+        Region whole = {0, 0, m_numTilesX, m_numTilesY};
+        double targetCost = cost(whole) / (NumRegionsPerThread * threadPool.numThreads());
+        std::vector<Region> allRegions;
+        subdivide(whole, targetCost, &allRegions);
+        std::vector<Region> regions;
+        for (int i = 0; i < allRegions.size(); ++i)
+            if (numActiveTiles(allRegions[i]) > 0)
+                regions.push_back(allRegions[i]);
+        if (regions.empty())
+            return;
+        
+        // a region is split into at least a few jobs so that the chain doesn't serialize the tail of the pass.
+        uint32_t samplesPerJob = std::min(std::max(numSamples / 4, 1u), MaxSamplesPerJob);
+        std::vector<RegionJob> jobs(regions.size());
+        for (int i = 0; i < regions.size(); ++i) {
+            RegionJob &job = jobs[i];
+            job.threadPool = &threadPool;
+            job.func = &func;
+            job.jobEndFunc = &jobEndFunc;
+            job.scheduler = this;
+            job.region = regions[i];
+            job.numRemainingSamples = numSamples;
+            job.samplesPerJob = samplesPerJob;
+            job.elapsed = 0.0;
+        }
+        
+        // Workers pop from the back of their deques, so enqueuing in ascending order of cost starts the expensive regions first.
+        std::vector<uint32_t> order(jobs.size());
+        for (int i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [this, &regions](uint32_t a, uint32_t b) { return cost(regions[a]) < cost(regions[b]); });
+        for (int i = 0; i < order.size(); ++i)
+            threadPool.enqueue(std::bind(&RegionJob::kernel, &jobs[order[i]], std::placeholders::_1));
+        threadPool.wait();
+        
+        // distribute the measured cost per sample evenly over the tiles of each region.
+        for (int i = 0; i < jobs.size(); ++i) {
+            const RegionJob &job = jobs[i];
+            const Region &region = job.region;
+            double tileCost = std::max(job.elapsed / (numSamples * numActiveTiles(region)), 1e-9);
+            for (int ty = region.tileY; ty < region.tileY + region.numTilesY; ++ty)
+                for (int tx = region.tileX; tx < region.tileX + region.numTilesX; ++tx)
+                    if (m_activeTiles[ty * m_numTilesX + tx])
+                        m_tileCosts[ty * m_numTilesX + tx] = tileCost;
+        }
+    }
+}
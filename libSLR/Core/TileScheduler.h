@@ -0,0 +1,61 @@
+//
+//  TileScheduler.h
+//
+//  Created by 渡部 心 on 2016/10/02.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#ifndef __SLR__TileScheduler__
+#define __SLR__TileScheduler__
+
+#include "../defines.h"
+#include "../references.h"
+
+class ThreadPool;
+
+namespace SLR {
+    // Groups the sensor tiles into rectangular regions of roughly equal cost and renders several samples per region job.
+    // Regions are rebuilt in each render() call by a k-d subdivision over the per-tile cost measured in the previous call,
+    // so expensive areas get split and cheap ones get merged.
+    class SLR_API TileScheduler {
+    public:
+        struct Region {
+            uint32_t tileX, tileY;
+            uint32_t numTilesX, numTilesY;
+            
+            uint32_t numTiles() const { return numTilesX * numTilesY; };
+        };
+        
+        // called for each sample of each tile.
+        typedef std::function<void(uint32_t threadID, uint32_t tileX, uint32_t tileY)> TileFunction;
+        // called at the end of each region job on its thread, before the next job of the region can start.
+        typedef std::function<void(uint32_t threadID)> JobEndFunction;
+    private:
+        static const uint32_t NumRegionsPerThread = 8;
+        static const uint32_t MaxSamplesPerJob = 16;
+        
+        struct RegionJob;
+        
+        uint32_t m_numTilesX;
+        uint32_t m_numTilesY;
+        std::vector<double> m_tileCosts;
+        std::vector<double> m_summedCosts;
+        std::vector<uint8_t> m_activeTiles;
+        
+        void buildSummedCosts();
+        uint32_t numActiveTiles(const Region &region) const;
+        double cost(const Region &region) const;
+        void subdivide(const Region &region, double targetCost, std::vector<Region>* regions) const;
+    public:
+        TileScheduler(uint32_t numTilesX, uint32_t numTilesY);
+        
+        // inactive tiles are skipped by render() and don't count in the cost of a region. All tiles are initially active.
+        void setTileActive(uint32_t tileX, uint32_t tileY, bool active) { m_activeTiles[tileY * m_numTilesX + tileX] = active; };
+        bool isTileActive(uint32_t tileX, uint32_t tileY) const { return m_activeTiles[tileY * m_numTilesX + tileX] != 0; };
+        
+        // renders numSamples samples for every active tile and returns when all of them complete.
+        void render(ThreadPool &threadPool, uint32_t numSamples, const TileFunction &func, const JobEndFunction &jobEndFunc = JobEndFunction());
+    };
+}
+
+#endif
@@ -25,6 +25,8 @@ namespace SLR {
         virtual Transform* createByMulLeft(const StaticTransform &staticTF, ArenaAllocator &mem) const { SLRAssert_NotImplemented(); return nullptr; }
         virtual Transform* createByMulRight(const StaticTransform &staticTF, ArenaAllocator &mem) const { SLRAssert_NotImplemented(); return nullptr; }
         virtual BoundingBox3D motionBounds(const BoundingBox3D &bb) const { SLRAssert_NotImplemented(); return BoundingBox3D(); }
+        // bounds swept by the box within the time interval.
+        virtual BoundingBox3D motionBounds(const BoundingBox3D &bb, float timeBegin, float timeEnd) const { SLRAssert_NotImplemented(); return BoundingBox3D(); }
         
         Ray mul(const Ray &r) const;
         Point3D mul(const Point3D &p, float t) const;
@@ -64,7 +66,8 @@ namespace SLR {
             return ret;
         }
         StaticTransform operator*(const Matrix4x4 &m) const { return StaticTransform(mat * m); }
-        StaticTransform operator*(const StaticTransform &t) const { return StaticTransform(mat * t.mat); }
+        // (AB)^-1 = B^-1 A^-1, which saves a 4x4 inversion.
+        StaticTransform operator*(const StaticTransform &t) const { return StaticTransform(mat * t.mat, t.matInv * matInv); }
         bool operator==(const StaticTransform &t) const { return mat == t.mat; }
         bool operator!=(const StaticTransform &t) const { return mat != t.mat; }
         
@@ -80,6 +83,7 @@ namespace SLR {
         Transform* createByMulLeft(const StaticTransform &staticTF, ArenaAllocator &mem) const override;
         Transform* createByMulRight(const StaticTransform &staticTF, ArenaAllocator &mem) const override;
         BoundingBox3D motionBounds(const BoundingBox3D &bb) const override { return *this * bb; }
+        BoundingBox3D motionBounds(const BoundingBox3D &bb, float timeBegin, float timeEnd) const override { return *this * bb; }
         
         
         friend StaticTransform invert(const StaticTransform &t) { return StaticTransform(t.matInv, t.mat); }
@@ -93,6 +97,29 @@ namespace SLR {
         Vector3D m_T[2];
         Quaternion m_R[2];
         Matrix4x4 m_S[2];
+        
+        // inverse of the upper-left 3x3 part by cofactors.
+        static Matrix4x4 invertLinearPart(const Matrix4x4 &m) {
+            Vector3D c0(m.m11 * m.m22 - m.m12 * m.m21, m.m12 * m.m20 - m.m10 * m.m22, m.m10 * m.m21 - m.m11 * m.m20);
+            Vector3D c1(m.m02 * m.m21 - m.m01 * m.m22, m.m00 * m.m22 - m.m02 * m.m20, m.m01 * m.m20 - m.m00 * m.m21);
+            Vector3D c2(m.m01 * m.m12 - m.m02 * m.m11, m.m02 * m.m10 - m.m00 * m.m12, m.m00 * m.m11 - m.m01 * m.m10);
+            float invDet = 1.0f / (m.m00 * c0.x + m.m01 * c0.y + m.m02 * c0.z);
+            return Matrix4x4(invDet * c0, invDet * c1, invDet * c2);
+        }
+        
+        // interpolates the decomposed components at a normalized time t in [0, 1].
+        void interpolate(float t, Vector3D* T, Quaternion* R, Matrix4x4* S) const {
+            *T = (1 - t) * m_T[0] + t * m_T[1];
+            *R = Slerp(t, m_R[0], m_R[1]);
+            *S = (1 - t) * m_S[0] + t * m_S[1];
+        }
+        
+        static BoundingBox3D transformBounds(const Matrix4x4 &m, const BoundingBox3D &bb) {
+            BoundingBox3D ret;
+            for (int i = 0; i < 8; ++i)
+                ret.unify(m * Point3D((i & 1) ? bb.maxP.x : bb.minP.x, (i & 2) ? bb.maxP.y : bb.minP.y, (i & 4) ? bb.maxP.z : bb.minP.z));
+            return ret;
+        }
     public:
         AnimatedTransform(const StaticTransform &tfBegin, const StaticTransform &tfEnd, float tBegin, float tEnd) :
         m_tfBegin(tfBegin), m_tfEnd(tfEnd), m_tBegin(tBegin), m_tEnd(tEnd) {
@@ -112,13 +139,14 @@ namespace SLR {
                 return;
             }
             float t = (time - m_tBegin) / (m_tEnd - m_tBegin);
-            Vector3D trans = (1 - t) * m_T[0] + t * m_T[1];
+            Vector3D trans;
+            Quaternion rotate;
+            Matrix4x4 scale;
+            interpolate(t, &trans, &rotate, &scale);
+            Matrix4x4 rotMat = rotate.toMatrix();
             
-            Quaternion rotate = Slerp(t, m_R[0], m_R[1]);
-            
-            Matrix4x4 scale = (1 - t) * m_S[0] + t * m_S[1];
-            
-            *tf = translate(trans) * rotate.toMatrix() * scale;
+            // The inverse is built from the components as S^-1 R^T T^-1 instead of inverting the product.
+            *tf = StaticTransform(translate(trans) * rotMat * scale, invertLinearPart(scale) * transpose(rotMat) * translate(-trans));
         }
         
         bool isChained() const override { return false; }
@@ -128,17 +156,52 @@ namespace SLR {
         Transform* createByMulLeft(const StaticTransform &staticTF, ArenaAllocator &mem) const override;
         Transform* createByMulRight(const StaticTransform &staticTF, ArenaAllocator &mem) const override;
         
-        // FIXME: This sampling-based way does not guarantee to generate the actual bounds.
         BoundingBox3D motionBounds(const BoundingBox3D &bb) const override {
+            return motionBounds(bb, m_tBegin, m_tEnd);
+        }
+        // Within the interval, T and S are linear in the same parameter and R moves along a single arc.
+        // So T + R S x is bounded by the hull of the boxes transformed with each combination of the end components,
+        // expanded by the largest deviation of the arc from its nearer end, 2 * sin(angle / 4) * |S x|.
+        BoundingBox3D motionBounds(const BoundingBox3D &bb, float timeBegin, float timeEnd) const override {
             BoundingBox3D ret;
-            const uint32_t numIte = 128;
-            for (uint32_t i = 0; i < numIte; ++i) {
-                float t = (float)i / (numIte - 1);
-                float sTime = (1 - t) * m_tBegin + t * m_tEnd;
-                StaticTransform staticTF;
-                sample(sTime, &staticTF);
-                ret.unify(staticTF * bb);
+            if (timeBegin <= m_tBegin)
+                ret.unify(m_tfBegin * bb);
+            if (timeEnd >= m_tEnd)
+                ret.unify(m_tfEnd * bb);
+            if (timeEnd <= m_tBegin || timeBegin >= m_tEnd || m_tEnd <= m_tBegin)
+                return ret;
+            
+            float ts[2] = {
+                std::max((timeBegin - m_tBegin) / (m_tEnd - m_tBegin), 0.0f),
+                std::min((timeEnd - m_tBegin) / (m_tEnd - m_tBegin), 1.0f)
+            };
+            Vector3D T[2];
+            Quaternion R[2];
+            Matrix4x4 S[2];
+            Matrix4x4 rotMats[2];
+            for (int i = 0; i < 2; ++i) {
+                interpolate(ts[i], &T[i], &R[i], &S[i]);
+                rotMats[i] = R[i].toMatrix();
+            }
+            
+            float maxLength = 0.0f;
+            for (int i = 0; i < 8; ++i) {
+                Vector3D corner((i & 1) ? bb.maxP.x : bb.minP.x, (i & 2) ? bb.maxP.y : bb.minP.y, (i & 4) ? bb.maxP.z : bb.minP.z);
+                maxLength = std::max(maxLength, std::max((S[0] * corner).length(), (S[1] * corner).length()));
+            }
+            
+            BoundingBox3D hull;
+            for (int r = 0; r < 2; ++r) {
+                hull.unify(transformBounds(translate(T[0]) * rotMats[r] * S[0], bb));
+                hull.unify(transformBounds(translate(T[1]) * rotMats[r] * S[1], bb));
             }
+            // half angle between the quaternions is the quarter of the rotation angle.
+            float halfAngle = 0.5f * std::acos(std::clamp(dot(R[0], R[1]), -1.0f, 1.0f));
+            float margin = 2 * std::sin(halfAngle) * maxLength;
+            hull.minP -= Vector3D(margin, margin, margin);
+            hull.maxP += Vector3D(margin, margin, margin);
+            
+            ret.unify(hull);
             return ret;
         }
     };
@@ -191,7 +254,7 @@ namespace SLR {
         }
         
         bool isChained() const override { return true; }
-
+        
         Transform* copy() const override;
         SLR::Transform* copy(SLR::ArenaAllocator &mem) const override;
         
@@ -210,6 +273,21 @@ namespace SLR {
             }
             return ret;
         }
+        BoundingBox3D motionBounds(const BoundingBox3D &bb, float timeBegin, float timeEnd) const override {
+            BoundingBox3D ret = bb;
+            const SLR::Transform* current = this;
+            while (current) {
+                const SLR::Transform* parent = nullptr;
+                if (current->isChained()) {
+                    parent = ((ChainedTransform*)current)->m_parent;
+                    current = ((ChainedTransform*)current)->m_transform;
+                }
+                ret = current->motionBounds(ret, timeBegin, timeEnd);
+                
+                current = parent;
+            }
+            return ret;
+        }
     };
 }
 
@@ -73,8 +73,59 @@ namespace SLR {
     
     
     
+    // builds the table from a normalized PMF with Vose's method.
     template <typename RealType>
-    RegularConstantDiscrete1DTemplate<RealType>::RegularConstantDiscrete1DTemplate(const std::vector<RealType> &values) {
+    static void buildAliasTable(const RealType* PMF, uint32_t numValues, RealType* probs, uint32_t* aliases) {
+        std::vector<uint32_t> smalls, larges;
+        smalls.reserve(numValues);
+        larges.reserve(numValues);
+        for (int i = 0; i < numValues; ++i) {
+            probs[i] = PMF[i] * numValues;
+            aliases[i] = i;
+            if (probs[i] < 1)
+                smalls.push_back(i);
+            else
+                larges.push_back(i);
+        }
+        while (!smalls.empty() && !larges.empty()) {
+            uint32_t sIdx = smalls.back();
+            smalls.pop_back();
+            uint32_t lIdx = larges.back();
+            aliases[sIdx] = lIdx;
+            probs[lIdx] -= 1 - probs[sIdx];
+            if (probs[lIdx] < 1) {
+                larges.pop_back();
+                smalls.push_back(lIdx);
+            }
+        }
+        // remaining entries are 1 up to rounding errors.
+        for (uint32_t idx : smalls)
+            probs[idx] = 1;
+        for (uint32_t idx : larges)
+            probs[idx] = 1;
+    }
+    
+    template <typename RealType>
+    static inline uint32_t sampleAliasTable(const RealType* probs, const uint32_t* aliases, uint32_t numValues, RealType u, RealType* remapped) {
+        RealType su = u * numValues;
+        uint32_t idx = std::min((uint32_t)su, numValues - 1);
+        RealType up = su - idx;
+        if (up < probs[idx]) {
+            *remapped = up / probs[idx];
+        }
+        else {
+            *remapped = (up - probs[idx]) / (1 - probs[idx]);
+            idx = aliases[idx];
+        }
+        *remapped = std::min(*remapped, std::nextafter((RealType)1, (RealType)0));
+        return idx;
+    }
+    
+    
+    
+    template <typename RealType>
+    RegularConstantDiscrete1DTemplate<RealType>::RegularConstantDiscrete1DTemplate(const std::vector<RealType> &values, bool useAliasTable) :
+    m_aliasProbs(nullptr), m_aliases(nullptr) {
         m_numValues = (uint32_t)values.size();
         m_PMF = new RealType[m_numValues];
         m_CDF = new RealType[m_numValues + 1];
@@ -91,11 +142,23 @@ namespace SLR {
             m_PMF[i] /= m_integral;
             m_CDF[i + 1] /= m_integral;
         }
+        
+        if (useAliasTable) {
+            m_aliasProbs = new RealType[m_numValues];
+            m_aliases = new uint32_t[m_numValues];
+            buildAliasTable(m_PMF, m_numValues, m_aliasProbs, m_aliases);
+        }
     };
     
     template <typename RealType>
     uint32_t RegularConstantDiscrete1DTemplate<RealType>::sample(RealType u, RealType* prob) const {
         SLRAssert(u >= 0 && u < 1, "\"u\" must be in range [0, 1).");
+        if (m_aliases) {
+            RealType remapped;
+            uint32_t idx = sampleAliasTable(m_aliasProbs, m_aliases, m_numValues, u, &remapped);
+            *prob = m_PMF[idx];
+            return idx;
+        }
         int idx = m_numValues;
         for (int d = prevPowerOf2(m_numValues); d > 0; d >>= 1)
             if (idx - d > 0 && m_CDF[idx - d] >= u)
@@ -108,6 +171,11 @@ namespace SLR {
     template <typename RealType>
     uint32_t RegularConstantDiscrete1DTemplate<RealType>::sample(RealType u, RealType* prob, RealType* remapped) const {
         SLRAssert(u >= 0 && u < 1, "\"u\" must be in range [0, 1).");
+        if (m_aliases) {
+            uint32_t idx = sampleAliasTable(m_aliasProbs, m_aliases, m_numValues, u, remapped);
+            *prob = m_PMF[idx];
+            return idx;
+        }
         int idx = m_numValues;
         for (int d = prevPowerOf2(m_numValues); d > 0; d >>= 1)
             if (idx - d > 0 && m_CDF[idx - d] >= u)
@@ -124,34 +192,27 @@ namespace SLR {
     
     
     template <typename RealType>
-    RegularConstantContinuous1DTemplate<RealType>::RegularConstantContinuous1DTemplate(uint32_t numValues, const std::function<RealType(uint32_t)> &pickFunc) :
+    RegularConstantContinuous1DTemplate<RealType>::RegularConstantContinuous1DTemplate(uint32_t numValues, const std::function<RealType(uint32_t)> &pickFunc, bool useAliasTable) :
     m_numValues(numValues) {
         m_PDF = new RealType[m_numValues];
-        m_CDF = new RealType[m_numValues + 1];
         for (int i = 0; i < numValues; ++i)
             m_PDF[i] = pickFunc(i);
-        
-        CompensatedSum<RealType> sum(0);
-        m_CDF[0] = 0;
-        for (int i = 0; i < m_numValues; ++i) {
-            sum += m_PDF[i] / m_numValues;
-            m_CDF[i + 1] = sum;
-        }
-        m_integral = sum;
-        for (int i = 0; i < m_numValues; ++i) {
-            m_PDF[i] /= sum;
-            m_CDF[i + 1] /= sum;
-        }
+        initialize(useAliasTable);
     };
     
     template <typename RealType>
-    RegularConstantContinuous1DTemplate<RealType>::RegularConstantContinuous1DTemplate(const std::vector<RealType> &values) :
+    RegularConstantContinuous1DTemplate<RealType>::RegularConstantContinuous1DTemplate(const std::vector<RealType> &values, bool useAliasTable) :
     m_numValues(values.size()) {
         m_PDF = new RealType[m_numValues];
-        m_CDF = new RealType[m_numValues + 1];
         std::memcpy(m_PDF, values.data(), sizeof(RealType) * m_numValues);
+        initialize(useAliasTable);
+    };
+    
+    template <typename RealType>
+    void RegularConstantContinuous1DTemplate<RealType>::initialize(bool useAliasTable) {
+        m_CDF = new RealType[m_numValues + 1];
         
-        CompensatedSum<RealType> sum{0};
+        CompensatedSum<RealType> sum(0);
         m_CDF[0] = 0;
         for (int i = 0; i < m_numValues; ++i) {
             sum += m_PDF[i] / m_numValues;
@@ -162,11 +223,28 @@ namespace SLR {
             m_PDF[i] /= sum;
             m_CDF[i + 1] /= sum;
         }
-    };
+        
+        m_aliasProbs = nullptr;
+        m_aliases = nullptr;
+        if (useAliasTable) {
+            m_aliasProbs = new RealType[m_numValues];
+            m_aliases = new uint32_t[m_numValues];
+            std::vector<RealType> PMF(m_numValues);
+            for (int i = 0; i < m_numValues; ++i)
+                PMF[i] = m_PDF[i] / m_numValues;
+            buildAliasTable(PMF.data(), m_numValues, m_aliasProbs, m_aliases);
+        }
+    }
     
     template <typename RealType>
     RealType RegularConstantContinuous1DTemplate<RealType>::sample(RealType u, RealType* PDF) const {
         SLRAssert(u < 1, "\"u\" must be in range [0, 1).");
+        if (m_aliases) {
+            RealType t;
+            uint32_t idx = sampleAliasTable(m_aliasProbs, m_aliases, m_numValues, u, &t);
+            *PDF = m_PDF[idx];
+            return (idx + t) / m_numValues;
+        }
         int idx = m_numValues;
         for (int d = prevPowerOf2(m_numValues); d > 0; d >>= 1)
             if (idx - d > 0 && m_CDF[idx - d] >= u)
@@ -189,18 +267,19 @@ namespace SLR {
     
     
     template <typename RealType>
-    RegularConstantContinuous2DTemplate<RealType>::RegularConstantContinuous2DTemplate(uint32_t numD1, uint32_t numD2, const std::function<RealType(uint32_t, uint32_t)> &pickFunc) :
+    RegularConstantContinuous2DTemplate<RealType>::RegularConstantContinuous2DTemplate(uint32_t numD1, uint32_t numD2, const std::function<RealType(uint32_t, uint32_t)> &pickFunc,
+                                                                                       bool useAliasTable) :
     m_num1DDists(numD2) {
         m_1DDists = (RegularConstantContinuous1DTemplate<RealType>*)malloc(sizeof(RegularConstantContinuous1DTemplate<RealType>) * numD2);
         CompensatedSum<RealType> sum(0);
         for (int i = 0; i < numD2; ++i) {
             auto pickFunc1D = std::bind(pickFunc, std::placeholders::_1, i);
-            new (m_1DDists + i) RegularConstantContinuous1DTemplate<RealType>(numD1, pickFunc1D);
+            new (m_1DDists + i) RegularConstantContinuous1DTemplate<RealType>(numD1, pickFunc1D, useAliasTable);
             sum += m_1DDists[i].integral();
         }
         m_integral = sum;
         auto pickFuncTop = [this](uint32_t idx) { return m_1DDists[idx].integral(); };
-        m_top1DDist = new RegularConstantContinuous1DTemplate<RealType>(numD2, pickFuncTop);
+        m_top1DDist = new RegularConstantContinuous1DTemplate<RealType>(numD2, pickFuncTop, useAliasTable);
         SLRAssert(!std::isnan(m_integral) && !std::isinf(m_integral), "invalid integral value.");
     };
     
@@ -259,4 +338,114 @@ namespace SLR {
     
     template class SLR_API RegularConstantContinuous2DTemplate<float>;
     template class SLR_API RegularConstantContinuous2DTemplate<double>;
+    
+    
+    
+    template <typename RealType>
+    static inline RealType remapSample(RealType u, RealType lowerMass, RealType upperMass, bool* upper) {
+        RealType scaledU = u * (lowerMass + upperMass);
+        *upper = scaledU >= lowerMass;
+        // written arithmetically rather than with branches since the choice is unpredictable.
+        RealType fUpper = *upper;
+        RealType remapped = (scaledU - fUpper * lowerMass) / (lowerMass + fUpper * (upperMass - lowerMass));
+        return std::min(remapped, 1 - std::numeric_limits<RealType>::epsilon() / 2);
+    }
+    
+    template <typename RealType>
+    HierarchicalConstantContinuous2DTemplate<RealType>::HierarchicalConstantContinuous2DTemplate(uint32_t numD1, uint32_t numD2, const std::function<RealType(uint32_t, uint32_t)> &pickFunc) {
+        SLRAssert(numD1 > 0 && numD2 > 0 && prevPowerOf2(numD1) == numD1 && prevPowerOf2(numD2) == numD2, "The resolutions must be powers of two.");
+        uint32_t numValues = 0;
+        uint32_t width = numD1;
+        uint32_t height = numD2;
+        while (true) {
+            m_levels.push_back(Level{numValues, width, height});
+            numValues += width * height;
+            if (width == 1 && height == 1)
+                break;
+            width = std::max(width / 2, 1u);
+            height = std::max(height / 2, 1u);
+        }
+        m_values = new RealType[numValues];
+        
+        for (int y = 0; y < numD2; ++y) {
+            for (int x = 0; x < numD1; ++x) {
+                RealType v = pickFunc(x, y);
+                SLRAssert(!std::isnan(v) && !std::isinf(v), "invalid value.");
+                m_values[numD1 * y + x] = std::max(v, (RealType)0);
+            }
+        }
+        buildUpperLevels();
+        
+        // fall back to the uniform distribution if the function is zero everywhere.
+        if (m_values[m_levels.back().offset] == 0) {
+            std::fill_n(m_values, numD1 * numD2, (RealType)1);
+            buildUpperLevels();
+        }
+        m_integral = m_values[m_levels.back().offset] / (numD1 * numD2);
+        SLRAssert(!std::isnan(m_integral) && !std::isinf(m_integral), "invalid integral value.");
+    };
+    
+    template <typename RealType>
+    void HierarchicalConstantContinuous2DTemplate<RealType>::buildUpperLevels() {
+        for (int l = 1; l < m_levels.size(); ++l) {
+            const Level &fine = m_levels[l - 1];
+            const Level &coarse = m_levels[l];
+            uint32_t stepX = fine.width / coarse.width;
+            uint32_t stepY = fine.height / coarse.height;
+            for (int y = 0; y < coarse.height; ++y) {
+                for (int x = 0; x < coarse.width; ++x) {
+                    RealType sum = 0;
+                    for (int cy = 0; cy < stepY; ++cy)
+                        for (int cx = 0; cx < stepX; ++cx)
+                            sum += value(fine, stepX * x + cx, stepY * y + cy);
+                    m_values[coarse.offset + coarse.width * y + x] = sum;
+                }
+            }
+        }
+    }
+    
+    template <typename RealType>
+    void HierarchicalConstantContinuous2DTemplate<RealType>::sample(RealType u0, RealType u1, RealType* d0, RealType* d1, RealType* PDF) const {
+        SLRAssert(u0 >= 0 && u0 < 1, "\"u0\" must be in range [0, 1).");
+        SLRAssert(u1 >= 0 && u1 < 1, "\"u1\" must be in range [0, 1).");
+        uint32_t x = 0;
+        uint32_t y = 0;
+        for (int l = (int)m_levels.size() - 2; l >= 0; --l) {
+            const Level &fine = m_levels[l];
+            const Level &coarse = m_levels[l + 1];
+            bool splitX = fine.width > coarse.width;
+            bool splitY = fine.height > coarse.height;
+            x = splitX ? 2 * x : x;
+            y = splitY ? 2 * y : y;
+            bool upper;
+            if (splitX) {
+                RealType left = value(fine, x, y) + (splitY ? value(fine, x, y + 1) : 0);
+                RealType right = value(fine, x + 1, y) + (splitY ? value(fine, x + 1, y + 1) : 0);
+                u0 = remapSample(u0, left, right, &upper);
+                x += upper;
+            }
+            if (splitY) {
+                u1 = remapSample(u1, value(fine, x, y), value(fine, x, y + 1), &upper);
+                y += upper;
+            }
+        }
+        const Level &finest = m_levels[0];
+        // keep the sample in the selected texel against rounding.
+        *d0 = std::min((x + u0) / finest.width, (x + 1) / (RealType)finest.width * (1 - std::numeric_limits<RealType>::epsilon() / 2));
+        *d1 = std::min((y + u1) / finest.height, (y + 1) / (RealType)finest.height * (1 - std::numeric_limits<RealType>::epsilon() / 2));
+        *PDF = value(finest, x, y) / m_integral;
+    };
+    
+    template <typename RealType>
+    RealType HierarchicalConstantContinuous2DTemplate<RealType>::evaluatePDF(RealType d0, RealType d1) const {
+        SLRAssert(d0 >= 0 && d0 < 1.0, "\"d0\" is out of range [0, 1)");
+        SLRAssert(d1 >= 0 && d1 < 1.0, "\"d1\" is out of range [0, 1)");
+        const Level &finest = m_levels[0];
+        uint32_t x = std::min(uint32_t(finest.width * d0), finest.width - 1);
+        uint32_t y = std::min(uint32_t(finest.height * d1), finest.height - 1);
+        return value(finest, x, y) / m_integral;
+    };
+    
+    template class SLR_API HierarchicalConstantContinuous2DTemplate<float>;
+    template class SLR_API HierarchicalConstantContinuous2DTemplate<double>;
 }
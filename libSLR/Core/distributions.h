@@ -65,15 +65,23 @@ namespace SLR {
     
     
     
+    // The distributions below optionally build an alias table (Vose's method) in addition to the CDF,
+    // then sampling takes constant time instead of a binary search.
+    // The alias method doesn't preserve the order of the input sample, so stratification of "u" is not carried to the output.
+    
     template <typename RealType>
     class SLR_API RegularConstantDiscrete1DTemplate {
         RealType* m_PMF;
         RealType* m_CDF;
+        RealType* m_aliasProbs;
+        uint32_t* m_aliases;
         RealType m_integral;
         uint32_t m_numValues;
     public:
-        RegularConstantDiscrete1DTemplate(const std::vector<RealType> &values);
+        RegularConstantDiscrete1DTemplate(const std::vector<RealType> &values, bool useAliasTable = false);
         ~RegularConstantDiscrete1DTemplate() {
+            delete[] m_aliases;
+            delete[] m_aliasProbs;
             delete[] m_PMF;
             delete[] m_CDF;
         };
@@ -94,12 +102,18 @@ namespace SLR {
     class SLR_API RegularConstantContinuous1DTemplate {
         RealType* m_PDF;
         RealType* m_CDF;
+        RealType* m_aliasProbs;
+        uint32_t* m_aliases;
         RealType m_integral;
         uint32_t m_numValues;
+        
+        void initialize(bool useAliasTable);
     public:
-        RegularConstantContinuous1DTemplate(uint32_t numValues, const std::function<RealType(uint32_t)> &pickFunc);
-        RegularConstantContinuous1DTemplate(const std::vector<RealType> &values);
+        RegularConstantContinuous1DTemplate(uint32_t numValues, const std::function<RealType(uint32_t)> &pickFunc, bool useAliasTable = false);
+        RegularConstantContinuous1DTemplate(const std::vector<RealType> &values, bool useAliasTable = false);
         ~RegularConstantContinuous1DTemplate() {
+            delete[] m_aliases;
+            delete[] m_aliasProbs;
             delete[] m_PDF;
             delete[] m_CDF;
         };
@@ -114,23 +128,69 @@ namespace SLR {
     
     
     template <typename RealType>
-    class SLR_API RegularConstantContinuous2DTemplate {
+    class SLR_API Continuous2DDistributionTemplate {
+    public:
+        virtual ~Continuous2DDistributionTemplate() { };
+        
+        virtual void sample(RealType u0, RealType u1, RealType* d0, RealType* d1, RealType* PDF) const = 0;
+        virtual RealType evaluatePDF(RealType d0, RealType d1) const = 0;
+    };
+    
+    
+    
+    template <typename RealType>
+    class SLR_API RegularConstantContinuous2DTemplate : public Continuous2DDistributionTemplate<RealType> {
         RegularConstantContinuous1DTemplate<RealType>* m_1DDists;
         uint32_t m_num1DDists;
         RealType m_integral;
         RegularConstantContinuous1DTemplate<RealType>* m_top1DDist;
     public:
-        RegularConstantContinuous2DTemplate(uint32_t numD1, uint32_t numD2, const std::function<RealType(uint32_t, uint32_t)> &pickFunc);;
+        RegularConstantContinuous2DTemplate(uint32_t numD1, uint32_t numD2, const std::function<RealType(uint32_t, uint32_t)> &pickFunc, bool useAliasTable = false);
         ~RegularConstantContinuous2DTemplate() {
+            for (int i = 0; i < m_num1DDists; ++i)
+                m_1DDists[i].~RegularConstantContinuous1DTemplate<RealType>();
             free(m_1DDists);
             delete m_top1DDist;
         };
         
-        void sample(RealType u0, RealType u1, RealType* d0, RealType* d1, RealType* PDF) const;
-        RealType evaluatePDF(RealType d0, RealType d1) const;
+        void sample(RealType u0, RealType u1, RealType* d0, RealType* d1, RealType* PDF) const override;
+        RealType evaluatePDF(RealType d0, RealType d1) const override;
         RealType integral() const { return m_integral; };
         void exportBMP(const std::string &filename, float gamma = 1.0f) const;
-    };    
+    };
+    
+    
+    
+    // MIP-style pyramid of a piecewise constant 2D function, each texel of a level holds the sum of the corresponding texels of the finer level.
+    // Sampling descends from the top texel choosing one of the children with remapped "u0" and "u1",
+    // so neither per-row CDFs nor a binary search are needed, and the PDF is evaluated by a single lookup at the finest level.
+    // The resolutions must be powers of two.
+    template <typename RealType>
+    class SLR_API HierarchicalConstantContinuous2DTemplate : public Continuous2DDistributionTemplate<RealType> {
+        struct Level {
+            uint32_t offset;
+            uint32_t width;
+            uint32_t height;
+        };
+        RealType* m_values;
+        std::vector<Level> m_levels;
+        RealType m_integral;
+        
+        RealType value(const Level &level, uint32_t x, uint32_t y) const {
+            return m_values[level.offset + level.width * y + x];
+        };
+        void buildUpperLevels();
+    public:
+        HierarchicalConstantContinuous2DTemplate(uint32_t numD1, uint32_t numD2, const std::function<RealType(uint32_t, uint32_t)> &pickFunc);
+        ~HierarchicalConstantContinuous2DTemplate() {
+            delete[] m_values;
+        };
+        
+        void sample(RealType u0, RealType u1, RealType* d0, RealType* d1, RealType* PDF) const override;
+        RealType evaluatePDF(RealType d0, RealType d1) const override;
+        RealType integral() const { return m_integral; };
+        uint32_t numLevels() const { return (uint32_t)m_levels.size(); };
+    };
 }
 
 #endif
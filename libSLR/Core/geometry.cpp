@@ -14,6 +14,10 @@
 namespace SLR {
     const float Ray::Epsilon = 0.0001f;
     
+    Point3D Surface::getIntersectionPoint(const Intersection &isect) const {
+        return isect.p;
+    }
+    
     Point3D Intersection::getIntersectionPoint() const {
         return obj.top()->getIntersectionPoint(*this);
     }
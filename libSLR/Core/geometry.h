@@ -19,6 +19,7 @@
 #include "../BasicTypes/TexCoord2.h"
 #include "../BasicTypes/RGBTypes.h"
 #include "../BasicTypes/SpectrumTypes.h"
+#include "../BasicTypes/FixedStack.h"
 
 namespace SLR {
     struct SLR_API Ray {
@@ -194,6 +195,12 @@ namespace SLR {
         }
         virtual bool preTransformed() const = 0;
         virtual bool intersect(const Ray &ray, Intersection* isect) const = 0;
+        virtual bool occluded(const Ray &ray) const = 0;
+        virtual bool getEmbeddableTriangle(Point3D* p0, Point3D* p1, Point3D* p2) const { return false; }
+        virtual void fillEmbeddedTriangleIntersection(const Ray &ray, float dist, float b1, float b2, Intersection* isect) const { SLRAssert_NotImplemented(); }
+        virtual Point3D getIntersectionPoint(const Intersection &isect) const;
+        // cone bounding the shading normals over the surface, the whole sphere by default.
+        virtual void normalBounds(Vector3D* axis, float* cosTheta) const { *axis = Vector3D::Ez; *cosTheta = -1.0f; }
         virtual void getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const = 0;
         virtual float area() const = 0;
         virtual void sample(float u0, float u1, SurfacePoint* surfPt, float* areaPDF) const = 0;
@@ -202,6 +209,13 @@ namespace SLR {
     
     
     
+    // The hierarchy of objects (the leaf object at the bottom and the outermost instance on top) of a hit or a light.
+    // A closer hit found by an accelerator is pushed above the objects of the previous one, and the accelerator erases the latter right after,
+    // so each instancing level holds at most one stale hit during traversal.
+    // Scene building rejects deeper instancing (see SurfaceObject::instancingDepth()).
+    const uint32_t MaxInstancingDepth = 6;
+    typedef FixedStack<const SurfaceObject*, MaxInstancingDepth * (MaxInstancingDepth + 1) / 2> SurfaceObjectStack;
+    
     // It is not safe to directly use the point and normal because they need to be applied several transforms.
     struct SLR_API Intersection {
         float time;
@@ -210,7 +224,7 @@ namespace SLR {
         Normal3D gNormal;
         float u, v;
         TexCoord2D texCoord;
-        mutable std::stack<const SurfaceObject*> obj;
+        mutable SurfaceObjectStack obj;
         //    const SurfaceObject* obj;
         
         Intersection() : dist(INFINITY) { }
@@ -244,7 +258,7 @@ namespace SLR {
         TexCoord2D texCoord;
         Vector3D texCoord0Dir;
         ReferenceFrame shadingFrame;
-        const SingleSurfaceObject* obj;
+        const SurfaceObject* obj;
         
         float getSquaredDistance(const Point3D &shadingPoint) const { return atInfinity ? 1.0f : sqDistance(p, shadingPoint); }
         Vector3D getDirectionFrom(const Point3D &shadingPoint, float* dist2) const;
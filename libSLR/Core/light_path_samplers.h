@@ -47,6 +47,9 @@ namespace SLR {
         IndependentLightPathSampler() { }
         IndependentLightPathSampler(uint32_t seed) : m_rng(seed) { }
         
+        XORShiftRNG &getRNG() { return m_rng; }
+        const XORShiftRNG &getRNG() const { return m_rng; }
+        
         float getTimeSample(float timeBegin, float timeEnd) override { float v = m_rng.getFloat0cTo1o(); return timeBegin * (1 - v) + timeEnd * v; }
         PixelPosition getPixelPositionSample(uint32_t baseX, uint32_t baseY) override { return PixelPosition(baseX + m_rng.getFloat0cTo1o(), baseY + m_rng.getFloat0cTo1o()); }
         float getWavelengthSample() override { return m_rng.getFloat0cTo1o(); }
@@ -56,7 +56,7 @@ namespace SLR {
         virtual ~SpectrumTexture() { }
         
         virtual SampledSpectrum evaluate(const SurfacePoint &surfPt, const WavelengthSamples &wls) const = 0;
-        virtual RegularConstantContinuous2D* createIBLImportanceMap() const = 0;
+        virtual Continuous2DDistribution* createIBLImportanceMap() const = 0;
     };
     
     class SLR_API Normal3DTexture {
@@ -0,0 +1,55 @@
+//
+//  ThreadPool.cpp
+//
+//  Created by 渡部 心 on 2016/07/18.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#include "ThreadPool.h"
+
+// pool and index of the worker running on the calling thread, set when the worker starts.
+static thread_local const ThreadPool* s_workerPool = nullptr;
+static thread_local int32_t s_workerIndex = -1;
+
+void ThreadPool::workerLoop(uint32_t threadID) {
+    s_workerPool = this;
+    s_workerIndex = threadID;
+    
+    JobFunctionObject task;
+    while (true) {
+        if (!claimTask()) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            ++m_numSleeping;
+            while (!m_finishable && m_numQueued.load() == 0)
+                m_taskCondVar.wait(lock);
+            --m_numSleeping;
+            if (m_numQueued.load() == 0)
+                return;
+            continue;
+        }
+        
+        // a claimed task is guaranteed to exist in one of the deques.
+        while (!popTask(threadID, &task))
+            std::this_thread::yield();
+        task(threadID);
+        task = nullptr;
+        
+        if (--m_numPending == 0) {
+            { std::lock_guard<std::mutex> lock(m_mutex); }
+            m_doneCondVar.notify_all();
+        }
+    }
+}
+
+int32_t ThreadPool::workerIndex() const {
+    return s_workerPool == this ? s_workerIndex : -1;
+}
+
+ThreadPool &ThreadPool::sharedPool() {
+#ifdef DEBUG
+    static ThreadPool pool(1);
+#else
+    static ThreadPool pool(std::thread::hardware_concurrency());
+#endif
+    return pool;
+}
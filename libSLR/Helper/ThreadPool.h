@@ -13,75 +13,119 @@
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <atomic>
 
-class ThreadPool {
+// Persistent thread pool with per-worker deques.
+// A worker pops tasks from the back of its own deque and steals from the front of the others' when it runs out.
+// wait() blocks until all enqueued tasks complete, so the pool can be reused across passes.
+class SLR_API ThreadPool {
     typedef std::function<void(uint32_t threadID)> JobFunctionObject;
     
-    class Worker {
-        uint32_t m_threadID;
-        ThreadPool& m_pool;
-    public:
-        Worker(uint32_t threadID, ThreadPool &pool) : m_threadID(threadID), m_pool(pool) { };
-        
-        void job() {
-            JobFunctionObject task;
-            while (true) {
-                {
-                    std::unique_lock<std::mutex> lock(m_pool.m_mutex);
-                    while (!m_pool.m_finishable && m_pool.m_taskQueue.empty())
-                        m_pool.m_condVar.wait(lock);
-                    
-                    if (m_pool.m_finishable && m_pool.m_taskQueue.empty())
-                        return;
-                    
-                    task = m_pool.m_taskQueue.front();
-                    m_pool.m_taskQueue.pop_front();
-                }
-                
-                task(m_threadID);
-            }
-        }
+    struct WorkQueue {
+        std::deque<JobFunctionObject> tasks;
+        std::mutex mutex;
     };
     
-    friend class Worker;
     std::vector<std::thread> m_workers;
-    std::deque<JobFunctionObject> m_taskQueue;
+    std::unique_ptr<WorkQueue[]> m_queues;
+    std::atomic<uint32_t> m_nextQueue;
+    
+    // The counters are atomic, m_mutex is taken only to sleep on or to wake the condition variables.
     std::mutex m_mutex;
-    std::condition_variable m_condVar;
+    std::condition_variable m_taskCondVar;
+    std::condition_variable m_doneCondVar;
+    std::atomic<int64_t> m_numQueued;
+    std::atomic<int64_t> m_numPending;
+    std::atomic<uint32_t> m_numSleeping;
     bool m_finishable;
-public:
-    ThreadPool(uint32_t numThreads = std::thread::hardware_concurrency()) : m_finishable(false) {
-        for (int i = 0; i < numThreads; ++i) {
-            m_workers.push_back(std::thread(std::bind(&Worker::job, Worker(i, *this))));
+    
+    bool popTask(uint32_t threadID, JobFunctionObject* task) {
+        {
+            WorkQueue &queue = m_queues[threadID];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                *task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                return true;
+            }
         }
+        const uint32_t numWorkers = (uint32_t)m_workers.size();
+        for (uint32_t i = 1; i < numWorkers; ++i) {
+            WorkQueue &victim = m_queues[(threadID + i) % numWorkers];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                *task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    bool claimTask() {
+        int64_t numQueued = m_numQueued.load();
+        while (numQueued > 0) {
+            if (m_numQueued.compare_exchange_weak(numQueued, numQueued - 1))
+                return true;
+        }
+        return false;
+    }
+    
+    void workerLoop(uint32_t threadID);
+    
+    // index of the calling thread in the pool, or -1 if it is not a worker of this pool.
+    int32_t workerIndex() const;
+
+public:
+    ThreadPool(uint32_t numThreads = std::thread::hardware_concurrency()) :
+    m_nextQueue(0), m_numQueued(0), m_numPending(0), m_numSleeping(0), m_finishable(false) {
+        numThreads = std::max(numThreads, 1u);
+        m_queues = std::unique_ptr<WorkQueue[]>(new WorkQueue[numThreads]);
+        for (uint32_t i = 0; i < numThreads; ++i)
+            m_workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
     };
     ~ThreadPool() {
-        m_finishable = true;
-        m_condVar.notify_all();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_finishable = true;
+        }
+        m_taskCondVar.notify_all();
         for (int i = 0; i < m_workers.size(); ++i)
             if (m_workers[i].joinable())
                 m_workers[i].join();
     };
     
+    // A task enqueued from a worker goes to that worker's own deque, others are distributed round-robin.
     void enqueue(const JobFunctionObject &task) {
+        int32_t self = workerIndex();
+        uint32_t queueIdx = self >= 0 ? self : m_nextQueue++ % m_workers.size();
+        // a task must be pending before it can be claimed so that the pending count never drops to zero early.
+        ++m_numPending;
         {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            m_taskQueue.push_back(task);
+            WorkQueue &queue = m_queues[queueIdx];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(task);
+        }
+        ++m_numQueued;
+        // taking the mutex orders this against a worker between checking the count and sleeping.
+        if (m_numSleeping.load() > 0) {
+            { std::lock_guard<std::mutex> lock(m_mutex); }
+            m_taskCondVar.notify_one();
         }
-        m_condVar.notify_all();
     };
     
+    // blocks until all tasks enqueued so far complete. This must not be called from a task.
     void wait() {
-        {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            m_finishable = true;
-        }
-        m_condVar.notify_all();
-        for (int i = 0; i < m_workers.size(); ++i)
-            m_workers[i].join();
+        SLRAssert(workerIndex() < 0, "ThreadPool::wait() must not be called from a worker thread.");
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_numPending.load() > 0)
+            m_doneCondVar.wait(lock);
     };
     
     uint32_t numThreads() const { return (uint32_t)m_workers.size(); };
+    
+    // pool shared by the renderers and the acceleration structure builders.
+    static ThreadPool &sharedPool();
 };
 
 #endif
@@ -27,6 +27,15 @@ namespace SLR {
         };
         
         typename TypeSet::UInt getUInt() override;
+        
+        void getState(typename TypeSet::UInt state[4]) const {
+            for (int i = 0; i < 4; ++i)
+                state[i] = m_state[i];
+        };
+        void setState(const typename TypeSet::UInt state[4]) {
+            for (int i = 0; i < 4; ++i)
+                m_state[i] = state[i];
+        };
     };
     
     template <> XORShiftRNGTemplate<Types32bit>::XORShiftRNGTemplate();
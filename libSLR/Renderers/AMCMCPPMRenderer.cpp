@@ -283,11 +283,8 @@ namespace SLR {
     };
     
     void AMCMCPPMRenderer::render(const Scene &scene, const RenderSettings &settings) const {                
-#ifdef DEBUG
-        uint32_t numThreads = 1;
-#else
-        uint32_t numThreads = std::thread::hardware_concurrency();
-#endif
+        ThreadPool &threadPool = ThreadPool::sharedPool();
+        uint32_t numThreads = threadPool.numThreads();
         XORShiftRNG topRand(settings.getInt(RenderSettingItem::RNGSeed));
         auto mems = std::unique_ptr<ArenaAllocator[]>(new ArenaAllocator[numThreads]);
         auto memPTs = std::unique_ptr<ArenaAllocator[]>(new ArenaAllocator[numThreads]);
@@ -368,27 +365,25 @@ namespace SLR {
             hitpointMap.initialize(numThreads, jobDRT.imageWidth * jobDRT.imageHeight);
             
             // Distributed Ray Tracing Pass: record hitpoints in a k-d tree.
-            ThreadPool DRTPool(numThreads);
             for (int ty = 0; ty < sensor->numTileY(); ++ty) {
                 for (int tx = 0; tx < sensor->numTileX(); ++tx) {
                     jobDRT.basePixelX = tx * sensor->tileWidth();
                     jobDRT.basePixelY = ty * sensor->tileHeight();
-                    DRTPool.enqueue(std::bind(&DistributedRTJob::kernel, jobDRT, std::placeholders::_1));
+                    threadPool.enqueue(std::bind(&DistributedRTJob::kernel, jobDRT, std::placeholders::_1));
                 }
             }
-            DRTPool.wait();
+            threadPool.wait();
             
             // Build a balanced k-d tree.
             hitpointMap.build();
             
             // Photon Tracing Pass: splatting photon's contribution to hitpoints near the photon.
-            ThreadPool PTPool(numThreads);
             for (int i = 0; i < numMCMCs; ++i) {
                 jobPSs[i].time = time;
                 jobPSs[i].radius = radius;
-                PTPool.enqueue(std::bind(&PhotonSplattingJob::kernel, std::ref(jobPSs[i]), std::placeholders::_1));
+                threadPool.enqueue(std::bind(&PhotonSplattingJob::kernel, std::ref(jobPSs[i]), std::placeholders::_1));
             }
-            PTPool.wait();
+            threadPool.wait();
             
             for (int i = 0; i < numThreads; ++i)
                 mems[i].reset();
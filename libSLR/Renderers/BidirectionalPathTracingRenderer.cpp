@@ -8,6 +8,8 @@
 #include "BidirectionalPathTracingRenderer.h"
 
 #include "../Core/RenderSettings.h"
+#include "../Core/TileScheduler.h"
+#include "../Core/RenderCheckpoint.h"
 #include "../Helper/ThreadPool.h"
 #include "../RNGs/XORShiftRNG.h"
 #include "../Memory/ArenaAllocator.h"
@@ -23,11 +25,8 @@ namespace SLR {
     }
     
     void BidirectionalPathTracingRenderer::render(const Scene &scene, const RenderSettings &settings) const {
-#ifdef DEBUG
-        uint32_t numThreads = 1;
-#else
-        uint32_t numThreads = std::thread::hardware_concurrency();
-#endif
+        ThreadPool &threadPool = ThreadPool::sharedPool();
+        uint32_t numThreads = threadPool.numThreads();
         XORShiftRNG topRand(settings.getInt(RenderSettingItem::RNGSeed));
         std::unique_ptr<ArenaAllocator[]> mems = std::unique_ptr<ArenaAllocator[]>(new ArenaAllocator[numThreads]);
         std::unique_ptr<IndependentLightPathSampler[]> samplers = std::unique_ptr<IndependentLightPathSampler[]>(new IndependentLightPathSampler[numThreads]);
@@ -39,6 +38,14 @@ namespace SLR {
         for (int i = 0; i < numThreads; ++i)
             samplerRefs[i] = &samplers[i];
         
+        // subpaths rarely get longer than this, longer ones grow the buffers once and keep them.
+        const uint32_t InitialSubpathCapacity = 32;
+        std::unique_ptr<WorkingArea[]> workingAreas = std::unique_ptr<WorkingArea[]>(new WorkingArea[numThreads]);
+        for (int i = 0; i < numThreads; ++i) {
+            workingAreas[i].lightVertices.reserve(InitialSubpathCapacity);
+            workingAreas[i].eyeVertices.reserve(InitialSubpathCapacity);
+        }
+        
         const Camera* camera = scene.getCamera();
         ImageSensor* sensor = camera->getSensor();
         
@@ -47,6 +54,7 @@ namespace SLR {
         
         job.mems = mems.get();
         job.pathSamplers = samplerRefs.get();
+        job.workingAreas = workingAreas.get();
         
         job.camera = camera;
         job.timeStart = settings.getFloat(RenderSettingItem::TimeStart);
@@ -63,42 +71,76 @@ namespace SLR {
         uint32_t endIdx = 16;
         
         sensor->init(job.imageWidth, job.imageHeight);
-        sensor->addSeparatedBuffers(numThreads);
+        sensor->enableSplatBuffer();
         
         std::chrono::system_clock::time_point start, end;
         start = std::chrono::system_clock::now();
         
-        for (int s = 0; s < m_samplesPerPixel; ++s) {
-            ThreadPool threadPool(numThreads);
-            for (int ty = 0; ty < sensor->numTileY(); ++ty) {
-                for (int tx = 0; tx < sensor->numTileX(); ++tx) {
-                    job.basePixelX = tx * sensor->tileWidth();
-                    job.basePixelY = ty * sensor->tileHeight();
-                    threadPool.enqueue(std::bind(&Job::kernel, job, std::placeholders::_1));
-                }
+        // tiles run several samples each without synchronization until the next export point.
+        TileScheduler scheduler(sensor->numTileX(), sensor->numTileY());
+        auto renderTile = [&job, sensor](uint32_t threadID, uint32_t tx, uint32_t ty) {
+            job.kernel(threadID, tx * sensor->tileWidth(), ty * sensor->tileHeight());
+        };
+        
+        // Passes are kept short while checkpointing so that a checkpoint can be taken often enough.
+        const uint32_t MaxSamplesPerCheckedPass = 16;
+        RenderCheckpoint checkpoint(settings.getString(RenderSettingItem::CheckpointPath));
+        double checkpointInterval = settings.getFloat(RenderSettingItem::CheckpointInterval);
+        
+        uint32_t s = 0;
+        double lastCheckpoint = 0.0;
+        if (settings.getBool(RenderSettingItem::Resume)) {
+            RenderCheckpoint::Progress progress;
+            if (checkpoint.read(sensor, &progress, samplers.get(), numThreads)) {
+                s = progress.numSamples;
+                exportPass = progress.exportPass;
+                imgIdx = progress.imageIndex;
+                start -= std::chrono::milliseconds((int64_t)(progress.elapsed * 1000));
+                lastCheckpoint = progress.elapsed;
+                printf("resumed from %u samples, %g[s].\n", s, progress.elapsed);
+            }
+            else {
+                printf("no valid checkpoint to resume from, starting from the beginning.\n");
             }
-            threadPool.wait();
+        }
+        
+        while (s < m_samplesPerPixel && imgIdx < endIdx) {
+            uint32_t numSamples = std::min(exportPass, m_samplesPerPixel) - s;
+            if (checkpoint.enabled())
+                numSamples = std::min(numSamples, MaxSamplesPerCheckedPass);
+            scheduler.render(threadPool, numSamples, renderTile);
+            s += numSamples;
+            
+            end = std::chrono::system_clock::now();
+            double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() * 0.001;
             
-            if ((s + 1) == exportPass) {
+            if (s == exportPass) {
                 char filename[256];
                 sprintf(filename, "%03u.bmp", imgIdx);
-                end = std::chrono::system_clock::now();
-                double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-                sensor->saveImage(filename, settings.getFloat(RenderSettingItem::Brightness) / (s + 1));
-                printf("%u samples: %s, %g[s]\n", exportPass, filename, elapsed * 0.001f);
+                sensor->saveImageAsync(filename, settings.getFloat(RenderSettingItem::Brightness) / s);
+                printf("%u samples: %s, %g[s]\n", exportPass, filename, elapsed);
                 ++imgIdx;
-                if (imgIdx == endIdx)
-                    break;
                 exportPass += exportPass;
             }
+            
+            if (checkpoint.enabled() && s < m_samplesPerPixel && elapsed - lastCheckpoint >= checkpointInterval) {
+                RenderCheckpoint::Progress progress = {s, exportPass, imgIdx, elapsed};
+                if (checkpoint.write(*sensor, progress, samplers.get(), numThreads))
+                    lastCheckpoint = elapsed;
+            }
         }
         
+        sensor->waitForExport();
+        
         //    sensor.saveImage("output.png", settings.getFloat(RenderSettingItem::SensorResponse) / numSamples);
     }
     
-    void BidirectionalPathTracingRenderer::Job::kernel(uint32_t threadID) {
+    void BidirectionalPathTracingRenderer::Job::kernel(uint32_t threadID, uint32_t basePixelX, uint32_t basePixelY) const {
         ArenaAllocator &mem = mems[threadID];
         IndependentLightPathSampler &pathSampler = *pathSamplers[threadID];
+        WorkingArea &wa = workingAreas[threadID];
+        std::vector<BPTVertex> &lightVertices = wa.lightVertices;
+        std::vector<BPTVertex> &eyeVertices = wa.eyeVertices;
         for (int ly = 0; ly < numPixelY; ++ly) {
             for (int lx = 0; lx < numPixelX; ++lx) {
                 float time = pathSampler.getTimeSample(timeStart, timeEnd);
@@ -108,9 +150,10 @@ namespace SLR {
                 WavelengthSamples wls = WavelengthSamples::createWithEqualOffsets(pathSampler.getWavelengthSample(), pathSampler.getWLSelectionSample(), &selectWLPDF);
                 
                 // initialize working area for the current pixel.
-                curPx = p.x;
-                curPy = p.y;
-                wlHint = wls.selectedLambda;
+                wa.curPx = p.x;
+                wa.curPy = p.y;
+                wa.wlHint = wls.selectedLambda;
+                int16_t wlHint = wa.wlHint;
                 eyeVertices.clear();
                 lightVertices.clear();
                 
@@ -134,12 +177,12 @@ namespace SLR {
                     
                     // register the first light vertex.
                     float lightAreaPDF = lightProb * lightPosResult.areaPDF;
-                    lightVertices.emplace_back(lightPosResult.surfPt, Vector3D::Zero, Normal3D(0, 0, 1), mem.create<EDFProxy>(edf),
+                    lightVertices.emplace_back(lightPosResult.surfPt, Vector3D::Zero, Normal3D(0, 0, 1), edf, DDFType::EDF,
                                                Le0 / lightAreaPDF, lightAreaPDF, 1.0f, lightPosResult.posType, WavelengthSamples::Flag(0));
                     
                     // create subsequent light subpath vertices by tracing in the scene.
                     SampledSpectrum alpha = lightVertices.back().alpha * Le1 * (absDot(ray.dir, lightPosResult.surfPt.gNormal) / edfResult.dirPDF);
-                    generateSubPath(wls, alpha, ray, edfResult.dirPDF, edfResult.dirType, edfResult.dir_sn.z, true, pathSampler, mem);
+                    generateSubPath(wa, wls, alpha, ray, edfResult.dirPDF, edfResult.dirType, edfResult.dir_sn.z, true, pathSampler, mem);
                 }
                 
                 // eye subpath generation
@@ -154,12 +197,12 @@ namespace SLR {
                     Ray ray = camera->sampleRay(lensQuery, pathSampler.getLensPosSample(), &lensResult, &We0, &idf, WeSample, &WeResult, &We1, mem);
                     
                     // register the first eye vertex.
-                    eyeVertices.emplace_back(lensResult.surfPt, Vector3D::Zero, Normal3D(0, 0, 1), mem.create<IDFProxy>(idf),
+                    eyeVertices.emplace_back(lensResult.surfPt, Vector3D::Zero, Normal3D(0, 0, 1), idf, DDFType::IDF,
                                              We0 / (lensResult.areaPDF * selectWLPDF), lensResult.areaPDF, 1.0f, lensResult.posType, WavelengthSamples::Flag(0));
                     
                     // create subsequent eye subpath vertices by tracing in the scene.
                     SampledSpectrum alpha = eyeVertices.back().alpha * We1 * (absDot(ray.dir, lensResult.surfPt.gNormal) / WeResult.dirPDF);
-                    generateSubPath(wls, alpha, ray, WeResult.dirPDF, WeResult.dirType, WeResult.dirLocal.z, false, pathSampler, mem);
+                    generateSubPath(wa, wls, alpha, ray, WeResult.dirPDF, WeResult.dirType, WeResult.dirLocal.z, false, pathSampler, mem);
                 }
                 
                 // connection
@@ -180,16 +223,16 @@ namespace SLR {
                         Vector3D lConnectVector = lVtx.surfPt.shadingFrame.toLocal(-connectionVector);
                         DDFQuery queryLightEnd{lVtx.dirIn_sn, lVtx.gNormal_sn, wlHint, true};
                         SampledSpectrum lRevDDF;
-                        SampledSpectrum lDDF = lVtx.ddf->evaluate(queryLightEnd, lConnectVector, &lRevDDF);
+                        SampledSpectrum lDDF = lVtx.evaluate(queryLightEnd, lConnectVector, &lRevDDF);
                         float eExtend2ndDirPDF;
-                        float lExtend1stDirPDF = lVtx.ddf->evaluatePDF(queryLightEnd, lConnectVector, &eExtend2ndDirPDF);
+                        float lExtend1stDirPDF = lVtx.evaluatePDF(queryLightEnd, lConnectVector, &eExtend2ndDirPDF);
                         
                         Vector3D eConnectVector = eVtx.surfPt.shadingFrame.toLocal(connectionVector);
                         DDFQuery queryEyeEnd{eVtx.dirIn_sn, eVtx.gNormal_sn, wlHint, false};
                         SampledSpectrum eRevDDF;
-                        SampledSpectrum eDDF = eVtx.ddf->evaluate(queryEyeEnd, eConnectVector, &eRevDDF);
+                        SampledSpectrum eDDF = eVtx.evaluate(queryEyeEnd, eConnectVector, &eRevDDF);
                         float lExtend2ndDirPDF;
-                        float eExtend1stDirPDF = eVtx.ddf->evaluatePDF(queryEyeEnd, eConnectVector, &lExtend2ndDirPDF);
+                        float eExtend1stDirPDF = eVtx.evaluatePDF(queryEyeEnd, eConnectVector, &lExtend2ndDirPDF);
                         
                         float wlProb = 1.0f;
                         if ((lVtx.wlFlags | eVtx.wlFlags) & WavelengthSamples::LambdaIsSelected)
@@ -232,7 +275,7 @@ namespace SLR {
                         }
                         
                         // calculate MIS weight and store weighted contribution to a sensor.
-                        float MISWeight = calculateMISWeight(lExtend1stAreaPDF, lExtend1stRRProb, lExtend2ndAreaPDF, lExtend2ndRRProb,
+                        float MISWeight = calculateMISWeight(wa, lExtend1stAreaPDF, lExtend1stRRProb, lExtend2ndAreaPDF, lExtend2ndRRProb,
                                                              eExtend1stAreaPDF, eExtend1stRRProb, eExtend2ndAreaPDF, eExtend2ndRRProb, s, t);
                         if (std::isinf(MISWeight) || std::isnan(MISWeight))
                             continue;
@@ -245,10 +288,10 @@ namespace SLR {
                             sensor->add(p.x, p.y, wls, contribution);
                         }
                         else {
-                            const IDF* idf = (const IDF*)eVtx.ddf->getDDF();
+                            const IDF* idf = (const IDF*)eVtx.ddf;
                             float hitPx, hitPy;
                             idf->calculatePixel(eConnectVector, &hitPx, &hitPy);
-                            sensor->add(threadID, hitPx, hitPy, wls, contribution);
+                            sensor->splat(hitPx, hitPy, wls, contribution);
                         }
                     }
                 }
@@ -258,9 +301,10 @@ namespace SLR {
         }
     }
     
-    void BidirectionalPathTracingRenderer::Job::generateSubPath(const WavelengthSamples &initWLs, const SampledSpectrum &initAlpha, const SLR::Ray &initRay, float dirPDF, DirectionType sampledType,
-                                                                float cosLast, bool adjoint, IndependentLightPathSampler &pathSampler, SLR::ArenaAllocator &mem) {
-        std::vector<BPTVertex> &vertices = adjoint ? lightVertices : eyeVertices;
+    void BidirectionalPathTracingRenderer::Job::generateSubPath(WorkingArea &wa, const WavelengthSamples &initWLs, const SampledSpectrum &initAlpha, const SLR::Ray &initRay, float dirPDF, DirectionType sampledType,
+                                                                float cosLast, bool adjoint, IndependentLightPathSampler &pathSampler, SLR::ArenaAllocator &mem) const {
+        std::vector<BPTVertex> &vertices = adjoint ? wa.lightVertices : wa.eyeVertices;
+        int16_t wlHint = wa.wlHint;
         
         // reject invalid values.
         if (dirPDF == 0.0f)
@@ -281,7 +325,7 @@ namespace SLR {
             BSDF* bsdf = surfPt.createBSDF(wls, mem);
             
             float areaPDF = dirPDF * absDot(dirOut_sn, gNorm_sn) / dist2;
-            vertices.emplace_back(surfPt, dirOut_sn, gNorm_sn, mem.create<BSDFProxy>(bsdf), alpha, areaPDF, RRProb, sampledType, wls.flags);
+            vertices.emplace_back(surfPt, dirOut_sn, gNorm_sn, bsdf, DDFType::BSDF, alpha, areaPDF, RRProb, sampledType, wls.flags);
             
             // implicit path (zero light subpath vertices, s = 0)
             if (!adjoint && surfPt.isEmitting()) {
@@ -293,7 +337,7 @@ namespace SLR {
                 float extend1stAreaPDF = lightProb * surfPt.evaluateAreaPDF();
                 float extend2ndAreaPDF = edf->evaluatePDF(EDFQuery(), dirOut_sn) * cosLast / dist2;
                 
-                float MISWeight = calculateMISWeight(extend1stAreaPDF, 1.0f, extend2ndAreaPDF, 1.0f,
+                float MISWeight = calculateMISWeight(wa, extend1stAreaPDF, 1.0f, extend2ndAreaPDF, 1.0f,
                                                      0.0f, 0.0f, 0.0f, 0.0f,
                                                      0, (uint32_t)vertices.size());
                 if (!std::isinf(MISWeight) && !std::isnan(MISWeight)) {
@@ -301,10 +345,10 @@ namespace SLR {
                     SLRAssert(MISWeight >= 0 && MISWeight <= 1.0f, "invalid MIS weight: %g", MISWeight);
                     SLRAssert(!contribution.hasNaN() && !contribution.hasInf() && !contribution.hasMinus(),
                               "Unexpected value detected: %s\n"
-                              "pix: (%f, %f)", contribution.toString().c_str(), curPx, curPy);
+                              "pix: (%f, %f)", contribution.toString().c_str(), wa.curPx, wa.curPy);
                     if (wls.flags & WavelengthSamples::LambdaIsSelected)
                         contribution *= WavelengthSamples::NumComponents;
-                    sensor->add(curPx, curPy, wls, contribution);
+                    sensor->add(wa.curPx, wa.curPy, wls, contribution);
                 }
             }
             
@@ -350,9 +394,11 @@ namespace SLR {
     }
     
     // calculate power heuristic MIS weight
-    float BidirectionalPathTracingRenderer::Job::calculateMISWeight(float lExtend1stAreaPDF, float lExtend1stRRProb, float lExtend2ndAreaPDF, float lExtend2ndRRProb,
+    float BidirectionalPathTracingRenderer::Job::calculateMISWeight(const WorkingArea &wa, float lExtend1stAreaPDF, float lExtend1stRRProb, float lExtend2ndAreaPDF, float lExtend2ndRRProb,
                                                                     float eExtend1stAreaPDF, float eExtend1stRRProb, float eExtend2ndAreaPDF, float eExtend2ndRRProb,
                                                                     uint32_t numLVtx, uint32_t numEVtx) const {
+        const std::vector<BPTVertex> &lightVertices = wa.lightVertices;
+        const std::vector<BPTVertex> &eyeVertices = wa.eyeVertices;
         const uint32_t minEyeVertices = 1;
         const uint32_t minLightVertices = 0;
         FloatSum recMISWeight = 1;
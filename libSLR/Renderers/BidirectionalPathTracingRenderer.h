@@ -24,54 +24,19 @@ namespace SLR {
             bool adjoint;
         };
         
-        struct DDFProxy {
-            virtual const void* getDDF() const = 0;
-            virtual SampledSpectrum evaluate(const DDFQuery &query, const Vector3D &dir_sn, SampledSpectrum* revVal) const = 0;
-            virtual float evaluatePDF(const DDFQuery &query, const Vector3D &dir_sn, float* revVal = nullptr) const = 0;
-        };
-        struct EDFProxy : public DDFProxy {
-            const EDF* edf;
-            EDFProxy(const EDF* _edf) : edf(_edf) {}
-            const void* getDDF() const override { return edf; }
-            SampledSpectrum evaluate(const DDFQuery &query, const Vector3D &dir_sn, SampledSpectrum* revVal) const override {
-                EDFQuery edfQuery;
-                return edf->evaluate(edfQuery, dir_sn);
-            }
-            float evaluatePDF(const DDFQuery &query, const Vector3D &dir_sn, float* revVal) const override {
-                EDFQuery edfQuery;
-                return edf->evaluatePDF(edfQuery, dir_sn);
-            }
-        };
-        struct BSDFProxy : public DDFProxy {
-            const BSDF* bsdf;
-            BSDFProxy(const BSDF* _bsdf) : bsdf(_bsdf) {}
-            const void* getDDF() const override { return bsdf; }
-            SampledSpectrum evaluate(const DDFQuery &query, const Vector3D &dir_sn, SampledSpectrum* revVal) const override {
-                BSDFQuery bsdfQuery(query.dir_sn, query.gNormal_sn, query.wlHint, DirectionType::All, query.adjoint);
-                return bsdf->evaluate(bsdfQuery, dir_sn, revVal);
-            }
-            float evaluatePDF(const DDFQuery &query, const Vector3D &dir_sn, float* revVal) const override {
-                BSDFQuery bsdfQuery(query.dir_sn, query.gNormal_sn, query.wlHint, DirectionType::All, query.adjoint);
-                return bsdf->evaluatePDF(bsdfQuery, dir_sn, revVal);
-            }
-        };
-        struct IDFProxy : public DDFProxy {
-            const IDF* idf;
-            IDFProxy(const IDF* _idf) : idf(_idf) {}
-            const void* getDDF() const override { return idf; }
-            SampledSpectrum evaluate(const DDFQuery &query, const Vector3D &dir_sn, SampledSpectrum* revVal) const override {
-                return idf->evaluate(dir_sn);
-            }
-            float evaluatePDF(const DDFQuery &query, const Vector3D &dir_sn, float* revVal) const override {
-                return idf->evaluatePDF(dir_sn);
-            }
+        // distribution function at a vertex, referred by a tagged pointer instead of a polymorphic proxy
+        // so that a vertex needs no allocation besides itself.
+        enum class DDFType : uint8_t {
+            EDF = 0,
+            BSDF,
+            IDF,
         };
         
         struct BPTVertex {
             SurfacePoint surfPt;
             Vector3D dirIn_sn;
             Normal3D gNormal_sn;
-            const DDFProxy* ddf;
+            const void* ddf;
             SampledSpectrum alpha;
             float areaPDF;
             float RRProb;
@@ -79,17 +44,55 @@ namespace SLR {
             float revRRProb;
             DirectionType sampledType;
             int16_t wlFlags;
-            BPTVertex(const SurfacePoint &_surfPt, const Vector3D &_dirIn_sn, const Normal3D &_gNormal_sn, const DDFProxy* _ddf,
+            DDFType ddfType;
+            BPTVertex(const SurfacePoint &_surfPt, const Vector3D &_dirIn_sn, const Normal3D &_gNormal_sn, const void* _ddf, DDFType _ddfType,
                       const SampledSpectrum &_alpha, float _areaPDF, float _RRProb, DirectionType _sampledType, int16_t _wlFlags) :
             surfPt(_surfPt), dirIn_sn(_dirIn_sn), gNormal_sn(_gNormal_sn), ddf(_ddf),
-            alpha(_alpha), areaPDF(_areaPDF), RRProb(_RRProb), revAreaPDF(NAN), revRRProb(NAN), sampledType(_sampledType), wlFlags(_wlFlags) {}
+            alpha(_alpha), areaPDF(_areaPDF), RRProb(_RRProb), revAreaPDF(NAN), revRRProb(NAN), sampledType(_sampledType), wlFlags(_wlFlags), ddfType(_ddfType) {}
+            
+            SampledSpectrum evaluate(const DDFQuery &query, const Vector3D &dir_sn, SampledSpectrum* revVal) const {
+                switch (ddfType) {
+                    case DDFType::EDF:
+                        return ((const EDF*)ddf)->evaluate(EDFQuery(), dir_sn);
+                    case DDFType::BSDF: {
+                        BSDFQuery bsdfQuery(query.dir_sn, query.gNormal_sn, query.wlHint, DirectionType::All, query.adjoint);
+                        return ((const BSDF*)ddf)->evaluate(bsdfQuery, dir_sn, revVal);
+                    }
+                    case DDFType::IDF:
+                    default:
+                        return ((const IDF*)ddf)->evaluate(dir_sn);
+                }
+            }
+            float evaluatePDF(const DDFQuery &query, const Vector3D &dir_sn, float* revVal) const {
+                switch (ddfType) {
+                    case DDFType::EDF:
+                        return ((const EDF*)ddf)->evaluatePDF(EDFQuery(), dir_sn);
+                    case DDFType::BSDF: {
+                        BSDFQuery bsdfQuery(query.dir_sn, query.gNormal_sn, query.wlHint, DirectionType::All, query.adjoint);
+                        return ((const BSDF*)ddf)->evaluatePDF(bsdfQuery, dir_sn, revVal);
+                    }
+                    case DDFType::IDF:
+                    default:
+                        return ((const IDF*)ddf)->evaluatePDF(dir_sn);
+                }
+            }
         };
         
+        // per-thread working area, the subpath buffers keep their capacity across paths and passes.
+        struct WorkingArea {
+            float curPx, curPy;
+            int16_t wlHint;
+            std::vector<BPTVertex> lightVertices;
+            std::vector<BPTVertex> eyeVertices;
+        };
+        
+        // shared by all the tiles of a render and passed by reference.
         struct Job {
             const Scene* scene;
             
             ArenaAllocator* mems;
             IndependentLightPathSampler** pathSamplers;
+            WorkingArea* workingAreas;
             
             const Camera* camera;
             float timeStart;
@@ -100,19 +103,11 @@ namespace SLR {
             uint32_t imageHeight;
             uint32_t numPixelX;
             uint32_t numPixelY;
-            uint32_t basePixelX;
-            uint32_t basePixelY;
-            
-            // working area
-            float curPx, curPy;
-            int16_t wlHint;
-            std::vector<BPTVertex> lightVertices;
-            std::vector<BPTVertex> eyeVertices;
             
-            void kernel(uint32_t threadID);
-            void generateSubPath(const WavelengthSamples &initWLs, const SampledSpectrum &initAlpha, const SLR::Ray &initRay, float dirPDF, DirectionType sampledType,
-                                 float cosLast, bool adjoint, IndependentLightPathSampler &pathSampler, SLR::ArenaAllocator &mem);
-            float calculateMISWeight(float lExtend1stAreaPDF, float lExtend1stRRProb, float lExtend2ndAreaPDF, float lExtend2ndRRProb,
+            void kernel(uint32_t threadID, uint32_t basePixelX, uint32_t basePixelY) const;
+            void generateSubPath(WorkingArea &wa, const WavelengthSamples &initWLs, const SampledSpectrum &initAlpha, const SLR::Ray &initRay, float dirPDF, DirectionType sampledType,
+                                 float cosLast, bool adjoint, IndependentLightPathSampler &pathSampler, SLR::ArenaAllocator &mem) const;
+            float calculateMISWeight(const WorkingArea &wa, float lExtend1stAreaPDF, float lExtend1stRRProb, float lExtend2ndAreaPDF, float lExtend2ndRRProb,
                                      float eExtend1stAreaPDF, float eExtend1stRRProb, float eExtend2ndAreaPDF, float eExtend2ndRRProb,
                                      uint32_t numLVtx, uint32_t numEVtx) const;
         };
@@ -27,11 +27,8 @@ namespace SLR {
     }
     
     void DebugRenderer::render(const Scene &scene, const RenderSettings &settings) const {
-#ifdef DEBUG
-        uint32_t numThreads = 1;
-#else
-        uint32_t numThreads = std::thread::hardware_concurrency();
-#endif
+        ThreadPool &threadPool = ThreadPool::sharedPool();
+        uint32_t numThreads = threadPool.numThreads();
         XORShiftRNG topRand(settings.getInt(RenderSettingItem::RNGSeed));
         std::unique_ptr<ArenaAllocator[]> mems = std::unique_ptr<ArenaAllocator[]>(new ArenaAllocator[numThreads]);
         std::unique_ptr<IndependentLightPathSampler[]> samplers = std::unique_ptr<IndependentLightPathSampler[]>(new IndependentLightPathSampler[numThreads]);
@@ -91,7 +88,6 @@ namespace SLR {
         }
         job.chImages = &chImages;
         
-        ThreadPool threadPool(numThreads);
         for (int ty = 0; ty < sensor->numTileY(); ++ty) {
             for (int tx = 0; tx < sensor->numTileX(); ++tx) {
                 job.basePixelX = tx * sensor->tileWidth();
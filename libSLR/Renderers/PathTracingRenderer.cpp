@@ -8,6 +8,8 @@
 #include "PathTracingRenderer.h"
 
 #include "../Core/RenderSettings.h"
+#include "../Core/TileScheduler.h"
+#include "../Core/RenderCheckpoint.h"
 #include "../Helper/ThreadPool.h"
 #include "../RNGs/XORShiftRNG.h"
 #include "../Memory/ArenaAllocator.h"
@@ -20,16 +22,14 @@
 #include "../Core/light_path_samplers.h"
 
 namespace SLR {
-    PathTracingRenderer::PathTracingRenderer(uint32_t spp) : m_samplesPerPixel(spp) {
+    PathTracingRenderer::PathTracingRenderer(uint32_t spp, float targetError, float timeLimit) :
+    m_samplesPerPixel(spp), m_targetError(targetError), m_timeLimit(timeLimit) {
         
     }
     
     void PathTracingRenderer::render(const Scene &scene, const RenderSettings &settings) const {
-#ifdef DEBUG
-        uint32_t numThreads = 1;
-#else
-        uint32_t numThreads = std::thread::hardware_concurrency();
-#endif
+        ThreadPool &threadPool = ThreadPool::sharedPool();
+        uint32_t numThreads = threadPool.numThreads();
         XORShiftRNG topRand(settings.getInt(RenderSettingItem::RNGSeed));
         std::unique_ptr<ArenaAllocator[]> mems = std::unique_ptr<ArenaAllocator[]>(new ArenaAllocator[numThreads]);
         std::unique_ptr<IndependentLightPathSampler[]> samplers = std::unique_ptr<IndependentLightPathSampler[]>(new IndependentLightPathSampler[numThreads]);
@@ -65,41 +65,128 @@ namespace SLR {
         uint32_t endIdx = 16;
         
         sensor->init(job.imageWidth, job.imageHeight);
+        bool adaptive = m_targetError > 0;
+        if (adaptive)
+            sensor->enableStatistics();
         
         std::chrono::system_clock::time_point start, end;
         start = std::chrono::system_clock::now();
         
-        for (int s = 0; s < m_samplesPerPixel; ++s) {
-            ThreadPool threadPool(numThreads);
+        // tiles run several samples each without synchronization until the next export point.
+        TileScheduler scheduler(sensor->numTileX(), sensor->numTileY());
+        auto renderTile = [&job, sensor](uint32_t threadID, uint32_t tx, uint32_t ty) {
+            Job tileJob = job;
+            tileJob.basePixelX = tx * sensor->tileWidth();
+            tileJob.basePixelY = ty * sensor->tileHeight();
+            tileJob.kernel(threadID);
+        };
+        
+        // Passes are kept short in the adaptive, the time-limited or the checkpointing mode so that the states are checked often enough.
+        const uint32_t MaxSamplesPerCheckedPass = 16;
+        const uint32_t MinSamplesForErrorEstimate = 16;
+        RenderCheckpoint checkpoint(settings.getString(RenderSettingItem::CheckpointPath));
+        double checkpointInterval = settings.getFloat(RenderSettingItem::CheckpointInterval);
+        bool checkEachPass = adaptive || m_timeLimit > 0 || checkpoint.enabled();
+        float brightness = settings.getFloat(RenderSettingItem::Brightness);
+        // pixels darker than this are nearly black after the tone mapping, their relative errors are measured against this value.
+        float minLuminance = 0.01f / brightness;
+        
+        auto updateActiveTiles = [this, sensor, &scheduler, minLuminance]() {
+            uint32_t numActiveTiles = 0;
             for (int ty = 0; ty < sensor->numTileY(); ++ty) {
                 for (int tx = 0; tx < sensor->numTileX(); ++tx) {
-                    job.basePixelX = tx * sensor->tileWidth();
-                    job.basePixelY = ty * sensor->tileHeight();
-                    threadPool.enqueue(std::bind(&Job::kernel, job, std::placeholders::_1));
+                    bool active = scheduler.isTileActive(tx, ty) && sensor->tileRelativeError(tx, ty, minLuminance) > m_targetError;
+                    scheduler.setTileActive(tx, ty, active);
+                    numActiveTiles += active;
                 }
             }
-            threadPool.wait();
+            return numActiveTiles;
+        };
+        
+        uint32_t s = 0;
+        double lastCheckpoint = 0.0;
+        if (settings.getBool(RenderSettingItem::Resume)) {
+            RenderCheckpoint::Progress progress;
+            if (checkpoint.read(sensor, &progress, samplers.get(), numThreads)) {
+                s = progress.numSamples;
+                exportPass = progress.exportPass;
+                imgIdx = progress.imageIndex;
+                start -= std::chrono::milliseconds((int64_t)(progress.elapsed * 1000));
+                lastCheckpoint = progress.elapsed;
+                if (adaptive && s >= MinSamplesForErrorEstimate)
+                    updateActiveTiles();
+                printf("resumed from %u samples, %g[s].\n", s, progress.elapsed);
+            }
+            else {
+                printf("no valid checkpoint to resume from, starting from the beginning.\n");
+            }
+        }
+        
+        while (s < m_samplesPerPixel && imgIdx < endIdx) {
+            uint32_t numSamples = std::min(exportPass, m_samplesPerPixel) - s;
+            if (checkEachPass)
+                numSamples = std::min(numSamples, MaxSamplesPerCheckedPass);
+            scheduler.render(threadPool, numSamples, renderTile);
+            s += numSamples;
             
-            if ((s + 1) == exportPass) {
+            end = std::chrono::system_clock::now();
+            double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() * 0.001;
+            
+            bool converged = false;
+            if (adaptive && s >= MinSamplesForErrorEstimate)
+                converged = updateActiveTiles() == 0;
+            bool timeOver = m_timeLimit > 0 && elapsed >= m_timeLimit;
+            bool finished = converged || timeOver || s == m_samplesPerPixel;
+            
+            if (s == exportPass || finished) {
                 char filename[256];
                 sprintf(filename, "%03u.bmp", imgIdx);
-                end = std::chrono::system_clock::now();
-                double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-                sensor->saveImage(filename, settings.getFloat(RenderSettingItem::Brightness) / (s + 1));
-                printf("%u samples: %s, %g[s]\n", exportPass, filename, elapsed * 0.001f);
+                // the sensor normalizes each pixel by its own sample count in the adaptive mode.
+                sensor->saveImageAsync(filename, adaptive ? brightness : brightness / s);
+                printf("%u samples: %s, %g[s]\n", s, filename, elapsed);
                 ++imgIdx;
-                if (imgIdx == endIdx)
-                    break;
-                exportPass += exportPass;
+                if (s == exportPass)
+                    exportPass += exportPass;
+            }
+            
+            // a render stopped by the time limit can be continued later with a larger limit.
+            if (checkpoint.enabled() && (timeOver || (!finished && elapsed - lastCheckpoint >= checkpointInterval))) {
+                RenderCheckpoint::Progress progress = {s, exportPass, imgIdx, elapsed};
+                if (checkpoint.write(*sensor, progress, samplers.get(), numThreads, timeOver))
+                    lastCheckpoint = elapsed;
             }
+            
+            if (converged)
+                printf("every tile reached the target error %g.\n", m_targetError);
+            else if (timeOver)
+                printf("reached the time limit %g[s].\n", m_timeLimit);
+            if (converged || timeOver)
+                break;
         }
         
+        sensor->waitForExport();
+        
         //    sensor.saveImage("output.png", settings.getFloat(RenderSettingItem::SensorResponse) / numSamples);
     }
     
     void PathTracingRenderer::Job::kernel(uint32_t threadID) {
         ArenaAllocator &mem = mems[threadID];
         IndependentLightPathSampler &pathSampler = *pathSamplers[threadID];
+        
+        // Primary rays in a tile are generated first and then traced as a stream to exploit their coherence.
+        const uint32_t MaxNumPixels = 64;
+        SLRAssert(numPixelX * numPixelY <= MaxNumPixels, "Tile is too large.");
+        struct PrimarySample {
+            float px, py;
+            WavelengthSamples wls;
+            SampledSpectrum weight;
+        };
+        PrimarySample primarySamples[MaxNumPixels];
+        Ray rays[MaxNumPixels];
+        Intersection isects[MaxNumPixels];
+        bool hits[MaxNumPixels];
+        
+        uint32_t numRays = 0;
         for (int ly = 0; ly < numPixelY; ++ly) {
             for (int lx = 0; lx < numPixelX; ++lx) {
                 float time = pathSampler.getTimeSample(timeStart, timeEnd);
@@ -117,24 +204,46 @@ namespace SLR {
                 IDF* idf = camera->createIDF(lensResult.surfPt, wls, mem);
                 SampledSpectrum We1 = idf->sample(WeSample, &WeResult);
                 
-                Ray ray(lensResult.surfPt.p, lensResult.surfPt.shadingFrame.fromLocal(WeResult.dirLocal), time);
-                SampledSpectrum C = contribution(*scene, wls, ray, pathSampler, mem);
-                SLRAssert(C.hasNaN() == false && C.hasInf() == false && C.hasMinus() == false,
-                          "Unexpected value detected: %s\n"
-                          "pix: (%f, %f)", C.toString().c_str(), px, py);
+                Ray &ray = rays[numRays];
+                ray = Ray(lensResult.surfPt.p, lensResult.surfPt.shadingFrame.fromLocal(WeResult.dirLocal), time);
                 
-                SampledSpectrum weight = (We0 * We1) * (absDot(ray.dir, lensResult.surfPt.gNormal) / (lensResult.areaPDF * WeResult.dirPDF * selectWLPDF));
-                SLRAssert(weight.hasNaN() == false && weight.hasInf() == false && weight.hasMinus() == false,
+                PrimarySample &primarySample = primarySamples[numRays];
+                primarySample.px = p.x;
+                primarySample.py = p.y;
+                primarySample.wls = wls;
+                primarySample.weight = (We0 * We1) * (absDot(ray.dir, lensResult.surfPt.gNormal) / (lensResult.areaPDF * WeResult.dirPDF * selectWLPDF));
+                SLRAssert(primarySample.weight.hasNaN() == false && primarySample.weight.hasInf() == false && primarySample.weight.hasMinus() == false,
                           "Unexpected value detected: %s\n"
-                          "pix: (%f, %f)", weight.toString().c_str(), px, py);
-                sensor->add(p.x, p.y, wls, weight * C);
+                          "pix: (%f, %f)", primarySample.weight.toString().c_str(), px, py);
+                ++numRays;
                 
                 mem.reset();
             }
         }
+        
+        scene->intersectStream(rays, isects, hits, numRays);
+        
+        for (uint32_t i = 0; i < numRays; ++i) {
+            const PrimarySample &primarySample = primarySamples[i];
+            if (!hits[i]) {
+                // a miss is still a sample of the pixel for the statistics.
+                if (sensor->hasStatistics())
+                    sensor->add(primarySample.px, primarySample.py, primarySample.wls, SampledSpectrum::Zero);
+                continue;
+            }
+            SampledSpectrum C = contribution(*scene, primarySample.wls, rays[i], isects[i], pathSampler, mem);
+            SLRAssert(C.hasNaN() == false && C.hasInf() == false && C.hasMinus() == false,
+                      "Unexpected value detected: %s\n"
+                      "pix: (%f, %f)", C.toString().c_str(), px, py);
+            
+            sensor->add(primarySample.px, primarySample.py, primarySample.wls, primarySample.weight * C);
+            
+            mem.reset();
+        }
     }
     
-    SampledSpectrum PathTracingRenderer::Job::contribution(const Scene &scene, const WavelengthSamples &initWLs, const Ray &initRay, IndependentLightPathSampler &pathSampler, ArenaAllocator &mem) const {
+    SampledSpectrum PathTracingRenderer::Job::contribution(const Scene &scene, const WavelengthSamples &initWLs, const Ray &initRay, const Intersection &initIsect,
+                                                          IndependentLightPathSampler &pathSampler, ArenaAllocator &mem) const {
         WavelengthSamples wls = initWLs;
         Ray ray = initRay;
         SurfacePoint surfPt;
@@ -143,9 +252,7 @@ namespace SLR {
         SampledSpectrumSum sp(SampledSpectrum::Zero);
         uint32_t pathLength = 0;
         
-        Intersection isect;
-        if (!scene.intersect(ray, &isect))
-            return SampledSpectrum::Zero;
+        Intersection isect = initIsect;
         isect.getSurfacePoint(&surfPt);
         
         Vector3D dirOut_sn = surfPt.shadingFrame.toLocal(-ray.dir);
@@ -156,7 +263,7 @@ namespace SLR {
         }
         if (surfPt.atInfinity)
             return sp;
-
+        
         while (true) {
             ++pathLength;
             if (pathLength >= 100)
@@ -169,7 +276,7 @@ namespace SLR {
             if (bsdf->hasNonDelta()) {
                 float lightProb;
                 Light light;
-                scene.selectLight(pathSampler.getLightSelectionSample(), &light, &lightProb);
+                scene.selectLight(surfPt.p, ray.time, pathSampler.getLightSelectionSample(), &light, &lightProb);
                 SLRAssert(!std::isnan(lightProb) && !std::isinf(lightProb), "lightProb: unexpected value detected: %f", lightProb);
                 
                 LightPosQuery lpQuery(ray.time, wls);
@@ -234,7 +341,7 @@ namespace SLR {
                 
                 EDF* edf = surfPt.createEDF(wls, mem);
                 SampledSpectrum Le = surfPt.emittance(wls) * edf->evaluate(EDFQuery(), dirOut_sn);
-                float lightProb = scene.evaluateProb(Light(isect.obj));
+                float lightProb = scene.evaluateProb(ray.org, ray.time, Light(isect.obj));
                 float dist2 = surfPt.getSquaredDistance(ray.org);
                 float lightPDF = lightProb * surfPt.evaluateAreaPDF() * dist2 / absDot(ray.dir, surfPt.gNormal);
                 SLRAssert(!Le.hasNaN() && !Le.hasInf(), "Le: unexpected value detected: %s", Le.toString().c_str());
@@ -33,12 +33,18 @@ namespace SLR {
             uint32_t basePixelY;
             
             void kernel(uint32_t threadID);
-            SampledSpectrum contribution(const Scene &scene, const WavelengthSamples &initWLs, const Ray &initRay, IndependentLightPathSampler &pathSampler, ArenaAllocator &mem) const;
+            SampledSpectrum contribution(const Scene &scene, const WavelengthSamples &initWLs, const Ray &initRay, const Intersection &initIsect,
+                                         IndependentLightPathSampler &pathSampler, ArenaAllocator &mem) const;
         };
         
         uint32_t m_samplesPerPixel;
+        float m_targetError;
+        float m_timeLimit;
     public:
-        PathTracingRenderer(uint32_t spp);
+        // With a positive "targetError", passes after the first few render only the tiles whose relative error of the pixel luminance
+        // is above the target, and rendering stops when every tile reaches it. "spp" then bounds the samples of a pixel.
+        // With a positive "timeLimit" [s], rendering stops after the pass exceeding it.
+        PathTracingRenderer(uint32_t spp, float targetError = 0.0f, float timeLimit = 0.0f);
         void render(const Scene &scene, const RenderSettings &settings) const override;
     };    
 }
@@ -0,0 +1,405 @@
+//
+//  WavefrontPathTracingRenderer.cpp
+//
+//  Created by 渡部 心 on 2016/10/23.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#include "WavefrontPathTracingRenderer.h"
+
+#include "../Core/RenderSettings.h"
+#include "../Core/TileScheduler.h"
+#include "../Core/RenderCheckpoint.h"
+#include "../Helper/ThreadPool.h"
+#include "../RNGs/XORShiftRNG.h"
+#include "../Memory/ArenaAllocator.h"
+#include "../Core/ImageSensor.h"
+#include "../Core/RandomNumberGenerator.h"
+#include "../Core/cameras.h"
+#include "../Core/SurfaceObject.h"
+#include "../Core/directional_distribution_functions.h"
+#include "../Core/light_path_samplers.h"
+
+namespace SLR {
+    void WavefrontPathTracingRenderer::Wavefront::init(uint32_t capacity) {
+        paths.resize(capacity);
+        numPaths = 0;
+        
+        activeIndices.reserve(capacity);
+        shadingQueue.reserve(capacity);
+        finishedIndices.reserve(capacity);
+        
+        rays.resize(capacity);
+        isects.resize(capacity);
+        hits = std::unique_ptr<bool[]>(new bool[capacity]);
+        
+        shadowIndices.reserve(capacity);
+        shadowRays.reserve(capacity);
+        occluded = std::unique_ptr<bool[]>(new bool[capacity]);
+    }
+    
+    WavefrontPathTracingRenderer::WavefrontPathTracingRenderer(uint32_t spp, uint32_t wavefrontSize) :
+    m_samplesPerPixel(spp), m_wavefrontSize(wavefrontSize) {
+        
+    }
+    
+    void WavefrontPathTracingRenderer::render(const Scene &scene, const RenderSettings &settings) const {
+        ThreadPool &threadPool = ThreadPool::sharedPool();
+        uint32_t numThreads = threadPool.numThreads();
+        XORShiftRNG topRand(settings.getInt(RenderSettingItem::RNGSeed));
+        std::unique_ptr<ArenaAllocator[]> mems = std::unique_ptr<ArenaAllocator[]>(new ArenaAllocator[numThreads]);
+        std::unique_ptr<IndependentLightPathSampler[]> samplers = std::unique_ptr<IndependentLightPathSampler[]>(new IndependentLightPathSampler[numThreads]);
+        for (int i = 0; i < numThreads; ++i) {
+            new (mems.get() + i) ArenaAllocator();
+            new (samplers.get() + i) IndependentLightPathSampler(topRand.getUInt());
+        }
+        std::unique_ptr<IndependentLightPathSampler*[]> samplerRefs = std::unique_ptr<IndependentLightPathSampler*[]>(new IndependentLightPathSampler*[numThreads]);
+        for (int i = 0; i < numThreads; ++i)
+            samplerRefs[i] = &samplers[i];
+        
+        const Camera* camera = scene.getCamera();
+        ImageSensor* sensor = camera->getSensor();
+        
+        uint32_t wavefrontSize = std::max(m_wavefrontSize, sensor->tileWidth() * sensor->tileHeight());
+        std::unique_ptr<Wavefront[]> wavefronts = std::unique_ptr<Wavefront[]>(new Wavefront[numThreads]);
+        for (int i = 0; i < numThreads; ++i)
+            wavefronts[i].init(wavefrontSize);
+        
+        Job job;
+        job.scene = &scene;
+        
+        job.mems = mems.get();
+        job.pathSamplers = samplerRefs.get();
+        job.wavefronts = wavefronts.get();
+        
+        job.camera = camera;
+        job.timeStart = settings.getFloat(RenderSettingItem::TimeStart);
+        job.timeEnd = settings.getFloat(RenderSettingItem::TimeEnd);
+        
+        job.sensor = sensor;
+        job.imageWidth = settings.getInt(RenderSettingItem::ImageWidth);
+        job.imageHeight = settings.getInt(RenderSettingItem::ImageHeight);
+        job.numPixelX = sensor->tileWidth();
+        job.numPixelY = sensor->tileHeight();
+        
+        uint32_t exportPass = 1;
+        uint32_t imgIdx = 0;
+        uint32_t endIdx = 16;
+        
+        sensor->init(job.imageWidth, job.imageHeight);
+        
+        std::chrono::system_clock::time_point start, end;
+        start = std::chrono::system_clock::now();
+        
+        // A tile only fills the batch of the thread, the batch is traced when it gets full and at the end of each region job.
+        // Regions don't overlap and a region has only one job at a time, so the paths of a pixel are never accumulated into the sensor concurrently.
+        TileScheduler scheduler(sensor->numTileX(), sensor->numTileY());
+        auto renderTile = [&job, sensor](uint32_t threadID, uint32_t tx, uint32_t ty) {
+            job.generatePaths(threadID, tx * sensor->tileWidth(), ty * sensor->tileHeight());
+        };
+        auto flushBatch = [&job, &wavefronts](uint32_t threadID) {
+            if (wavefronts[threadID].numPaths > 0)
+                job.trace(threadID);
+        };
+        auto renderPass = [&threadPool, &scheduler, &renderTile, &flushBatch](uint32_t numSamples) {
+            scheduler.render(threadPool, numSamples, renderTile, flushBatch);
+        };
+        
+        // Passes are kept short while checkpointing so that a checkpoint can be taken often enough.
+        const uint32_t MaxSamplesPerCheckedPass = 16;
+        RenderCheckpoint checkpoint(settings.getString(RenderSettingItem::CheckpointPath));
+        double checkpointInterval = settings.getFloat(RenderSettingItem::CheckpointInterval);
+        
+        uint32_t s = 0;
+        double lastCheckpoint = 0.0;
+        if (settings.getBool(RenderSettingItem::Resume)) {
+            RenderCheckpoint::Progress progress;
+            if (checkpoint.read(sensor, &progress, samplers.get(), numThreads)) {
+                s = progress.numSamples;
+                exportPass = progress.exportPass;
+                imgIdx = progress.imageIndex;
+                start -= std::chrono::milliseconds((int64_t)(progress.elapsed * 1000));
+                lastCheckpoint = progress.elapsed;
+                printf("resumed from %u samples, %g[s].\n", s, progress.elapsed);
+            }
+            else {
+                printf("no valid checkpoint to resume from, starting from the beginning.\n");
+            }
+        }
+        
+        while (s < m_samplesPerPixel && imgIdx < endIdx) {
+            uint32_t numSamples = std::min(exportPass, m_samplesPerPixel) - s;
+            if (checkpoint.enabled())
+                numSamples = std::min(numSamples, MaxSamplesPerCheckedPass);
+            renderPass(numSamples);
+            s += numSamples;
+            
+            end = std::chrono::system_clock::now();
+            double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() * 0.001;
+            
+            if (s == exportPass) {
+                char filename[256];
+                sprintf(filename, "%03u.bmp", imgIdx);
+                sensor->saveImageAsync(filename, settings.getFloat(RenderSettingItem::Brightness) / s);
+                printf("%u samples: %s, %g[s]\n", exportPass, filename, elapsed);
+                ++imgIdx;
+                exportPass += exportPass;
+            }
+            
+            if (checkpoint.enabled() && s < m_samplesPerPixel && elapsed - lastCheckpoint >= checkpointInterval) {
+                RenderCheckpoint::Progress progress = {s, exportPass, imgIdx, elapsed};
+                if (checkpoint.write(*sensor, progress, samplers.get(), numThreads))
+                    lastCheckpoint = elapsed;
+            }
+        }
+        
+        sensor->waitForExport();
+    }
+    
+    void WavefrontPathTracingRenderer::Job::generatePaths(uint32_t threadID, uint32_t basePixelX, uint32_t basePixelY) const {
+        Wavefront &wf = wavefronts[threadID];
+        if (wf.numPaths + numPixelX * numPixelY > wf.paths.size())
+            trace(threadID);
+        
+        ArenaAllocator &mem = mems[threadID];
+        IndependentLightPathSampler &pathSampler = *pathSamplers[threadID];
+        
+        for (int ly = 0; ly < numPixelY; ++ly) {
+            for (int lx = 0; lx < numPixelX; ++lx) {
+                float time = pathSampler.getTimeSample(timeStart, timeEnd);
+                PixelPosition p = pathSampler.getPixelPositionSample(basePixelX + lx, basePixelY + ly);
+                
+                float selectWLPDF;
+                WavelengthSamples wls = WavelengthSamples::createWithEqualOffsets(pathSampler.getWavelengthSample(), pathSampler.getWLSelectionSample(), &selectWLPDF);
+                
+                LensPosQuery lensQuery(time, wls);
+                LensPosQueryResult lensResult;
+                SampledSpectrum We0 = camera->sample(lensQuery, pathSampler.getLensPosSample(), &lensResult);
+                
+                IDFSample WeSample(p.x / imageWidth, p.y / imageHeight);
+                IDFQueryResult WeResult;
+                IDF* idf = camera->createIDF(lensResult.surfPt, wls, mem);
+                SampledSpectrum We1 = idf->sample(WeSample, &WeResult);
+                
+                PathState &path = wf.paths[wf.numPaths++];
+                path.px = p.x;
+                path.py = p.y;
+                path.wls = wls;
+                path.ray = Ray(lensResult.surfPt.p, lensResult.surfPt.shadingFrame.fromLocal(WeResult.dirLocal), time);
+                path.weight = (We0 * We1) * (absDot(path.ray.dir, lensResult.surfPt.gNormal) / (lensResult.areaPDF * WeResult.dirPDF * selectWLPDF));
+                SLRAssert(path.weight.hasNaN() == false && path.weight.hasInf() == false && path.weight.hasMinus() == false,
+                          "Unexpected value detected: %s\n"
+                          "pix: (%f, %f)", path.weight.toString().c_str(), p.x, p.y);
+                path.alpha = SampledSpectrum::One;
+                path.sp = SampledSpectrumSum(SampledSpectrum::Zero);
+                path.initY = path.alpha.importance(wls.selectedLambda);
+                path.pathLength = 0;
+                
+                mem.reset();
+            }
+        }
+    }
+    
+    void WavefrontPathTracingRenderer::Job::trace(uint32_t threadID) const {
+        Wavefront &wf = wavefronts[threadID];
+        ArenaAllocator &mem = mems[threadID];
+        IndependentLightPathSampler &pathSampler = *pathSamplers[threadID];
+        
+        wf.activeIndices.clear();
+        for (uint32_t i = 0; i < wf.numPaths; ++i)
+            wf.activeIndices.push_back(i);
+        
+        while (!wf.activeIndices.empty()) {
+            extend(wf, pathSampler, mem);
+            shade(wf, pathSampler, mem);
+            traceShadowRays(wf);
+            accumulate(wf);
+        }
+        wf.numPaths = 0;
+    }
+    
+    // intersects the extension rays of the active paths, adds the emittance at the hit points (implicit light sampling)
+    // and queues the surviving paths for shading.
+    void WavefrontPathTracingRenderer::Job::extend(Wavefront &wf, IndependentLightPathSampler &pathSampler, ArenaAllocator &mem) const {
+        uint32_t numRays = (uint32_t)wf.activeIndices.size();
+        for (uint32_t i = 0; i < numRays; ++i) {
+            wf.rays[i] = wf.paths[wf.activeIndices[i]].ray;
+            wf.isects[i] = Intersection();
+        }
+        scene->intersectStream(wf.rays.data(), wf.isects.data(), wf.hits.get(), numRays);
+        
+        wf.shadingQueue.clear();
+        for (uint32_t i = 0; i < numRays; ++i) {
+            uint32_t pathIdx = wf.activeIndices[i];
+            PathState &path = wf.paths[pathIdx];
+            if (!wf.hits[i]) {
+                wf.finishedIndices.push_back(pathIdx);
+                continue;
+            }
+            const Intersection &isect = wf.isects[i];
+            const Ray &ray = path.ray;
+            SurfacePoint &surfPt = path.surfPt;
+            isect.getSurfacePoint(&surfPt);
+            path.dirOut_sn = surfPt.shadingFrame.toLocal(-ray.dir);
+            
+            if (surfPt.isEmitting()) {
+                EDF* edf = surfPt.createEDF(path.wls, mem);
+                SampledSpectrum Le = surfPt.emittance(path.wls) * edf->evaluate(EDFQuery(), path.dirOut_sn);
+                SLRAssert(!Le.hasNaN() && !Le.hasInf(), "Le: unexpected value detected: %s", Le.toString().c_str());
+                if (path.pathLength == 0) {
+                    path.sp += path.alpha * Le;
+                }
+                else {
+                    float bsdfPDF = path.dirPDF;
+                    float lightProb = scene->evaluateProb(ray.org, ray.time, Light(isect.obj));
+                    float dist2 = surfPt.getSquaredDistance(ray.org);
+                    float lightPDF = lightProb * surfPt.evaluateAreaPDF() * dist2 / absDot(ray.dir, surfPt.gNormal);
+                    SLRAssert(!std::isnan(lightPDF)/* && !std::isinf(lightPDF)*/, "lightPDF: unexpected value detected: %f", lightPDF);
+                    
+                    float MISWeight = 1.0f;
+                    if (!path.dirIsDelta)
+                        MISWeight = (bsdfPDF * bsdfPDF) / (lightPDF * lightPDF + bsdfPDF * bsdfPDF);
+                    SLRAssert(MISWeight <= 1.0f, "Invalid MIS weight: %g", MISWeight);
+                    
+                    path.sp += path.alpha * Le * MISWeight;
+                }
+                mem.reset();
+            }
+            if (surfPt.atInfinity) {
+                wf.finishedIndices.push_back(pathIdx);
+                continue;
+            }
+            
+            // Russian roulette
+            if (path.pathLength > 0) {
+                float continueProb = std::min(path.alpha.importance(path.wls.selectedLambda) / path.initY, 1.0f);
+                if (pathSampler.getPathTerminationSample() < continueProb) {
+                    path.alpha /= continueProb;
+                }
+                else {
+                    wf.finishedIndices.push_back(pathIdx);
+                    continue;
+                }
+            }
+            
+            wf.shadingQueue.emplace_back(isect.getSurfaceMaterial(), pathIdx);
+        }
+    }
+    
+    // creates the BSDFs in the order of materials, computes the contributions of the next event estimation with their shadow rays,
+    // and samples the next directions of the paths.
+    void WavefrontPathTracingRenderer::Job::shade(Wavefront &wf, IndependentLightPathSampler &pathSampler, ArenaAllocator &mem) const {
+        std::sort(wf.shadingQueue.begin(), wf.shadingQueue.end());
+        
+        wf.activeIndices.clear();
+        for (uint32_t i = 0; i < wf.shadingQueue.size(); ++i) {
+            uint32_t pathIdx = wf.shadingQueue[i].second;
+            PathState &path = wf.paths[pathIdx];
+            ++path.pathLength;
+            if (path.pathLength >= 100) {
+                wf.finishedIndices.push_back(pathIdx);
+                continue;
+            }
+            const SurfacePoint &surfPt = path.surfPt;
+            WavelengthSamples &wls = path.wls;
+            float time = path.ray.time;
+            
+            Normal3D gNorm_sn = surfPt.shadingFrame.toLocal(surfPt.gNormal);
+            BSDF* bsdf = surfPt.createBSDF(wls, mem);
+            BSDFQuery fsQuery(path.dirOut_sn, gNorm_sn, wls.selectedLambda);
+            
+            // Next Event Estimation (explicit light sampling)
+            // The contribution is computed in advance and added in the shadow ray stage only if the light is visible.
+            if (bsdf->hasNonDelta()) {
+                float lightProb;
+                Light light;
+                scene->selectLight(surfPt.p, time, pathSampler.getLightSelectionSample(), &light, &lightProb);
+                SLRAssert(!std::isnan(lightProb) && !std::isinf(lightProb), "lightProb: unexpected value detected: %f", lightProb);
+                
+                LightPosQuery lpQuery(time, wls);
+                LightPosQueryResult lpResult;
+                SampledSpectrum M = light.sample(lpQuery, pathSampler.getLightPosSample(), &lpResult);
+                SLRAssert(!std::isnan(lpResult.areaPDF)/* && !std::isinf(xpResult.areaPDF)*/, "areaPDF: unexpected value detected: %f", lpResult.areaPDF);
+                
+                float dist2;
+                Vector3D shadowDir = lpResult.surfPt.getDirectionFrom(surfPt.p, &dist2);
+                Vector3D shadowDir_l = lpResult.surfPt.shadingFrame.toLocal(-shadowDir);
+                Vector3D shadowDir_sn = surfPt.shadingFrame.toLocal(shadowDir);
+                
+                EDF* edf = lpResult.surfPt.createEDF(wls, mem);
+                SampledSpectrum Le = M * edf->evaluate(EDFQuery(), shadowDir_l);
+                float lightPDF = lightProb * lpResult.areaPDF;
+                SLRAssert(!Le.hasNaN() && !Le.hasInf(), "Le: unexpected value detected: %s", Le.toString().c_str());
+                
+                SampledSpectrum fs = bsdf->evaluate(fsQuery, shadowDir_sn);
+                float cosLight = absDot(-shadowDir, lpResult.surfPt.gNormal);
+                float bsdfPDF = bsdf->evaluatePDF(fsQuery, shadowDir_sn) * cosLight / dist2;
+                
+                float MISWeight = 1.0f;
+                if (!lpResult.posType.isDelta() && !std::isinf(lpResult.areaPDF))
+                    MISWeight = (lightPDF * lightPDF) / (lightPDF * lightPDF + bsdfPDF * bsdfPDF);
+                SLRAssert(MISWeight <= 1.0f, "Invalid MIS weight: %g", MISWeight);
+                
+                float G = absDot(shadowDir_sn, gNorm_sn) * cosLight / dist2;
+                SLRAssert(!std::isnan(G) && !std::isinf(G), "G: unexpected value detected: %f", G);
+                path.neeContribution = path.alpha * Le * fs * (G * MISWeight / lightPDF);
+                
+                // a shadow ray is needless for a path that gains nothing from the light.
+                if (path.neeContribution != SampledSpectrum::Zero) {
+                    wf.shadowIndices.push_back(pathIdx);
+                    wf.shadowRays.push_back(Scene::createVisibilityRay(surfPt, lpResult.surfPt, time));
+                }
+            }
+            
+            // get a next direction by sampling BSDF.
+            BSDFQueryResult fsResult;
+            SampledSpectrum fs = bsdf->sample(fsQuery, pathSampler.getBSDFSample(), &fsResult);
+            mem.reset();
+            if (fs == SampledSpectrum::Zero || fsResult.dirPDF == 0.0f) {
+                wf.finishedIndices.push_back(pathIdx);
+                continue;
+            }
+            if (fsResult.dirType.isDispersive()) {
+                fsResult.dirPDF /= WavelengthSamples::NumComponents;
+                wls.flags |= WavelengthSamples::LambdaIsSelected;
+            }
+            path.alpha *= fs * absDot(fsResult.dir_sn, gNorm_sn) / fsResult.dirPDF;
+            SLRAssert(!path.alpha.hasInf() && !path.alpha.hasNaN(),
+                      "alpha: %s\nlength: %u, cos: %g, dirPDF: %g",
+                      path.alpha.toString().c_str(), path.pathLength, absDot(fsResult.dir_sn, gNorm_sn), fsResult.dirPDF);
+            
+            Vector3D dirIn = surfPt.shadingFrame.fromLocal(fsResult.dir_sn);
+            path.ray = Ray(surfPt.p, dirIn, time, Ray::Epsilon);
+            path.dirPDF = fsResult.dirPDF;
+            path.dirIsDelta = fsResult.dirType.isDelta();
+            wf.activeIndices.push_back(pathIdx);
+        }
+    }
+    
+    void WavefrontPathTracingRenderer::Job::traceShadowRays(Wavefront &wf) const {
+        uint32_t numRays = (uint32_t)wf.shadowRays.size();
+        scene->occludedStream(wf.shadowRays.data(), wf.occluded.get(), numRays);
+        for (uint32_t i = 0; i < numRays; ++i) {
+            if (wf.occluded[i])
+                continue;
+            PathState &path = wf.paths[wf.shadowIndices[i]];
+            path.sp += path.neeContribution;
+        }
+        wf.shadowIndices.clear();
+        wf.shadowRays.clear();
+    }
+    
+    // A path is accumulated after the shadow ray of its last vertex is resolved.
+    // A path missing the scene from the camera is still a sample of the pixel for the statistics.
+    void WavefrontPathTracingRenderer::Job::accumulate(Wavefront &wf) const {
+        for (uint32_t i = 0; i < wf.finishedIndices.size(); ++i) {
+            const PathState &path = wf.paths[wf.finishedIndices[i]];
+            SampledSpectrum C = path.sp;
+            SLRAssert(C.hasNaN() == false && C.hasInf() == false && C.hasMinus() == false,
+                      "Unexpected value detected: %s\n"
+                      "pix: (%f, %f)", C.toString().c_str(), path.px, path.py);
+            sensor->add(path.px, path.py, path.wls, path.weight * C);
+        }
+        wf.finishedIndices.clear();
+    }
+}
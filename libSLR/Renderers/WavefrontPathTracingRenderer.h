@@ -0,0 +1,100 @@
+//
+//  WavefrontPathTracingRenderer.h
+//
+//  Created by 渡部 心 on 2016/10/23.
+//  Copyright (c) 2016年 渡部 心. All rights reserved.
+//
+
+#ifndef __SLR__WavefrontPathTracingRenderer__
+#define __SLR__WavefrontPathTracingRenderer__
+
+#include "../defines.h"
+#include "../references.h"
+#include "../Core/Renderer.h"
+
+#include "../Core/geometry.h"
+
+namespace SLR {
+    // Path tracer equivalent to PathTracingRenderer, but each thread advances a large batch of paths a bounce at a time
+    // through separate stages: extension ray intersection, material evaluation in the order of materials, shadow ray intersection and accumulation.
+    // Each stage runs the same code over the whole batch and the ray batches are traced as streams.
+    class SLR_API WavefrontPathTracingRenderer : public Renderer {
+        struct PathState {
+            float px, py;
+            WavelengthSamples wls;
+            SampledSpectrum weight;
+            SampledSpectrum alpha;
+            SampledSpectrumSum sp;
+            float initY;
+            uint32_t pathLength;
+            Ray ray;
+            SurfacePoint surfPt;
+            Vector3D dirOut_sn;
+            // of the direction sampled at the previous vertex, for MIS of an implicitly hit light.
+            float dirPDF;
+            bool dirIsDelta;
+            // contribution of the next event estimation, valid when its shadow ray is unoccluded.
+            SampledSpectrum neeContribution;
+            
+            PathState() : sp(SampledSpectrum::Zero) { }
+        };
+        
+        // per-thread batch of paths and the work lists of the stages.
+        struct Wavefront {
+            std::vector<PathState> paths;
+            uint32_t numPaths;
+            
+            std::vector<uint32_t> activeIndices;
+            // paths to shade paired with their materials, sorted so that paths of the same material are shaded in a row.
+            std::vector<std::pair<const SurfaceMaterial*, uint32_t>> shadingQueue;
+            std::vector<uint32_t> finishedIndices;
+            
+            std::vector<Ray> rays;
+            std::vector<Intersection> isects;
+            std::unique_ptr<bool[]> hits;
+            
+            std::vector<uint32_t> shadowIndices;
+            std::vector<Ray> shadowRays;
+            std::unique_ptr<bool[]> occluded;
+            
+            void init(uint32_t capacity);
+        };
+        
+        struct Job {
+            const Scene* scene;
+            
+            ArenaAllocator* mems;
+            IndependentLightPathSampler** pathSamplers;
+            Wavefront* wavefronts;
+            
+            const Camera* camera;
+            float timeStart;
+            float timeEnd;
+            
+            ImageSensor* sensor;
+            uint32_t imageWidth;
+            uint32_t imageHeight;
+            uint32_t numPixelX;
+            uint32_t numPixelY;
+            
+            // appends the camera paths of a tile to the thread's batch, the batch is traced first if it has no room for them.
+            void generatePaths(uint32_t threadID, uint32_t basePixelX, uint32_t basePixelY) const;
+            // traces all the paths in the batch to completion and accumulates them into the sensor.
+            void trace(uint32_t threadID) const;
+            
+            void extend(Wavefront &wf, IndependentLightPathSampler &pathSampler, ArenaAllocator &mem) const;
+            void shade(Wavefront &wf, IndependentLightPathSampler &pathSampler, ArenaAllocator &mem) const;
+            void traceShadowRays(Wavefront &wf) const;
+            void accumulate(Wavefront &wf) const;
+        };
+        
+        uint32_t m_samplesPerPixel;
+        uint32_t m_wavefrontSize;
+    public:
+        // "wavefrontSize" is the number of paths in the batch of a thread.
+        WavefrontPathTracingRenderer(uint32_t spp, uint32_t wavefrontSize = 2048);
+        void render(const Scene &scene, const RenderSettings &settings) const override;
+    };
+}
+
+#endif
@@ -45,6 +45,11 @@ namespace SLR {
         return true;
     }
     
+    bool InfiniteSphere::occluded(const Ray &ray) const {
+        // The infinite sphere never occludes any finite segment.
+        return false;
+    }
+    
     void InfiniteSphere::getSurfacePoint(const Intersection &isect, SurfacePoint *surfPt) const {
         surfPt->p = isect.p;
         surfPt->atInfinity = true;
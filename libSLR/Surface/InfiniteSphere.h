@@ -24,6 +24,7 @@ namespace SLR {
         void splitBounds(BoundingBox3D::Axis chopAxis, float splitPos, BoundingBox3D* bbox0, BoundingBox3D* bbox1) const override;
         bool preTransformed() const override;
         bool intersect(const Ray &ray, Intersection* isect) const override;
+        bool occluded(const Ray &ray) const override;
         void getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const override;
         float area() const override;
         void sample(float u0, float u1, SurfacePoint* surfPt, float* areaPDF) const override;
@@ -12,6 +12,72 @@
 #include "../Core/textures.h"
 
 namespace SLR {
+    static inline float signNotZero(float v) {
+        return v >= 0.0f ? 1.0f : -1.0f;
+    }
+    
+    static void encodeOctahedral(const Vector3D &v, uint16_t encoded[2]) {
+        float l1Norm = std::fabs(v.x) + std::fabs(v.y) + std::fabs(v.z);
+        // a zero (or invalid) vector is encoded as +Z.
+        if (!(l1Norm > 0.0f)) {
+            encoded[0] = encoded[1] = 32768;
+            return;
+        }
+        float px = v.x / l1Norm;
+        float py = v.y / l1Norm;
+        if (v.z < 0) {
+            float tx = (1.0f - std::fabs(py)) * signNotZero(px);
+            py = (1.0f - std::fabs(px)) * signNotZero(py);
+            px = tx;
+        }
+        encoded[0] = (uint16_t)std::round(std::min(std::max(0.5f * px + 0.5f, 0.0f), 1.0f) * 65535);
+        encoded[1] = (uint16_t)std::round(std::min(std::max(0.5f * py + 0.5f, 0.0f), 1.0f) * 65535);
+    }
+    
+    static Vector3D decodeOctahedral(const uint16_t encoded[2]) {
+        Vector3D v;
+        v.x = encoded[0] * (2.0f / 65535) - 1.0f;
+        v.y = encoded[1] * (2.0f / 65535) - 1.0f;
+        v.z = 1.0f - std::fabs(v.x) - std::fabs(v.y);
+        if (v.z < 0) {
+            float tx = (1.0f - std::fabs(v.y)) * signNotZero(v.x);
+            v.y = (1.0f - std::fabs(v.x)) * signNotZero(v.y);
+            v.x = tx;
+        }
+        return normalize(v);
+    }
+    
+    CompactVertexAttribute::CompactVertexAttribute(const Vertex &v) : texCoord{v.texCoord.u, v.texCoord.v} {
+        encodeOctahedral(v.normal, normal);
+        encodeOctahedral(v.tangent, tangent);
+    }
+    
+    Normal3D CompactVertexAttribute::decodeNormal() const {
+        return decodeOctahedral(normal);
+    }
+    
+    Tangent3D CompactVertexAttribute::decodeTangent() const {
+        return decodeOctahedral(tangent);
+    }
+    
+    TriangleConstants TriangleConstants::calculate(const Vertex &v0, const Vertex &v1, const Vertex &v2) {
+        TriangleConstants ret;
+        ret.gNormal = normalize(cross(v1.position - v0.position, v2.position - v0.position));
+        
+        Vector3D dP0 = v0.position - v2.position;
+        Vector3D dP1 = v1.position - v2.position;
+        TexCoord2D dTC0 = v0.texCoord - v2.texCoord;
+        TexCoord2D dTC1 = v1.texCoord - v2.texCoord;
+        float detTC = dTC0.u * dTC1.v - dTC0.v * dTC1.u;
+        if (detTC != 0)
+            ret.texCoord0Dir = normalize((1.0f / detTC) * Vector3D(dTC1.v * dP0.x - dTC0.v * dP1.x,
+                                                                   dTC1.v * dP0.y - dTC0.v * dP1.y,
+                                                                   dTC1.v * dP0.z - dTC0.v * dP1.z));
+        else
+            ret.texCoord0Dir = normalize(dP0);
+        return ret;
+    }
+    
     BoundingBox3D Triangle::bounds() const {
         return BoundingBox3D(m_v[0]->position).unify(m_v[1]->position).unify(m_v[2]->position);
     }
@@ -159,50 +225,107 @@ namespace SLR {
             return false;
         
         float b0 = 1.0f - b1 - b2;
-        TexCoord2D texCoord = b0 * v0.texCoord + b1 * v1.texCoord + b2 * v2.texCoord;
         // Check if an alpha value at the intersection point is zero or not.
         // If zero, intersection doesn't occur.
         if (m_alphaTex) {
+            TexCoord2D texCoord = b0 * v0.texCoord + b1 * v1.texCoord + b2 * v2.texCoord;
             if (m_alphaTex->evaluate(texCoord) == 0.0f)
                 return false;
         }
         
+        // A closer hit may still be found, so the other attributes are left to getSurfacePoint().
         isect->dist = tt;
-        isect->p = ray.org + ray.dir * tt;
-        isect->gNormal = normalize(cross(edge01, edge02));
         isect->u = b0;
         isect->v = b1;
-        isect->texCoord = texCoord;
         
         return true;
     }
     
-    void Triangle::getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const {
-        surfPt->p = isect.p;
-        surfPt->atInfinity = false;
-        surfPt->gNormal = isect.gNormal;
-        surfPt->u = isect.u;
-        surfPt->v = isect.v;
-        surfPt->texCoord = isect.texCoord;
+    bool Triangle::occluded(const Ray &ray) const {
+        const Vertex &v0 = *m_v[0];
+        const Vertex &v1 = *m_v[1];
+        const Vertex &v2 = *m_v[2];
+        
+        Vector3D edge01 = v1.position - v0.position;
+        Vector3D edge02 = v2.position - v0.position;
+        
+        Vector3D p = cross(ray.dir, edge02);
+        float det = dot(edge01, p);
+        if (det == 0.0f)
+            return false;
+        float invDet = 1.0f / det;
+        
+        Vector3D d = ray.org - v0.position;
+        
+        float b1 = dot(d, p) * invDet;
+        if (b1 < 0.0f || b1 > 1.0f)
+            return false;
+        
+        Vector3D q = cross(d, edge01);
         
+        float b2 = dot(ray.dir, q) * invDet;
+        if (b2 < 0.0f || b1 + b2 > 1.0f)
+            return false;
+        
+        float tt = dot(edge02, q) * invDet;
+        if (tt < ray.distMin || tt > ray.distMax)
+            return false;
+        
+        // Hit attributes aren't needed for occlusion, only a texture coordinate for the alpha test.
+        if (m_alphaTex) {
+            float b0 = 1.0f - b1 - b2;
+            TexCoord2D texCoord = b0 * v0.texCoord + b1 * v1.texCoord + b2 * v2.texCoord;
+            if (m_alphaTex->evaluate(texCoord) == 0.0f)
+                return false;
+        }
+        
+        return true;
+    }
+    
+    bool Triangle::getEmbeddableTriangle(Point3D* p0, Point3D* p1, Point3D* p2) const {
+        // a triangle with an alpha texture needs to evaluate the texture during traversal.
+        if (m_alphaTex)
+            return false;
+        *p0 = m_v[0]->position;
+        *p1 = m_v[1]->position;
+        *p2 = m_v[2]->position;
+        return true;
+    }
+    
+    void Triangle::fillEmbeddedTriangleIntersection(const Ray &ray, float dist, float b1, float b2, Intersection* isect) const {
+        isect->dist = dist;
+        isect->u = 1.0f - b1 - b2;
+        isect->v = b1;
+    }
+    
+    Point3D Triangle::getIntersectionPoint(const Intersection &isect) const {
+        float b0 = isect.u, b1 = isect.v;
+        float b2 = 1.0f - b0 - b1;
+        return b0 * m_v[0]->position + b1 * m_v[1]->position + b2 * m_v[2]->position;
+    }
+    
+    void Triangle::normalBounds(Vector3D* axis, float* cosTheta) const {
+        *axis = getConstants().gNormal;
+        *cosTheta = 1.0f;
+        for (int i = 0; i < 3; ++i)
+            *cosTheta = std::min(*cosTheta, dot(*axis, normalize(m_v[i]->normal)));
+    }
+    
+    void Triangle::getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const {
         const Vertex &v0 = *m_v[0];
         const Vertex &v1 = *m_v[1];
         const Vertex &v2 = *m_v[2];
         float b0 = isect.u, b1 = isect.v;
         float b2 = 1.0f - b0 - b1;
+        TriangleConstants constants = getConstants();
         
-        // TODO: It might be preferable to explicitly calculate this direction from texture coordinates at the setup time and add an attribute to Triangle.
-        Vector3D dP0 = v0.position - v2.position;
-        Vector3D dP1 = v1.position - v2.position;
-        TexCoord2D dTC0 = v0.texCoord - v2.texCoord;
-        TexCoord2D dTC1 = v1.texCoord - v2.texCoord;
-        float detTC = dTC0.u * dTC1.v - dTC0.v * dTC1.u;
-        if (detTC != 0)
-            surfPt->texCoord0Dir = normalize((1.0f / detTC) * Vector3D(dTC1.v * dP0.x - dTC0.v * dP1.x,
-                                                                       dTC1.v * dP0.y - dTC0.v * dP1.y,
-                                                                       dTC1.v * dP0.z - dTC0.v * dP1.z));
-        else
-            surfPt->texCoord0Dir = normalize(dP0);
+        surfPt->p = b0 * v0.position + b1 * v1.position + b2 * v2.position;
+        surfPt->atInfinity = false;
+        surfPt->gNormal = constants.gNormal;
+        surfPt->u = b0;
+        surfPt->v = b1;
+        surfPt->texCoord = b0 * v0.texCoord + b1 * v1.texCoord + b2 * v2.texCoord;
+        surfPt->texCoord0Dir = constants.texCoord0Dir;
         
         surfPt->shadingFrame.z = normalize(b0 * v0.normal + b1 * v1.normal + b2 * v2.normal);
         surfPt->shadingFrame.x = normalize(b0 * v0.tangent + b1 * v1.tangent + b2 * v2.tangent);
@@ -231,21 +354,15 @@ namespace SLR {
         const Vertex v1 = *m_v[1];
         const Vertex v2 = *m_v[2];
         
+        TriangleConstants constants = getConstants();
+        
         surfPt->p = b0 * v0.position + b1 * v1.position + b2 * v2.position;
         surfPt->atInfinity = false;
-        surfPt->gNormal = cross(v1.position - v0.position, v2.position - v0.position).normalize();
+        surfPt->gNormal = constants.gNormal;
         surfPt->u = b0;
         surfPt->v = b1;
         surfPt->texCoord = b0 * v0.texCoord + b1 * v1.texCoord + b2 * v2.texCoord;
-        
-        Vector3D dP0 = v0.position - v2.position;
-        Vector3D dP1 = v1.position - v2.position;
-        TexCoord2D dTC0 = v0.texCoord - v2.texCoord;
-        TexCoord2D dTC1 = v1.texCoord - v2.texCoord;
-        float invDetTC = 1.0f / (dTC0.u * dTC1.v - dTC0.v * dTC1.u);
-        surfPt->texCoord0Dir = invDetTC * Vector3D(dTC1.v * dP0.x - dTC0.v * dP1.x,
-                                                   dTC1.v * dP0.y - dTC0.v * dP1.y,
-                                                   dTC1.v * dP0.z - dTC0.v * dP1.z);
+        surfPt->texCoord0Dir = constants.texCoord0Dir;
         
         surfPt->shadingFrame.z = normalize(b0 * v0.normal + b1 * v1.normal + b2 * v2.normal);
         surfPt->shadingFrame.x = normalize(b0 * v0.tangent + b1 * v1.tangent + b2 * v2.tangent);
@@ -11,15 +11,46 @@
 #include "../defines.h"
 #include "../references.h"
 #include "../Core/geometry.h"
+#include <half.h>
 
 namespace SLR {
+    // shading attributes of a vertex packed into 12 bytes.
+    // The normal and the tangent are octahedral-encoded into pairs of 16-bit unorms and the texture coordinates are stored as half floats.
+    struct SLR_API CompactVertexAttribute {
+        uint16_t normal[2];
+        uint16_t tangent[2];
+        half texCoord[2];
+        
+        CompactVertexAttribute() { }
+        CompactVertexAttribute(const Vertex &v);
+        
+        Normal3D decodeNormal() const;
+        Tangent3D decodeTangent() const;
+        TexCoord2D decodeTexCoord() const { return TexCoord2D(texCoord[0], texCoord[1]); }
+    };
+    
+    // values which depend only on the vertices of a triangle, meshes precompute them at build time.
+    struct SLR_API TriangleConstants {
+        Normal3D gNormal;
+        Vector3D texCoord0Dir;
+        
+        static TriangleConstants calculate(const Vertex &v0, const Vertex &v1, const Vertex &v2);
+    };
+    
+    // Intersection only records the distance and the barycentric coordinates,
+    // the other hit attributes are reconstructed from them when the surface point of the final hit is requested.
     class SLR_API Triangle : public Surface {
         const Vertex* m_v[3];
         const FloatTexture* m_alphaTex;
+        const TriangleConstants* m_constants;
+        
+        TriangleConstants getConstants() const {
+            return m_constants ? *m_constants : TriangleConstants::calculate(*m_v[0], *m_v[1], *m_v[2]);
+        }
     public:
-        Triangle() : m_v{nullptr, nullptr, nullptr}, m_alphaTex(nullptr) { }
-        Triangle(const Vertex* v0, const Vertex* v1, const Vertex* v2, const FloatTexture* aTex) :
-        m_v{v0, v1, v2}, m_alphaTex(aTex) { }
+        Triangle() : m_v{nullptr, nullptr, nullptr}, m_alphaTex(nullptr), m_constants(nullptr) { }
+        Triangle(const Vertex* v0, const Vertex* v1, const Vertex* v2, const FloatTexture* aTex, const TriangleConstants* constants = nullptr) :
+        m_v{v0, v1, v2}, m_alphaTex(aTex), m_constants(constants) { }
         
         // TODO: consider a better cost value.
         float costForIntersect() const override { return 1.0f; }
@@ -28,6 +59,11 @@ namespace SLR {
         void splitBounds(BoundingBox3D::Axis splitAxis, float splitPos, BoundingBox3D* bbox0, BoundingBox3D* bbox1) const override;
         bool preTransformed() const override;
         bool intersect(const Ray &ray, Intersection* isect) const override;
+        bool occluded(const Ray &ray) const override;
+        bool getEmbeddableTriangle(Point3D* p0, Point3D* p1, Point3D* p2) const override;
+        void fillEmbeddedTriangleIntersection(const Ray &ray, float dist, float b1, float b2, Intersection* isect) const override;
+        Point3D getIntersectionPoint(const Intersection &isect) const override;
+        void normalBounds(Vector3D* axis, float* cosTheta) const override;
         void getSurfacePoint(const Intersection &isect, SurfacePoint* surfPt) const override;
         float area() const override;
         void sample(float u0, float u1, SurfacePoint* surfPt, float* areaPDF) const override;
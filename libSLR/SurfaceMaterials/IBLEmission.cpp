@@ -20,7 +20,7 @@ namespace SLR {
         return mem.create<IBLEDF>(m_scene->getWorldDiscArea());
     }
     
-    RegularConstantContinuous2D* IBLEmission::createIBLImportanceMap() const {
+    Continuous2DDistribution* IBLEmission::createIBLImportanceMap() const {
         return m_coeffM->createIBLImportanceMap();
     }
 }
@@ -24,7 +24,7 @@ namespace SLR {
         SampledSpectrum emittance(const SurfacePoint &surfPt, const WavelengthSamples &wls) const override;
         EDF* getEDF(const SurfacePoint &surfPt, const WavelengthSamples &wls, ArenaAllocator &mem, float scale = 1.0f) const override;
         
-        RegularConstantContinuous2D* createIBLImportanceMap() const;
+        Continuous2DDistribution* createIBLImportanceMap() const;
     };
 }
 
@@ -8,7 +8,7 @@
 #include "checker_board_textures.h"
 
 namespace SLR {
-    RegularConstantContinuous2D* CheckerBoardSpectrumTexture::createIBLImportanceMap() const {
+    Continuous2DDistribution* CheckerBoardSpectrumTexture::createIBLImportanceMap() const {
         SLRAssert_NotImplemented();
         return nullptr;
     }
@@ -23,7 +23,7 @@ namespace SLR {
             Point3D tc = m_mapping->map(surfPt);
             return m_values[((int)(tc.x * 2) + (int)(tc.y * 2)) % 2]->evaluate(wls);
         }
-        RegularConstantContinuous2D* createIBLImportanceMap() const override;
+        Continuous2DDistribution* createIBLImportanceMap() const override;
     };
     
     class SLR_API CheckerBoardNormal3DTexture : public Normal3DTexture {
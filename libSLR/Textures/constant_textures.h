@@ -19,7 +19,7 @@ namespace SLR {
         ConstantSpectrumTexture(const InputSpectrum* value) : m_value(value) { }
         
         SampledSpectrum evaluate(const SurfacePoint &surfPt, const WavelengthSamples &wls) const override { return m_value->evaluate(wls); }
-        RegularConstantContinuous2D* createIBLImportanceMap() const override;
+        Continuous2DDistribution* createIBLImportanceMap() const override;
     };
     
     class SLR_API ConstantFloatTexture : public FloatTexture {
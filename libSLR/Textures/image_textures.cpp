@@ -18,6 +18,12 @@ namespace SLR {
         v += v < 0 ? 1.0f : 0.0f;
         uint32_t px = std::min((uint32_t)(m_data->width() * u), m_data->width() - 1);
         uint32_t py = std::min((uint32_t)(m_data->height() * v), m_data->height() - 1);
+#ifdef Use_Spectral_Representation
+        if (m_coefficients) {
+            const SpectralCoefficients &coeffs = m_coefficients[m_data->width() * py + px];
+            return UpsampledContinuousSpectrum::evaluateCoefficients(coeffs.indices, coeffs.weights, wls);
+        }
+#endif
         SampledSpectrum ret;
         switch (m_data->format()) {
 #ifdef Use_Spectral_Representation
@@ -78,11 +84,48 @@ namespace SLR {
         return ret;
     }
     
-    RegularConstantContinuous2D* ImageSpectrumTexture::createIBLImportanceMap() const {
-        uint32_t mapWidth = m_data->width() / 4;
-        uint32_t mapHeight = m_data->height() / 4;
-        float deltaX = m_data->width() / mapWidth;
-        float deltaY = m_data->height() / mapHeight;
+    void ImageSpectrumTexture::cacheSpectralCoefficients() const {
+#ifdef Use_Spectral_Representation
+        if (m_coefficients)
+            return;
+        ColorFormat format = m_data->format();
+        if (format != ColorFormat::uvs16Fx3 && format != ColorFormat::uvsA16Fx4)
+            return;
+        
+        uint32_t width = m_data->width();
+        uint32_t height = m_data->height();
+        m_coefficients = new SpectralCoefficients[width * height];
+        for (int py = 0; py < height; ++py) {
+            for (int px = 0; px < width; ++px) {
+                float u, v, s;
+                if (format == ColorFormat::uvs16Fx3) {
+                    const uvs16Fx3 &data = m_data->get<uvs16Fx3>(px, py);
+                    u = data.u;
+                    v = data.v;
+                    s = data.s;
+                }
+                else {
+                    const uvsA16Fx4 &data = m_data->get<uvsA16Fx4>(px, py);
+                    u = data.u;
+                    v = data.v;
+                    s = data.s;
+                }
+                SpectralCoefficients &coeffs = m_coefficients[width * py + px];
+                UpsampledContinuousSpectrum(u, v, s / Upsampling::EqualEnergyReflectance).computeCoefficients(coeffs.indices, coeffs.weights);
+            }
+        }
+#endif
+    }
+    
+    // The importance map is a power-of-two pyramid about half the resolution of the image,
+    // so a large environment map doesn't need a CDF for every row.
+    Continuous2DDistribution* ImageSpectrumTexture::createIBLImportanceMap() const {
+        cacheSpectralCoefficients();
+        
+        uint32_t mapWidth = prevPowerOf2(std::max(m_data->width() / 2, 1u));
+        uint32_t mapHeight = prevPowerOf2(std::max(m_data->height() / 2, 1u));
+        float deltaX = (float)m_data->width() / mapWidth;
+        float deltaY = (float)m_data->height() / mapHeight;
         std::function<float(uint32_t, uint32_t)> pickFunc = [this, &deltaX, &deltaY, &mapHeight](uint32_t x, uint32_t y) -> float {
             uint8_t data[16];
             m_data->areaAverage(x * deltaX, (x + 1) * deltaX, y * deltaY, (y + 1) * deltaY, data);
@@ -130,7 +173,7 @@ namespace SLR {
             SLRAssert(!std::isnan(luminance) && !std::isinf(luminance), "Invalid area average value.");
             return std::sin(M_PI * (y + 0.5f) / mapHeight) * luminance;
         };
-        return new RegularConstantContinuous2D(mapWidth, mapHeight, pickFunc);
+        return new HierarchicalConstantContinuous2D(mapWidth, mapHeight, pickFunc);
     }
     
     Normal3D ImageNormal3DTexture::evaluate(const SurfacePoint &surfPt) const {
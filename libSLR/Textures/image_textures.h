@@ -14,14 +14,27 @@
 
 namespace SLR {
     class SLR_API ImageSpectrumTexture : public SpectrumTexture {
+        struct SpectralCoefficients {
+            uint8_t indices[4];
+            float weights[4];
+        };
+        
         const TiledImage2D* m_data;
         const Texture2DMapping* m_mapping;
+        // per-texel upsampled spectra resolved in advance, built when the texture is used as an environment map
+        // whose texels are looked up far more often than the others'.
+        mutable SpectralCoefficients* m_coefficients;
+        
+        void cacheSpectralCoefficients() const;
     public:
         ImageSpectrumTexture(const TiledImage2D* image, const Texture2DMapping* mapping) :
-        m_data(image), m_mapping(mapping) { }
+        m_data(image), m_mapping(mapping), m_coefficients(nullptr) { }
+        ~ImageSpectrumTexture() {
+            delete[] m_coefficients;
+        }
         
         SampledSpectrum evaluate(const SurfacePoint &surfPt, const WavelengthSamples &wls) const override;
-        RegularConstantContinuous2D* createIBLImportanceMap() const override;
+        Continuous2DDistribution* createIBLImportanceMap() const override;
     };
     
     class SLR_API ImageNormal3DTexture : public Normal3DTexture {
@@ -82,7 +82,7 @@ namespace SLR {
 #endif
     }
     
-    RegularConstantContinuous2D* VoronoiSpectrumTexture::createIBLImportanceMap() const {
+    Continuous2DDistribution* VoronoiSpectrumTexture::createIBLImportanceMap() const {
         SLRAssert_NotImplemented();
         return nullptr;
     }
@@ -25,7 +25,7 @@ namespace SLR {
         m_mapping(mapping), m_scale(scale), m_brightness(brightness) { }
         
         SampledSpectrum evaluate(const SurfacePoint &surfPt, const WavelengthSamples &wls) const override;
-        RegularConstantContinuous2D* createIBLImportanceMap() const override;
+        Continuous2DDistribution* createIBLImportanceMap() const override;
     };
     
     class SLR_API VoronoiNormal3DTexture : public Normal3DTexture {
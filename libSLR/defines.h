@@ -81,9 +81,19 @@ SLR_API void debugPrintf(const char* fmt, ...);
 #   define SLRAssert(expr, fmt, ...)
 #endif
 
+// checked also in release builds, for a bound whose violation would corrupt memory.
+#define SLRRequire(expr, fmt, ...) do { if (!(expr)) { debugPrintf("%s @%s: %u:\n", #expr, __FILE__, __LINE__); debugPrintf(fmt"\n", ##__VA_ARGS__); abort(); } } while (0)
+
 #define SLRAssert_NotDefined() SLRAssert(false, "Not defined!")
 #define SLRAssert_NotImplemented() SLRAssert(false, "Not implemented!")
 
+// For functions using instruction sets beyond the compiler's baseline, called after a runtime CPU check.
+#if defined(SLR_Defs_MSVC)
+#   define SLR_TARGET_AVX2
+#else
+#   define SLR_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
 #define SLR_Minimum_Machine_Alignment 16
 #define SLR_L1_Cacheline_Size 64
 
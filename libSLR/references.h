@@ -98,10 +98,14 @@ namespace SLR {
     // Distributions
     template <typename RealType> class RegularConstantDiscrete1DTemplate;
     template <typename RealType> class RegularConstantContinuous1DTemplate;
+    template <typename RealType> class Continuous2DDistributionTemplate;
     template <typename RealType> class RegularConstantContinuous2DTemplate;
+    template <typename RealType> class HierarchicalConstantContinuous2DTemplate;
     typedef RegularConstantDiscrete1DTemplate<float> RegularConstantDiscrete1D;
     typedef RegularConstantContinuous1DTemplate<float> RegularConstantContinuous1D;
+    typedef Continuous2DDistributionTemplate<float> Continuous2DDistribution;
     typedef RegularConstantContinuous2DTemplate<float> RegularConstantContinuous2D;
+    typedef HierarchicalConstantContinuous2DTemplate<float> HierarchicalConstantContinuous2D;
     
     // Image & Tiled Image
     class Image2D;
@@ -123,6 +127,9 @@ namespace SLR {
     // Surface Objects
     class SurfaceObject;
     class SingleSurfaceObject;
+    class TriangleSurfaceObject;
+    struct TriangleMeshMaterialGroup;
+    class TriangleMeshSurfaceObject;
     class InfiniteSphereSurfaceObject;
     class SurfaceObjectAggregate;
     class TransformedSurfaceObject;
@@ -146,14 +153,25 @@ namespace SLR {
     
     // Surfaces
     class Surface;
+    struct TriangleConstants;
     class Triangle;
     class InfiniteSphere;
     
     // Accelerators
+    enum class AcceleratorType {
+        Auto = 0,
+        StandardBVH,
+        SBVH,
+        QBVH,
+        OBVH,
+        MotionBVH,
+    };
     class Accelerator;
     class BBVH;
     class SBVH;
     class QBVH;
+    class OBVH;
+    class MotionBVH;
     
     // Textures & Mapping
     class Texture2DMapping;
@@ -237,10 +255,12 @@ namespace SLR {
     
     class RenderSettings;
     class Renderer;
+    class TileScheduler;
     
     // Renderers
     class PathTracingRenderer;
     class BidirectionalPathTracingRenderer;
+    class WavefrontPathTracingRenderer;
     class AMCMCPPMRenderer;
 }
 
@@ -16,6 +16,7 @@
 #include <libSLR/Renderers/DebugRenderer.h>
 #include <libSLR/Renderers/PathTracingRenderer.h>
 #include <libSLR/Renderers/BidirectionalPathTracingRenderer.h>
+#include <libSLR/Renderers/WavefrontPathTracingRenderer.h>
 
 #include "Parser/BuiltinFunctions/builtin_math.hpp"
 #include "Parser/BuiltinFunctions/builtin_transform.hpp"
@@ -739,6 +740,10 @@ namespace SLRSceneGraph {
                              [](const std::map<std::string, Element> &args, ExecuteContext &context, ErrorMessage* err) {
                                  NodeRef node = args.at("src").rawRef<TypeMap::Node>();
                                  InternalNodeRef copied = std::dynamic_pointer_cast<InternalNode>(node->copy());
+                                 if (!copied) {
+                                     *err = ErrorMessage("Failed to copy the node.");
+                                     return Element();
+                                 }
                                  return Element(TypeMap::Node(), copied);
                              })
                     );
@@ -946,7 +951,15 @@ namespace SLRSceneGraph {
                                  RenderingData buildData;
                                  SLR::ArenaAllocator mem;
                                  node->getRenderingData(mem, nullptr, &buildData);
+                                 if (buildData.failed) {
+                                     *err = ErrorMessage("The node can't be built for scattering.");
+                                     return Element();
+                                 }
                                  auto aggregate = createUnique<SurfaceObjectAggregate>(buildData.surfObjs);
+                                 if (aggregate->instancingDepth() > SLR::MaxInstancingDepth) {
+                                     *err = ErrorMessage("Instancing is nested %u levels deep, it must be at most %u levels.", aggregate->instancingDepth(), SLR::MaxInstancingDepth);
+                                     return Element();
+                                 }
                                  
                                  SLR::BoundingBox3D bounds = aggregate->bounds();
                                  for (int i = 0; i < numY; ++i) {
@@ -1014,10 +1027,16 @@ namespace SLRSceneGraph {
                                  const ParameterList &config = args.at("config").raw<TypeMap::Tuple>();
                                  if (method == "PT") {
                                      const static Function configPT{
-                                         0, {{"samples", Type::Integer, Element(8)}},
+                                         0, {
+                                             {"samples", Type::Integer, Element(8)},
+                                             {"targetError", Type::RealNumber, Element(0.0)},
+                                             {"timeLimit", Type::RealNumber, Element(0.0)}
+                                         },
                                          [](const std::map<std::string, Element> &args, ExecuteContext &context, ErrorMessage* err) {
                                              uint32_t spp = args.at("samples").raw<TypeMap::Integer>();
-                                             context.renderingContext->renderer = createUnique<SLR::PathTracingRenderer>(spp);
+                                             float targetError = args.at("targetError").raw<TypeMap::RealNumber>();
+                                             float timeLimit = args.at("timeLimit").raw<TypeMap::RealNumber>();
+                                             context.renderingContext->renderer = createUnique<SLR::PathTracingRenderer>(spp, targetError, timeLimit);
                                              return Element();
                                          }
                                      };
@@ -1034,6 +1053,21 @@ namespace SLRSceneGraph {
                                      };
                                      return configBPT(config, context, err);
                                  }
+                                 else if (method == "WPT") {
+                                     const static Function configWPT{
+                                         0, {
+                                             {"samples", Type::Integer, Element(8)},
+                                             {"wavefrontSize", Type::Integer, Element(2048)}
+                                         },
+                                         [](const std::map<std::string, Element> &args, ExecuteContext &context, ErrorMessage* err) {
+                                             uint32_t spp = args.at("samples").raw<TypeMap::Integer>();
+                                             uint32_t wavefrontSize = args.at("wavefrontSize").raw<TypeMap::Integer>();
+                                             context.renderingContext->renderer = createUnique<SLR::WavefrontPathTracingRenderer>(spp, wavefrontSize);
+                                             return Element();
+                                         }
+                                     };
+                                     return configWPT(config, context, err);
+                                 }
                                  else if (method == "debug") {
                                      const static Function configDebug{
                                          0, {{"outputs", Type::Tuple}},
@@ -1088,6 +1122,63 @@ namespace SLRSceneGraph {
                                  renderCtx->brightness = args.at("brightness").raw<TypeMap::RealNumber>();
                                  renderCtx->rngSeed = args.at("rngSeed").raw<TypeMap::Integer>();
                                  
+                                 return Element();
+                             })
+                    );
+            stack["setAccelerator"] =
+            Element(TypeMap::Function(),
+                    Function(1,
+                             {
+                                 {"topLevel", Type::String, Element(TypeMap::String(), "auto")},
+                                 {"instance", Type::String, Element(TypeMap::String(), "auto")},
+                                 {"cacheDirectory", Type::String, Element(TypeMap::String(), "")}
+                             },
+                             [](const std::map<std::string, Element> &args, ExecuteContext &context, ErrorMessage* err) {
+                                 auto getAcceleratorType = [](const std::string &name, SLR::AcceleratorType* type) {
+                                     if (name == "auto")
+                                         *type = SLR::AcceleratorType::Auto;
+                                     else if (name == "BVH")
+                                         *type = SLR::AcceleratorType::StandardBVH;
+                                     else if (name == "SBVH")
+                                         *type = SLR::AcceleratorType::SBVH;
+                                     else if (name == "QBVH")
+                                         *type = SLR::AcceleratorType::QBVH;
+                                     else if (name == "OBVH")
+                                         *type = SLR::AcceleratorType::OBVH;
+                                     else if (name == "MotionBVH")
+                                         *type = SLR::AcceleratorType::MotionBVH;
+                                     else
+                                         return false;
+                                     return true;
+                                 };
+                                 
+                                 RenderingContext* renderCtx = context.renderingContext;
+                                 if (!getAcceleratorType(args.at("topLevel").raw<TypeMap::String>(), &renderCtx->topLevelAccelerator) ||
+                                     !getAcceleratorType(args.at("instance").raw<TypeMap::String>(), &renderCtx->instanceAccelerator))
+                                     *err = ErrorMessage("Unknown accelerator is specified.");
+                                 // a relative path is resolved against the directory of the scene file.
+                                 std::string cacheDir = args.at("cacheDirectory").raw<TypeMap::String>();
+                                 if (!cacheDir.empty() && cacheDir[0] != '/')
+                                     cacheDir = context.absFileDirPath + cacheDir;
+                                 renderCtx->acceleratorCacheDirectory = cacheDir;
+                                 
+                                 return Element();
+                             })
+                    );
+            stack["setVertexFormat"] =
+            Element(TypeMap::Function(),
+                    Function(1,
+                             {{"format", Type::String, Element(TypeMap::String(), "full")}},
+                             [](const std::map<std::string, Element> &args, ExecuteContext &context, ErrorMessage* err) {
+                                 std::string format = args.at("format").raw<TypeMap::String>();
+                                 RenderingContext* renderCtx = context.renderingContext;
+                                 if (format == "full")
+                                     renderCtx->compactVertices = false;
+                                 else if (format == "compact")
+                                     renderCtx->compactVertices = true;
+                                 else
+                                     *err = ErrorMessage("Unknown vertex format is specified.");
+                                 
                                  return Element();
                              })
                     );
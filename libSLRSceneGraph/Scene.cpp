@@ -14,6 +14,8 @@
 #include "InfiniteSphereNode.h"
 
 #include <libSLR/Core/Renderer.h>
+#include <libSLR/Core/RenderSettings.h>
+#include <libSLR/Core/Accelerator.h>
 
 namespace SLRSceneGraph {
     Scene::Scene() : m_envNode(nullptr) {
@@ -25,12 +27,24 @@ namespace SLRSceneGraph {
     
     Scene::~Scene() {}
     
-    void Scene::build(const SLR::Scene** scene, SLR::ArenaAllocator &mem) {
+    bool Scene::build(const SLR::Scene** scene, const SLR::RenderSettings &settings, SLR::ArenaAllocator &mem) {
+        SLR::Accelerator::setCacheDirectory(settings.getString(SLR::RenderSettingItem::AcceleratorCacheDirectory));
+        SLR::Accelerator::setTimeInterval(settings.getFloat(SLR::RenderSettingItem::TimeStart), settings.getFloat(SLR::RenderSettingItem::TimeEnd));
+        SLR::TriangleMeshSurfaceObject::setUseCompactVertices(settings.getBool(SLR::RenderSettingItem::CompactVertices));
+        
         RenderingData renderingData;
+        renderingData.instanceAccelerator = (SLR::AcceleratorType)settings.getInt(SLR::RenderSettingItem::InstanceAccelerator);
         m_rootNode->getRenderingData(mem, nullptr, &renderingData);
+        if (renderingData.failed)
+            return false;
         SLRAssert(renderingData.camera != nullptr, "Camera is not set.");
         
-        SLR::SurfaceObjectAggregate* aggregate = mem.create<SLR::SurfaceObjectAggregate>(renderingData.surfObjs);
+        SLR::AcceleratorType topLevelAccelerator = (SLR::AcceleratorType)settings.getInt(SLR::RenderSettingItem::TopLevelAccelerator);
+        SLR::SurfaceObjectAggregate* aggregate = mem.create<SLR::SurfaceObjectAggregate>(renderingData.surfObjs, topLevelAccelerator);
+        if (aggregate->instancingDepth() > SLR::MaxInstancingDepth) {
+            printf("Instancing is nested %u levels deep, it must be at most %u levels.\n", aggregate->instancingDepth(), SLR::MaxInstancingDepth);
+            return false;
+        }
         SLR::InfiniteSphereSurfaceObject* envSphere = m_envNode ? m_envNode->getSurfaceObject() : nullptr;
         
         SLR::Camera* camera = renderingData.camera;
@@ -38,9 +52,11 @@ namespace SLRSceneGraph {
         m_raw->build(aggregate, envSphere, camera);
         
         *scene = m_raw.get();
+        return true;
     }
     
-    RenderingContext::RenderingContext() {
+    RenderingContext::RenderingContext() :
+    topLevelAccelerator(SLR::AcceleratorType::Auto), instanceAccelerator(SLR::AcceleratorType::Auto), compactVertices(false) {
         
     }
     
@@ -56,6 +72,10 @@ namespace SLRSceneGraph {
         timeEnd = ctx.timeEnd;
         brightness = ctx.brightness;
         rngSeed = ctx.rngSeed;
+        topLevelAccelerator = ctx.topLevelAccelerator;
+        instanceAccelerator = ctx.instanceAccelerator;
+        acceleratorCacheDirectory = ctx.acceleratorCacheDirectory;
+        compactVertices = ctx.compactVertices;
         
         return *this;
     }
@@ -23,7 +23,8 @@ namespace SLRSceneGraph {
         InternalNodeRef &rootNode() { return m_rootNode; };
         void setEnvNode(const InfiniteSphereNodeRef &node) { m_envNode = node; };
         
-        void build(const SLR::Scene** scene, SLR::ArenaAllocator &mem);
+        // fails if the scene is not renderable, e.g. instancing is nested too deep.
+        bool build(const SLR::Scene** scene, const SLR::RenderSettings &settings, SLR::ArenaAllocator &mem);
         
         const SLR::Scene* raw() const { return m_raw.get(); }
     };
@@ -36,6 +37,10 @@ namespace SLRSceneGraph {
         float timeEnd;
         float brightness;
         int32_t rngSeed;
+        SLR::AcceleratorType topLevelAccelerator;
+        SLR::AcceleratorType instanceAccelerator;
+        std::string acceleratorCacheDirectory;
+        bool compactVertices;
         
         RenderingContext();
         ~RenderingContext();
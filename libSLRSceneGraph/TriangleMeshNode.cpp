@@ -14,19 +14,19 @@
 
 namespace SLRSceneGraph {
     TriangleMeshNode::~TriangleMeshNode() {
-        if (m_trianglesForRendering)
-            delete[] m_trianglesForRendering;
-        if (m_verticesForRendering)
-            delete[] m_verticesForRendering;
+        if (m_meshForRendering)
+            delete m_meshForRendering;
     }
-
+    
     uint64_t TriangleMeshNode::addVertex(const SLR::Vertex &v) {
+        SLRRequire(!m_ready, "The mesh can't be edited after its surface objects are created.");
         m_vertices.push_back(v);
         return m_vertices.size() - 1;
     }
     
     void TriangleMeshNode::addTriangles(const SurfaceMaterialRef &mat, const Normal3DTextureRef &normalMap, const FloatTextureRef &alphaMap,
                                         const std::vector<Triangle> &&triangles) {
+        SLRRequire(!m_ready, "The mesh can't be edited after its surface objects are created.");
         m_matGroups.emplace_back();
         MaterialGroup &matGroup = m_matGroups.back();
         matGroup.material = mat;
@@ -50,6 +50,11 @@ namespace SLRSceneGraph {
     }
     
     NodeRef TriangleMeshNode::copy() const {
+        // the node no longer has its vertices.
+        if (m_ready) {
+            printf("The mesh can't be copied after its surface objects are created.\n");
+            return nullptr;
+        }
         TriangleMeshNodeRef ret = createShared<TriangleMeshNode>();
         ret->m_vertices = m_vertices;
         ret->m_matGroups = m_matGroups;
@@ -57,6 +62,10 @@ namespace SLRSceneGraph {
     }
     
     void TriangleMeshNode::applyTransform(const SLR::StaticTransform &t) {
+        if (m_ready) {
+            printf("The mesh can't be transformed after its surface objects are created.\n");
+            return;
+        }
         for (int i = 0; i < m_vertices.size(); ++i) {
             Vertex &v = m_vertices[i];
             v.position = t * v.position;
@@ -65,16 +74,19 @@ namespace SLRSceneGraph {
         }
     }
     
-    void TriangleMeshNode::applyTransformForRendering(const SLR::StaticTransform &tf) {
+    bool TriangleMeshNode::applyTransformForRendering(const SLR::StaticTransform &tf) {
         SLRAssert(m_ready, "createSurfaceObjects() must be called before this function.");
-        for (int i = 0; i < m_vertices.size(); ++i) {
-            Vertex &v = m_vertices[i];
-            Vertex &vR = m_verticesForRendering[i];
-            vR.position = tf * v.position;
-            vR.normal = normalize(tf * v.normal);
-            vR.tangent = normalize(tf * v.tangent);
-            vR.texCoord = v.texCoord;
+        if (tf == m_transformForRendering)
+            return true;
+        // The mesh is transformed from its source vertices only once, re-transforming would accumulate errors.
+        if (m_transformApplied) {
+            printf("The mesh can't be rendered with different transforms, use a reference node to instance it.\n");
+            return false;
         }
+        m_meshForRendering->applyTransform(tf);
+        m_transformForRendering = tf;
+        m_transformApplied = true;
+        return true;
     }
     
     void TriangleMeshNode::createSurfaceObjects() {
@@ -82,32 +94,38 @@ namespace SLRSceneGraph {
         for (const MaterialGroup &matGroup : m_matGroups)
             m_numRefinedObjs += matGroup.triangles.size();
         
-        m_refinedObjs = new SLR::SingleSurfaceObject*[m_numRefinedObjs];
-        m_trianglesForRendering = new SLR::Triangle[m_numRefinedObjs];
-        m_verticesForRendering = new Vertex[m_vertices.size()];
+        std::vector<SLR::TriangleMeshMaterialGroup> matGroupsR(m_matGroups.size());
+        std::vector<uint32_t> indices(3 * m_numRefinedObjs);
+        std::vector<uint16_t> matIndices(m_numRefinedObjs);
+        SLRAssert(m_matGroups.size() <= UINT16_MAX + 1, "Too many material groups in a mesh.");
         
         uint32_t triIdxBase = 0;
-        for (const MaterialGroup &matGroup : m_matGroups) {
-            const SLR::SurfaceMaterial* mat = matGroup.material->getRaw();
-            const SLR::Normal3DTexture* normalMap = nullptr;
-            const SLR::FloatTexture* alphaMap = nullptr;
-            if (matGroup.normalMap)
-                normalMap = matGroup.normalMap->getRaw();
-            if (matGroup.alphaMap)
-                alphaMap = matGroup.alphaMap->getRaw();
+        for (int mIdx = 0; mIdx < m_matGroups.size(); ++mIdx) {
+            const MaterialGroup &matGroup = m_matGroups[mIdx];
+            SLR::TriangleMeshMaterialGroup &matGroupR = matGroupsR[mIdx];
+            matGroupR.material = matGroup.material->getRaw();
+            matGroupR.normalMap = matGroup.normalMap ? matGroup.normalMap->getRaw() : nullptr;
+            matGroupR.alphaTexture = matGroup.alphaMap ? matGroup.alphaMap->getRaw() : nullptr;
             
             for (int tIdx = 0; tIdx < matGroup.triangles.size(); ++tIdx) {
                 const Triangle &tri = matGroup.triangles[tIdx];
-                
                 uint32_t trIdx = triIdxBase + tIdx;
-                SLR::Triangle &triR = m_trianglesForRendering[trIdx];
-                new (&triR) SLR::Triangle(&m_verticesForRendering[tri.vIdx[0]], &m_verticesForRendering[tri.vIdx[1]], &m_verticesForRendering[tri.vIdx[2]], alphaMap);
-                if (normalMap)
-                    m_refinedObjs[trIdx] = new SLR::BumpSingleSurfaceObject(&triR, mat, normalMap);
-                else
-                    m_refinedObjs[trIdx] = new SLR::SingleSurfaceObject(&triR, mat);
+                indices[3 * trIdx + 0] = (uint32_t)tri.vIdx[0];
+                indices[3 * trIdx + 1] = (uint32_t)tri.vIdx[1];
+                indices[3 * trIdx + 2] = (uint32_t)tri.vIdx[2];
+                matIndices[trIdx] = mIdx;
             }
             triIdxBase += matGroup.triangles.size();
         }
+        
+        m_meshForRendering = new SLR::TriangleMeshSurfaceObject(std::move(m_vertices), std::move(indices), std::move(matIndices), matGroupsR);
+        m_transformForRendering = SLR::StaticTransform();
+        m_transformApplied = false;
+        std::vector<Vertex>().swap(m_vertices);
+        for (MaterialGroup &matGroup : m_matGroups)
+            std::vector<Triangle>().swap(matGroup.triangles);
+        m_refinedObjs = new SLR::SurfaceObject*[m_numRefinedObjs];
+        for (int i = 0; i < m_numRefinedObjs; ++i)
+            m_refinedObjs[i] = m_meshForRendering->triangle(i);
     }
 }
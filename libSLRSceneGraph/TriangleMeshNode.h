@@ -12,6 +12,7 @@
 #include "references.h"
 #include "nodes.h"
 #include <libSLR/Core/geometry.h>
+#include <libSLR/Core/Transform.h>
 
 namespace SLRSceneGraph {
     // There is a possibility to define a unique vertex format suitable for editing.
@@ -33,13 +34,15 @@ namespace SLRSceneGraph {
             std::vector<Triangle> triangles;
         };
     private:
-        SLR::Triangle* m_trianglesForRendering;
-        Vertex* m_verticesForRendering;
+        SLR::TriangleMeshSurfaceObject* m_meshForRendering;
+        SLR::StaticTransform m_transformForRendering;
+        bool m_transformApplied;
         
+        // released once the mesh for rendering is created, the mesh is transformed in place afterward.
         std::vector<Vertex> m_vertices;
         std::vector<MaterialGroup> m_matGroups;
     public:
-        TriangleMeshNode() : SurfaceObjectNode(), m_trianglesForRendering(nullptr), m_verticesForRendering(nullptr) { }
+        TriangleMeshNode() : SurfaceObjectNode(), m_meshForRendering(nullptr), m_transformApplied(false) { }
         ~TriangleMeshNode();
         
         uint64_t addVertex(const SLR::Vertex &v);
@@ -49,7 +52,7 @@ namespace SLRSceneGraph {
         
         void applyTransform(const SLR::StaticTransform &t) final;
         
-        void applyTransformForRendering(const SLR::StaticTransform &tf) override;
+        bool applyTransformForRendering(const SLR::StaticTransform &tf) override;
         void createSurfaceObjects() final;
     };
 }
@@ -71,6 +71,8 @@ namespace SLRSceneGraph {
         ret->m_localToWorld = TransformRef(m_localToWorld->copy());
         for (int i = 0; i < m_childNodes.size(); ++i) {
             NodeRef c = m_childNodes[i]->copy();
+            if (!c)
+                return nullptr;
             ret->m_childNodes.push_back(c);
         }
         return ret;
@@ -120,10 +122,12 @@ namespace SLRSceneGraph {
         }
         else {
             RenderingData subData;
+            subData.instanceAccelerator = data->instanceAccelerator;
             for (int i = 0; i < m_childNodes.size(); ++i)
                 m_childNodes[i]->getRenderingData(mem, nullptr, &subData);
+            data->failed |= subData.failed;
             if (subData.surfObjs.size() > 1) {
-                SLR::SurfaceObjectAggregate* aggr = mem.create<SLR::SurfaceObjectAggregate>(subData.surfObjs);
+                SLR::SurfaceObjectAggregate* aggr = mem.create<SLR::SurfaceObjectAggregate>(subData.surfObjs, subData.instanceAccelerator);
                 reduced = SLR::ChainedTransform(subTF, m_localToWorld.get()).reduce(mem);// &m_localToWorld or m_localToWorld.copy(tfMem)?
                 SLR::TransformedSurfaceObject* tfobj = mem.create<SLR::TransformedSurfaceObject>(aggr, reduced);
                 data->surfObjs.push_back(tfobj);
@@ -144,8 +148,6 @@ namespace SLRSceneGraph {
     SurfaceObjectNode::~SurfaceObjectNode() {
         if (!m_ready)
             return;
-        for (int i = 0; i < m_numRefinedObjs; ++i)
-            delete m_refinedObjs[i];
         delete[] m_refinedObjs;
     }
     
@@ -162,10 +164,11 @@ namespace SLRSceneGraph {
             SLRAssert(subTF->isStatic(), "Transformation given to SurfaceObjectNode must be static.");
             subTF->sample(0.0f, &transform);
         }
-        // TODO: consider SingleSurfaceObject for which analytic transform is NOT applicable.
-        applyTransformForRendering(transform);
+        // TODO: consider SurfaceObject for which analytic transform is NOT applicable.
+        if (!applyTransformForRendering(transform))
+            data->failed = true;
         for (int i = 0; i < m_numRefinedObjs; ++i) {
-            SLR::SingleSurfaceObject* obj = m_refinedObjs[i];
+            SLR::SurfaceObject* obj = m_refinedObjs[i];
             data->surfObjs[curSize + i] = obj;
         }
     }
@@ -173,13 +176,15 @@ namespace SLRSceneGraph {
     
     void ReferenceNode::getRenderingData(SLR::ArenaAllocator &mem, const SLR::Transform* subTF, RenderingData *data) {
         if (!m_ready) {
+            m_subData.instanceAccelerator = data->instanceAccelerator;
             m_node->getRenderingData(mem, nullptr, &m_subData);
             if (m_subData.surfObjs.size() > 1)
-                m_surfObj = mem.create<SLR::SurfaceObjectAggregate>(m_subData.surfObjs);
+                m_surfObj = mem.create<SLR::SurfaceObjectAggregate>(m_subData.surfObjs, m_subData.instanceAccelerator);
             else
                 m_surfObj = m_subData.surfObjs[0];
             m_ready = true;
         }
+        data->failed |= m_subData.failed;
         data->surfObjs.push_back(mem.create<SLR::TransformedSurfaceObject>(m_surfObj, subTF));
     }
     
@@ -16,7 +16,10 @@ namespace SLRSceneGraph {
         std::vector<SLR::SurfaceObject*> surfObjs;
         SLR::Camera* camera;
         const SLR::Transform* camTransform;
-        RenderingData() : camera(nullptr), camTransform(nullptr) { }
+        SLR::AcceleratorType instanceAccelerator;
+        // set when a node can't provide its objects as requested, the node has printed the reason.
+        bool failed;
+        RenderingData() : camera(nullptr), camTransform(nullptr), instanceAccelerator(SLR::AcceleratorType::Auto), failed(false) { }
     };
     
     class SLR_SCENEGRAPH_API Node {
@@ -62,20 +65,21 @@ namespace SLRSceneGraph {
         void applyTransform() override;
         void applyTransform(const SLR::StaticTransform &tf) override;
         void applyTransformToLeaf(const SLR::StaticTransform &tf) override;
-
+        
         void getRenderingData(SLR::ArenaAllocator &mem, const SLR::Transform* subTF, RenderingData *data) override;
     };
     
     class SLR_SCENEGRAPH_API SurfaceObjectNode : public Node {
     protected:
         bool m_ready;
-        SLR::SingleSurfaceObject** m_refinedObjs;
+        // the objects themselves are owned by the derived node.
+        SLR::SurfaceObject** m_refinedObjs;
         size_t m_numRefinedObjs;
     public:
         SurfaceObjectNode() : m_ready(false) { }
         virtual ~SurfaceObjectNode();
         
-        virtual void applyTransformForRendering(const SLR::StaticTransform &tf) = 0;
+        virtual bool applyTransformForRendering(const SLR::StaticTransform &tf) = 0;
         virtual void createSurfaceObjects() = 0;
         void getRenderingData(SLR::ArenaAllocator &mem, const SLR::Transform* subTF, RenderingData *data) final;
     };
@@ -103,7 +107,7 @@ namespace SLRSceneGraph {
         virtual void createCamera() = 0;
         void getRenderingData(SLR::ArenaAllocator &mem, const SLR::Transform* subTF, RenderingData *data) final;
     };
-    
+
 }
 
 #endif